@@ -0,0 +1,467 @@
+// DHCP client shared by the network drivers
+
+#include <Arduino.h>
+#include "WSEvent.h"
+#include "MessageCoder.h"
+#include "NetDriver.h"
+#include "TxSink.h"
+#include "DHCP.h"
+
+// See http://tools.ietf.org/html/rfc2131 and rfc2132 for details
+
+static const uint8_t zero_ip[4] = {0, 0, 0, 0};
+static const char zeros[16] = {0};
+
+static void put_zeros(TxSink *sink, uint16_t n)
+{
+    while (n) {
+        uint8_t i = (n < sizeof(zeros) ? n : sizeof(zeros));
+        sink->put_bytes(zeros, i);
+        n -= i;
+    }
+}
+
+DHCP::DHCP()
+{
+    net = NULL;
+    events = NULL;
+    state = STATE_DHCP_IDLE;
+    memset(&timer, 0, sizeof(timer));
+}
+
+// s is the client's own UDP socket, the address is then acquired
+// in the background on a timer from queue, and Address_Changed_Event_t
+// is queued on it when the address is acquired or changes
+void DHCP::begin(NetDriver *driver, uint8_t s, EventQueue *queue)
+{
+    net = driver;
+    socket = s;
+    events = queue;
+    fall_back = false;
+    memset(&lease, 0, sizeof(lease));
+
+    // transaction ids should differ between devices and restarts
+    xid = ((uint32_t)random(0x7FFF) << 16) ^ micros();
+
+    Serial.println(F("running DHCP client"));
+    net->open_udp(socket, DHCP_CLIENT_PORT, 0);
+    discover();
+    reschedule();
+}
+
+bool DHCP::is_bound()
+{
+    return state == STATE_DHCP_LEASED || state == STATE_DHCP_REREQUEST;
+}
+
+void DHCP::on_timer(void *data)
+{
+    ((DHCP *)data)->run();
+}
+
+// retransmits and renews the lease as they fall due
+void DHCP::run()
+{
+    unsigned long now = millis();
+
+    if (state == STATE_DHCP_IDLE || state == STATE_DHCP_RELEASE)
+        return;
+
+    // count whole seconds as the lease may outlast millis()
+    while (now - tick_at >= 1000) {
+        tick_at += 1000;
+        ++elapsed;
+    }
+
+    if (state == STATE_DHCP_LEASED) {
+        if (elapsed >= lease.t1) {
+            Serial.println(F("renewing DHCP lease"));
+            state = STATE_DHCP_REREQUEST;
+            retries = 0;
+            rto = DHCP_INITIAL_RTO;
+            send_message(DHCP_REQUEST);
+        }
+    } else if (state == STATE_DHCP_REREQUEST && elapsed >= lease.lease_time) {
+        Serial.println(F("DHCP lease expired"));
+        unbind();
+        discover();
+    } else if (now - sent_at >= timeout) {
+        retransmit();
+    }
+
+    reschedule();
+}
+
+// sets the timer for the next retransmission, or for T1 or the end
+// of the lease, whichever is first
+void DHCP::reschedule()
+{
+    unsigned long now = millis();
+    unsigned long wait = TIMER_NONE;
+
+    if (state == STATE_DHCP_IDLE || state == STATE_DHCP_RELEASE) {
+        events->cancel_timer(&timer);
+        return;
+    }
+
+    if (is_bound()) {
+        uint32_t end = (state == STATE_DHCP_LEASED ? lease.t1 : lease.lease_time);
+        uint32_t seconds = (end > elapsed ? end - elapsed : 0);
+
+        if (seconds > DHCP_MAX_WAIT)
+            seconds = DHCP_MAX_WAIT;
+
+        wait = seconds * 1000;
+        wait = (wait > now - tick_at ? wait - (now - tick_at) : 0);
+    }
+
+    if (state != STATE_DHCP_LEASED) {
+        unsigned long retry = (now - sent_at < timeout ? timeout - (now - sent_at) : 0);
+
+        if (retry < wait)
+            wait = retry;
+    }
+
+    events->start_timer(&timer, wait, 0, on_timer, this);
+}
+
+// starts a new transaction by broadcasting DHCPDISCOVER
+void DHCP::discover()
+{
+    state = STATE_DHCP_DISCOVER;
+    retries = 0;
+    rto = DHCP_INITIAL_RTO;
+    ++xid;
+    send_message(DHCP_DISCOVER);
+}
+
+// asks for the address offered by the server
+void DHCP::request()
+{
+    state = STATE_DHCP_REQUEST;
+    retries = 0;
+    rto = DHCP_INITIAL_RTO;
+    send_message(DHCP_REQUEST);
+}
+
+void DHCP::retransmit()
+{
+    rto = (rto < DHCP_MAX_RTO / 2 ? 2 * rto : DHCP_MAX_RTO);
+    ++retries;
+
+    if (state == STATE_DHCP_DISCOVER) {
+        if (retries == MAX_DHCP_RETRY && !fall_back) {
+            // Couldn't get an IP address so use defaults
+            // whilst carrying on in the background
+            const uint8_t ip[4] = {192, 168, 1, 25};
+            const uint8_t subnet[4] = {255, 255, 255, 0};
+            const uint8_t gateway[4] = {192, 168, 1, 254};
+
+            Serial.println(F("Using default network configuration as fall back"));
+            net->configure(NetDriver::default_mac, ip, subnet, gateway);
+            fall_back = true;
+
+            // so discovery starts on the default address
+            events->enqueue(Address_Changed_Event_t, NULL);
+        }
+
+        send_message(DHCP_DISCOVER);
+    } else if (state == STATE_DHCP_REQUEST && retries >= MAX_DHCP_RETRY) {
+        // the offer has lapsed
+        discover();
+    } else {
+        send_message(DHCP_REQUEST);
+    }
+}
+
+// streams the message straight into the TX buffer, it is broadcast
+// unless the lease is being renewed, i.e. before T2, or released
+void DHCP::send_message(uint8_t type)
+{
+    static const char host_name[] = HOST_NAME;
+    bool has_ip = (state == STATE_DHCP_REREQUEST || type == DHCP_RELEASE);
+    bool unicast = (type == DHCP_RELEASE ||
+                    (state == STATE_DHCP_REREQUEST && elapsed < lease.t2));
+    const uint8_t *ciaddr = (has_ip ? lease.ip : zero_ip);
+    uint8_t options[64];
+    uint8_t i = 0;
+    TxSink sink;
+
+    sent_at = millis();
+    timeout = rto + random(1000);
+
+    if (sink.begin(net, socket, DHCP_MIN_MESSAGE) < DHCP_MIN_MESSAGE)
+        return;  // try again when it times out
+
+    // op, htype, hlen, hops, xid, secs, flags and ciaddr
+    const uint8_t header[16] = {
+        DHCP_BOOTREQUEST, DHCP_HTYPE10MB, DHCP_HLENETHERNET, DHCP_HOPS,
+        (uint8_t)(xid >> 24), (uint8_t)(xid >> 16), (uint8_t)(xid >> 8), (uint8_t)xid,
+        0, DHCP_SECS, (uint8_t)(has_ip ? 0 : DHCP_FLAGSBROADCAST), 0,
+        ciaddr[0], ciaddr[1], ciaddr[2], ciaddr[3]
+    };
+
+    sink.put_bytes((const char *)header, sizeof(header));
+    put_zeros(&sink, 12);  // yiaddr, siaddr and giaddr
+    sink.put_bytes((const char *)NetDriver::default_mac, 6);
+    put_zeros(&sink, 10 + 64 + 128);  // the rest of chaddr, sname and file
+
+    // MAGIC_COOKIE IN NETWORK ORDER
+    options[i++] = (uint8_t)((MAGIC_COOKIE >> 24) & 0xFF);
+    options[i++] = (uint8_t)((MAGIC_COOKIE >> 16) & 0xFF);
+    options[i++] = (uint8_t)((MAGIC_COOKIE >> 8) & 0xFF);
+    options[i++] = (uint8_t)(MAGIC_COOKIE & 0xFF);
+
+    options[i++] = dhcpMessageType;
+    options[i++] = 0x01;
+    options[i++] = type;
+
+    // client identifier
+    options[i++] = dhcpClientIdentifier;
+    options[i++] = 0x07;
+    options[i++] = 0x01; // Ethernet (10Mb)
+    memcpy(options + i, NetDriver::default_mac, 6);
+    i += 6;
+
+    // the offered address, unless renewing or rebinding
+    if (state == STATE_DHCP_REQUEST) {
+        options[i++] = dhcpRequestedIPaddr;
+        options[i++] = 0x04;
+        memcpy(options + i, lease.ip, 4);
+        i += 4;
+    }
+
+    if (state == STATE_DHCP_REQUEST || type == DHCP_RELEASE) {
+        options[i++] = dhcpServerIdentifier;
+        options[i++] = 0x04;
+        memcpy(options + i, lease.server, 4);
+        i += 4;
+    }
+
+    if (type != DHCP_RELEASE) {
+        options[i++] = hostName;
+        options[i++] = sizeof(host_name) - 1;
+        memcpy(options + i, host_name, sizeof(host_name) - 1);
+        i += sizeof(host_name) - 1;
+
+        // parameter request list
+        options[i++] = dhcpParamRequest;
+        options[i++] = 0x05;
+        options[i++] = subnetMask;
+        options[i++] = routersOnSubnet;
+        options[i++] = dhcpIPaddrLeaseTime;
+        options[i++] = dhcpT1value;
+        options[i++] = dhcpT2value;
+    }
+
+    options[i++] = endOption;
+    sink.put_bytes((const char *)options, i);
+
+    // pad to the minimum BOOTP message size
+    put_zeros(&sink, DHCP_MIN_MESSAGE - sink.size());
+
+    if (unicast)
+        net->set_ip(socket, lease.server[0], lease.server[1],
+                    lease.server[2], lease.server[3]);
+    else
+        net->set_ip(socket, 255, 255, 255, 255);
+
+    net->set_port(socket, DHCP_SERVER_PORT);
+    sink.commit();
+}
+
+// handles the replies that have arrived, one datagram at a time
+void DHCP::readable()
+{
+    DHCPReply reply;
+
+    while (net->receive_available(socket)) {
+        uint8_t type = read_reply(&reply);
+        net->skip_datagram(socket);
+
+        if (state == STATE_DHCP_DISCOVER) {
+            if (type == DHCP_OFFER) {
+                Serial.println(F("got DHCP OFFER"));
+                lease = reply;
+                request();
+            }
+        } else if (state == STATE_DHCP_REQUEST || state == STATE_DHCP_REREQUEST) {
+            if (type == DHCP_ACK) {
+                bind(&reply);
+            } else if (type == DHCP_NAK) {
+                Serial.println(F("got DHCP NAK"));
+                unbind();
+                discover();
+            }
+        }
+    }
+
+    reschedule();
+}
+
+// parses the next datagram in place in the RX buffer, returns its
+// DHCP message type, or 0 if it isn't a reply to this client
+uint8_t DHCP::read_reply(DHCPReply *reply)
+{
+    uint8_t header[8];
+    uint8_t fields[offsetof(RIP_MSG, chaddr) + 6];
+    uint8_t cookie[4];
+    uint8_t option[6];
+    const uint8_t *value = option + 2;
+
+    memset(reply, 0, sizeof(DHCPReply));
+
+    if (net->peek(socket, 0, (char *)header, 8) != 8 ||
+        256 * header[4] + header[5] != DHCP_SERVER_PORT)
+        return 0;
+
+    // the offsets are from the start of the UDP header
+    uint16_t end = 8 + 256 * header[6] + header[7];
+    uint16_t offset = 8 + DHCP_OPTIONS_OFFSET;
+
+    if (end < offset ||
+        net->peek(socket, 8, (char *)fields, sizeof(fields)) != sizeof(fields) ||
+        net->peek(socket, offset - 4, (char *)cookie, 4) != 4)
+        return 0;
+
+    if (fields[offsetof(RIP_MSG, op)] != DHCP_BOOTREPLY ||
+        fields[4] != (uint8_t)(xid >> 24) || fields[5] != (uint8_t)(xid >> 16) ||
+        fields[6] != (uint8_t)(xid >> 8) || fields[7] != (uint8_t)xid ||
+        memcmp(fields + offsetof(RIP_MSG, chaddr), NetDriver::default_mac, 6) ||
+        cookie[0] != (uint8_t)(MAGIC_COOKIE >> 24) || cookie[1] != (uint8_t)(MAGIC_COOKIE >> 16) ||
+        cookie[2] != (uint8_t)(MAGIC_COOKIE >> 8) || cookie[3] != (uint8_t)MAGIC_COOKIE)
+        return 0;
+
+    memcpy(reply->ip, fields + offsetof(RIP_MSG, yiaddr), 4);
+
+    // each option is read with up to 4 bytes of its value
+    while (offset < end) {
+        uint16_t n = end - offset;
+
+        if (n > sizeof(option))
+            n = sizeof(option);
+
+        net->peek(socket, offset, (char *)option, n);
+
+        if (option[0] == padOption) {
+            ++offset;
+            continue;
+        }
+
+        if (option[0] == endOption || n < 2)
+            break;
+
+        uint8_t length = option[1];
+
+        if (n >= 2 + (length < 4 ? length : 4)) {
+            switch (option[0]) {
+                case dhcpMessageType:
+                    reply->type = value[0];
+                    break;
+
+                case subnetMask:
+                    if (length >= 4)
+                        memcpy(reply->subnet, value, 4);
+                    break;
+
+                case routersOnSubnet:
+                    if (length >= 4)
+                        memcpy(reply->gateway, value, 4);
+                    break;
+
+                case dhcpServerIdentifier:
+                    if (length >= 4)
+                        memcpy(reply->server, value, 4);
+                    break;
+
+                case dhcpIPaddrLeaseTime:
+                case dhcpT1value:
+                case dhcpT2value:
+                    if (length >= 4) {
+                        uint32_t seconds = value[0];
+                        seconds <<= 8; seconds |= value[1];
+                        seconds <<= 8; seconds |= value[2];
+                        seconds <<= 8; seconds |= value[3];
+
+                        if (option[0] == dhcpIPaddrLeaseTime)
+                            reply->lease_time = seconds;
+                        else if (option[0] == dhcpT1value)
+                            reply->t1 = seconds;
+                        else
+                            reply->t2 = seconds;
+                    }
+                    break;
+            }
+        }
+
+        offset += 2 + length;
+    }
+
+    return reply->type;
+}
+
+// configures the network with the acked lease and sets its timers
+void DHCP::bind(DHCPReply *reply)
+{
+    bool changed = !is_bound() || memcmp(reply->ip, lease.ip, 4) ||
+                   memcmp(reply->subnet, lease.subnet, 4) ||
+                   memcmp(reply->gateway, lease.gateway, 4);
+
+    if (!reply->server[0] && !reply->server[1] &&
+        !reply->server[2] && !reply->server[3])
+        memcpy(reply->server, lease.server, 4);
+
+    lease = *reply;
+
+    if (!lease.lease_time)
+        lease.lease_time = DHCP_INFINITE_LEASE;
+
+    // the defaults are 1/2 and 7/8 of the lease
+    if (!lease.t1 || lease.t1 > lease.lease_time)
+        lease.t1 = (lease.lease_time == DHCP_INFINITE_LEASE ?
+                    DHCP_INFINITE_LEASE : lease.lease_time / 2);
+
+    if (!lease.t2 || lease.t2 > lease.lease_time)
+        lease.t2 = (lease.lease_time == DHCP_INFINITE_LEASE ?
+                    DHCP_INFINITE_LEASE : lease.lease_time - lease.lease_time / 8);
+
+    state = STATE_DHCP_LEASED;
+    elapsed = 0;
+    tick_at = millis();
+    fall_back = false;
+
+    if (changed) {
+        net->configure(NetDriver::default_mac, lease.ip, lease.subnet, lease.gateway);
+        events->enqueue(Address_Changed_Event_t, NULL);
+        Serial.print(F("Got IP address via DHCP, "));
+        net->print_config();
+    }
+
+    Serial.print(F("DHCP lease = "));
+    Serial.print(lease.lease_time);
+    Serial.print(F("s, T1 = "));
+    Serial.print(lease.t1);
+    Serial.print(F("s, T2 = "));
+    Serial.print(lease.t2);
+    Serial.println(F("s"));
+}
+
+// stops using the address
+void DHCP::unbind()
+{
+    if (is_bound())
+        net->configure(NetDriver::default_mac, zero_ip, zero_ip, zero_ip);
+
+    fall_back = false;
+}
+
+// gives up the lease, e.g. before powering down, the address is
+// left configured so that the DHCPRELEASE can still be sent
+void DHCP::release()
+{
+    if (is_bound()) {
+        send_message(DHCP_RELEASE);
+        state = STATE_DHCP_RELEASE;
+        events->cancel_timer(&timer);
+    }
+}
@@ -2,20 +2,29 @@
    Basic DHCP client to configure device's local IP address
    With thanks to Nabeel Ahmad (nbl14@hotmail.com) who
    in turn adapted it from code by Wiznet
+
+   The client is a state machine driven by a timer on the event queue,
+   set for the next retransmission or the next of the lease's timers,
+   and by readable() when a reply arrives, so the device keeps serving
+   whilst it acquires and renews its lease, and nothing is polled in
+   between. Address_Changed_Event_t is queued when it has an address. It has its own UDP socket,
+   messages are streamed straight into the socket's TX buffer, and the
+   replies are parsed in place in the RX buffer, so the 548 byte DHCP
+   message is never held in RAM.
 */
 
 #ifndef _DHCP_H_
 #define _DHCP_H_
 
 // DHCP state machine
-#define	STATE_DHCP_DISCOVER 1
-#define	STATE_DHCP_REQUEST 2
-#define	STATE_DHCP_LEASED 3
-#define	STATE_DHCP_REREQUEST 4
-#define	STATE_DHCP_RELEASE 5
+#define STATE_DHCP_IDLE 0       // not started
+#define	STATE_DHCP_DISCOVER 1   // waiting for an offer
+#define	STATE_DHCP_REQUEST 2    // waiting for the offer to be acked
+#define	STATE_DHCP_LEASED 3     // bound until T1
+#define	STATE_DHCP_REREQUEST 4  // renewing from T1, rebinding from T2
+#define	STATE_DHCP_RELEASE 5    // the lease was given up
 
-#define	MAX_DHCP_RETRY 10   // maximum number of retries
-#define	DHCP_WAIT_TIME 2000 // milliseconds between retries
+#define	MAX_DHCP_RETRY 4    // discover attempts before using the fall back
 
 #define DHCP_FLAGSBROADCAST 0x0080
 
@@ -37,9 +46,14 @@
 #define	DHCP_RELEASE 7
 #define DHCP_INFORM 8
 
-// DHCP RETRANSMISSION TIMEOUT (microseconds)
-#define DHCP_INITIAL_RTO (4*1000000)
-#define DHCP_MAX_RTO (64*1000000)
+// DHCP retransmission timeout in milliseconds, doubled
+// for each retry, with up to a second of random jitter
+#define DHCP_INITIAL_RTO 2000
+#define DHCP_MAX_RTO 64000
+
+// seconds into the lease are counted at least this often, in
+// seconds, so that long leases don't overflow the timer's delay
+#define DHCP_MAX_WAIT 3600
 
 #define DHCP_HTYPE10MB 1
 #define DHCP_HTYPE100MB 2
@@ -50,8 +64,8 @@
 
 #define MAGIC_COOKIE 0x63825363
 
-#define DEFAULT_LEASETIME 0xffffffff // infinite lease time
-#define MAX_DHCP_options 16
+#define DHCP_INFINITE_LEASE 0xffffffff
+#define DHCP_MIN_MESSAGE 300  // BOOTP messages are padded to this
 
 // DHCP option and value (cf. RFC1533) 
 
@@ -122,11 +136,8 @@ enum
 	endOption					=	255
 };
 
-typedef unsigned char uint8_t;
-typedef unsigned int uint16_t;
-typedef unsigned long uint32_t;
-
 // for the DHCP message see http://www.tcpipguide.com/free/t_DHCPMessageFormat.htm
+// the struct gives the layout, the options start after the magic cookie
 
 typedef struct _RIP_MSG
 {
@@ -147,4 +158,53 @@ typedef struct _RIP_MSG
 	uint8_t  	options[312];
 } RIP_MSG;
 
+#define DHCP_OPTIONS_OFFSET 240
+
+// the fields and options that matter from a reply, and for the lease
+typedef struct {
+    uint8_t type;
+    uint8_t ip[4];
+    uint8_t subnet[4];
+    uint8_t gateway[4];
+    uint8_t server[4];
+    uint32_t lease_time, t1, t2;  // seconds
+} DHCPReply;
+
+class DHCP
+{
+    private:
+        NetDriver *net;
+        EventQueue *events;
+        uint8_t socket;
+        uint8_t state;
+        uint8_t retries;
+        bool fall_back;          // using the default configuration
+        uint32_t xid;
+        uint16_t rto;            // ms, doubled for each retry
+        uint16_t timeout;        // ms before retransmitting
+        unsigned long sent_at;
+        unsigned long tick_at;   // for counting seconds into the lease
+        uint32_t elapsed;        // seconds since the lease was acked
+        DHCPReply lease;
+        Timer timer;             // for whatever is due next
+
+        static void on_timer(void *data);
+        void run();
+        void reschedule();
+        void discover();
+        void request();
+        void send_message(uint8_t type);
+        void retransmit();
+        uint8_t read_reply(DHCPReply *reply);
+        void bind(DHCPReply *reply);
+        void unbind();
+
+    public:
+        DHCP();
+        void begin(NetDriver *driver, uint8_t s, EventQueue *queue);
+        void readable();
+        void release();
+        bool is_bound();
+};
+
 #endif
\ No newline at end of file
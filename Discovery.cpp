@@ -0,0 +1,537 @@
+// mDNS discovery of the gateway, shared by the network drivers
+
+#include <Arduino.h>
+#include "WSEvent.h"
+#include "MessageCoder.h"
+#include "NetDriver.h"
+#include "TxSink.h"
+#include "DnsReader.h"
+#include "Discovery.h"
+
+#define MDNS_GROUP 0xE00000FB  // 224.0.0.251
+#define MDNS_PORT 5353
+
+// DNS record types
+#define DNS_TYPE_A 1
+#define DNS_TYPE_PTR 12
+#define DNS_TYPE_SRV 33
+#define DNS_TYPE_ANY 255
+
+Discovery::Discovery()
+{
+    net = NULL;
+    events = NULL;
+    socket = 0;
+    started = false;
+    changed = false;
+    memset(gateways, 0, sizeof(gateways));
+    memset(&timer, 0, sizeof(timer));
+}
+
+// s is the driver's UDP socket, which is used for mDNS, and
+// Gateway_Changed_Event_t is queued on queue
+void Discovery::begin(NetDriver *driver, uint8_t s, EventQueue *queue)
+{
+    net = driver;
+    socket = s;
+    events = queue;
+}
+
+// the number of entries in the gateway table
+uint8_t Discovery::gateway_count()
+{
+    return MDNS_MAX_GATEWAYS;
+}
+
+// returns entry i, or NULL if it doesn't yet have both
+// an address and a port, the rtt may be set by the caller
+GatewayEntry *Discovery::get_gateway(uint8_t i)
+{
+    GatewayEntry *entry = gateways + i;
+
+    return (i < MDNS_MAX_GATEWAYS && entry->name_hash && entry->ip &&
+            entry->port ? entry : NULL);
+}
+
+// true if there is at least one usable gateway
+bool Discovery::found()
+{
+    for (uint8_t i = 0; i < MDNS_MAX_GATEWAYS; ++i) {
+        if (get_gateway(i))
+            return true;
+    }
+
+    return false;
+}
+
+void Discovery::print_gateways()
+{
+    for (uint8_t i = 0; i < MDNS_MAX_GATEWAYS; ++i) {
+        GatewayEntry *entry = get_gateway(i);
+
+        if (!entry)
+            continue;
+
+        Serial.print(F("gateway "));
+        Serial.print(i);
+        Serial.print(F(": "));
+        Serial.print((entry->ip >> 24) & 255);
+        Serial.print(F("."));
+        Serial.print((entry->ip >> 16) & 255);
+        Serial.print(F("."));
+        Serial.print((entry->ip >> 8) & 255);
+        Serial.print(F("."));
+        Serial.print(entry->ip & 255);
+        Serial.print(F(", port = "));
+        Serial.print(entry->port);
+
+        if (entry->rtt == GATEWAY_UNPROBED) {
+            Serial.println(F(", not probed"));
+        } else if (entry->rtt == GATEWAY_UNREACHABLE) {
+            Serial.println(F(", unreachable"));
+        } else {
+            Serial.print(F(", rtt = "));
+            Serial.print(entry->rtt);
+            Serial.println(F("ms"));
+        }
+    }
+}
+
+// mDNS query for the gateway's service, which is also used
+// to match the service name in the records of the responses
+static const uint8_t mdns_query[33] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // header
+    0x04,0x5F,0x77,0x6F,0x74,  // _wot
+    0x04,0x5F,0x74,0x63,0x70,  // _tcp
+    0x05,0x6C,0x6F,0x63,0x61,0x6C,  // local
+    0x00, // end of service type
+    0x00, 0x0C, // QTYPE PTR
+    0x00, 0x01, // QCLASS IN
+};
+
+// the device's own service type, in the order it's sent
+static const uint8_t device_service[22] = {
+    0x09,0x5F,0x77,0x6F,0x74,0x74,0x68,0x69,0x6E,0x67,  // _wotthing
+    0x04,0x5F,0x74,0x63,0x70,  // _tcp
+    0x05,0x6C,0x6F,0x63,0x61,0x6C,  // local
+    0x00
+};
+
+// offsets in the response for name compression
+#define DEVICE_SERVICE_OFFSET 12
+#define DEVICE_LOCAL_OFFSET (DEVICE_SERVICE_OFFSET + 15)
+
+// opens the UDP socket for mDNS, which stays open
+// so that responses are picked up in the background
+void Discovery::open()
+{
+    Serial.println(F("starting mDNS search"));
+
+    // mDNS IPv4 dest address 224.0.0.251 port 5353, the drivers
+    // join the multicast group when the socket is opened, and
+    // leave the group again when it is closed
+    net->open_udp(socket, MDNS_PORT, MDNS_GROUP);
+}
+
+// call once the device has an IP address, the search
+// then carries on in the background on the timer
+void Discovery::start()
+{
+    started = true;
+    respond_pending = true;  // announce the device
+    responded_at = millis() - 1000;
+    interval = MDNS_MIN_INTERVAL;
+    query_at = millis();
+    open();
+    reschedule(query_at);
+}
+
+// called when the socket reports a timeout or a disconnect
+void Discovery::closed()
+{
+    uint8_t status = net->get_socket_status(socket);
+
+    if (started && (status == SOCK_INIT || status == SOCK_CLOSED))
+        open();
+}
+
+void Discovery::on_timer(void *data)
+{
+    ((Discovery *)data)->run();
+}
+
+// queries, responds and expires records as they fall due
+void Discovery::run()
+{
+    unsigned long now = millis();
+    uint8_t status = net->get_socket_status(socket);
+
+    if (status == SOCK_INIT || status == SOCK_CLOSED)
+        open();
+
+    expire(now);
+
+    if (respond_pending && now - responded_at >= 1000) {
+        respond_pending = false;
+        responded_at = now;
+        respond();
+    }
+
+    if ((long)(now - query_at) >= 0) {
+        query();
+
+        if (found()) {
+            // again half way to expiry, i.e. at 80, 90, 95% of the TTL
+            schedule(now, 50);
+        } else {
+            query_at = now + interval;
+            interval = (interval < MDNS_MAX_INTERVAL / 2 ? 2 * interval : MDNS_MAX_INTERVAL);
+        }
+    }
+
+    reschedule(now);
+}
+
+// sets the timer for the next query, the pending response
+// or the first record to expire, whichever is due first
+void Discovery::reschedule(unsigned long now)
+{
+    long wait = query_at - now;
+
+    if (respond_pending && (long)(responded_at + 1000 - now) < wait)
+        wait = responded_at + 1000 - now;
+
+    for (uint8_t i = 0; i < MDNS_MAX_GATEWAYS; ++i) {
+        GatewayEntry *entry = gateways + i;
+
+        if (!entry->name_hash)
+            continue;
+
+        if ((long)(entry->srv_expires_at - now) < wait)
+            wait = entry->srv_expires_at - now;
+
+        if (entry->ip && (long)(entry->a_expires_at - now) < wait)
+            wait = entry->a_expires_at - now;
+    }
+
+    if (events)
+        events->start_timer(&timer, wait > 0 ? wait : 0, 0, on_timer, this);
+}
+
+void Discovery::query()
+{
+    Serial.println(F("querying _wot._tcp.local"));
+    net->send_async(socket, (char *)mdns_query, sizeof(mdns_query));
+}
+
+// sets the next query for percent of the time until the first
+// of the gateways' records expires, but at least a second ahead
+void Discovery::schedule(unsigned long now, uint8_t percent)
+{
+    unsigned long wait = 0xFFFFFFFF;
+
+    for (uint8_t i = 0; i < MDNS_MAX_GATEWAYS; ++i) {
+        GatewayEntry *entry = get_gateway(i);
+
+        if (entry) {
+            if (entry->srv_expires_at - now < wait)
+                wait = entry->srv_expires_at - now;
+
+            if (entry->a_expires_at - now < wait)
+                wait = entry->a_expires_at - now;
+        }
+    }
+
+    wait = wait / 100 * percent;
+    query_at = now + (wait < 1000 ? 1000 : wait);
+}
+
+void Discovery::expire(unsigned long now)
+{
+    bool had_gateway = found();
+
+    for (uint8_t i = 0; i < MDNS_MAX_GATEWAYS; ++i) {
+        GatewayEntry *entry = gateways + i;
+
+        if (!entry->name_hash)
+            continue;
+
+        if ((long)(now - entry->srv_expires_at) >= 0) {
+            changed |= (get_gateway(i) != NULL);
+            memset(entry, 0, sizeof(GatewayEntry));
+        } else if (entry->ip && (long)(now - entry->a_expires_at) >= 0) {
+            changed |= (get_gateway(i) != NULL);
+            entry->ip = 0;
+        }
+    }
+
+    if (had_gateway && !found()) {
+        Serial.println(F("gateway expired"));
+        interval = MDNS_MIN_INTERVAL;
+        query_at = now;
+    }
+
+    notify();
+}
+
+// queues Gateway_Changed_Event_t if the table has changed
+void Discovery::notify()
+{
+    if (changed) {
+        changed = false;
+
+        if (events)
+            events->enqueue(Gateway_Changed_Event_t, NULL);
+    }
+}
+
+// adds or updates the entry for the SRV record of an instance
+void Discovery::update_srv(uint16_t name, uint16_t target, uint16_t port,
+                           unsigned long expires_at)
+{
+    GatewayEntry *entry = NULL;
+
+    for (uint8_t i = 0; i < MDNS_MAX_GATEWAYS; ++i) {
+        if (gateways[i].name_hash == name) {
+            entry = gateways + i;
+            break;
+        }
+
+        if (!entry && !gateways[i].name_hash)
+            entry = gateways + i;
+    }
+
+    if (!entry) {
+        Serial.println(F("gateway table is full"));
+        return;
+    }
+
+    if (entry->name_hash != name || entry->target_hash != target) {
+        // a new instance, or the host has changed
+        changed |= (entry->name_hash == name && entry->ip);
+        entry->name_hash = name;
+        entry->target_hash = target;
+        entry->ip = 0;
+        entry->rtt = GATEWAY_UNPROBED;
+    } else if (entry->port != port) {
+        changed |= (entry->ip != 0);
+        entry->rtt = GATEWAY_UNPROBED;
+    }
+
+    entry->port = port;
+    entry->srv_expires_at = expires_at;
+}
+
+// sets the address of the gateways on the named host,
+// returns true if there were any
+bool Discovery::update_a(uint16_t name, uint32_t ip, unsigned long expires_at)
+{
+    bool matched = false;
+
+    for (uint8_t i = 0; i < MDNS_MAX_GATEWAYS; ++i) {
+        GatewayEntry *entry = gateways + i;
+
+        if (entry->name_hash && entry->target_hash == name) {
+            if (entry->ip != ip) {
+                changed = true;
+                entry->ip = ip;
+                entry->rtt = GATEWAY_UNPROBED;
+            }
+
+            entry->a_expires_at = expires_at;
+            matched = true;
+        }
+    }
+
+    return matched;
+}
+
+// streams the PTR, SRV and A records for the device's service
+// straight into the TX buffer, using name compression
+void Discovery::respond()
+{
+    static const uint8_t header[12] = {
+        0x00, 0x00, 0x84, 0x00, // id, flags for an authoritative response
+        0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00  // 3 answers
+    };
+    static const char host_name[] = HOST_NAME;
+    const uint8_t name_length = 1 + sizeof(host_name) - 1 + 2;
+    const uint16_t instance = DEVICE_SERVICE_OFFSET + sizeof(device_service) + 10;
+    const uint16_t target = instance + name_length + 18;
+    uint16_t port = net->get_local_port();
+    uint8_t rr[16], n0, n1, n2, n3;
+    TxSink sink;
+
+    net->get_local_ip(&n0, &n1, &n2, &n3);
+
+    if (sink.begin(net, socket, target + name_length + 16) < target + name_length + 16)
+        return;
+
+    sink.put_bytes((const char *)header, sizeof(header));
+
+    // PTR from the service type to the instance name
+    sink.put_bytes((const char *)device_service, sizeof(device_service));
+    rr[0] = 0; rr[1] = DNS_TYPE_PTR; rr[2] = 0x00; rr[3] = 0x01;
+    rr[4] = 0; rr[5] = 0; rr[6] = 0x11; rr[7] = 0x94;  // 4500 seconds
+    rr[8] = 0; rr[9] = name_length;
+    sink.put_bytes((const char *)rr, 10);
+    sink.put_byte(sizeof(host_name) - 1);
+    sink.put_bytes(host_name, sizeof(host_name) - 1);
+    sink.put_byte(0xC0); sink.put_byte(DEVICE_SERVICE_OFFSET);
+
+    // SRV from the instance name to the port and host name,
+    // the top bit of the class is the cache flush bit
+    rr[0] = 0xC0; rr[1] = instance;
+    rr[2] = 0; rr[3] = DNS_TYPE_SRV; rr[4] = 0x80; rr[5] = 0x01;
+    rr[6] = 0; rr[7] = 0; rr[8] = 0; rr[9] = MDNS_DEVICE_TTL;
+    rr[10] = 0; rr[11] = 6 + name_length;
+    rr[12] = 0; rr[13] = 0; rr[14] = 0; rr[15] = 0;  // priority and weight
+    sink.put_bytes((const char *)rr, 16);
+    sink.put_byte(port >> 8); sink.put_byte(port & 255);
+    sink.put_byte(sizeof(host_name) - 1);
+    sink.put_bytes(host_name, sizeof(host_name) - 1);
+    sink.put_byte(0xC0); sink.put_byte(DEVICE_LOCAL_OFFSET);
+
+    // A from the host name to the IP address
+    rr[0] = 0xC0; rr[1] = target;
+    rr[2] = 0; rr[3] = DNS_TYPE_A; rr[4] = 0x80; rr[5] = 0x01;
+    rr[6] = 0; rr[7] = 0; rr[8] = 0; rr[9] = MDNS_DEVICE_TTL;
+    rr[10] = 0; rr[11] = 4;
+    rr[12] = n0; rr[13] = n1; rr[14] = n2; rr[15] = n3;
+    sink.put_bytes((const char *)rr, 16);
+
+    sink.commit();
+}
+
+// handles the mDNS messages that have arrived, e.g. announcements,
+// responses to queries from any client, which may update the cached
+// gateway records, and queries for the device's service
+void Discovery::readable()
+{
+    while (net->receive_available(socket)) {
+        if (!handle_response(mdns_query))
+            Serial.println(F("error in DNS message"));
+
+        net->skip_datagram(socket);
+    }
+
+    notify();
+
+    if (started)
+        reschedule(millis());
+}
+
+// query is the mDNS query message that triggered the response,
+// the message is read through a DnsReader to keep down the SPI traffic
+uint8_t Discovery::handle_response(const uint8_t *query)
+{
+    DnsReader reader;
+    uint16_t offset = DNS_MESSAGE;
+    uint8_t buffer[DNS_HEADER_SIZE];
+    unsigned long now = millis();
+    bool refreshed = false;
+    
+    if (!reader.begin(net, socket) || !reader.read(offset, buffer, DNS_HEADER_SIZE))
+        return 0;
+
+    offset += DNS_HEADER_SIZE;
+    uint16_t flags = buffer[2]; flags <<= 8; flags |= buffer[3];
+    uint16_t qdcnt = buffer[4]; qdcnt <<= 8; qdcnt |= buffer[5];
+    uint16_t ancnt = buffer[6]; ancnt <<= 8; ancnt |= buffer[7];
+    uint16_t nscnt = buffer[8]; nscnt <<= 8; nscnt |= buffer[9];
+    uint16_t arcnt = buffer[10]; arcnt <<= 8; arcnt |= buffer[11];
+    uint16_t rrcount = ancnt + nscnt + arcnt;
+
+    // Parse questions which may come from other clients
+        
+    while (qdcnt--) {
+        bool match = reader.name_matches(offset, device_service);
+        
+        if (!(offset = reader.skip_name(offset)) || !reader.read(offset, buffer, 4))
+            return 0;
+                
+        offset += 4;
+        uint16_t qtype = buffer[0]; qtype <<= 8; qtype |= buffer[1];
+        
+        // queries for the device's service are answered on the timer
+        if (match && !(flags & 0x8000) && (qtype == DNS_TYPE_PTR || qtype == DNS_TYPE_ANY))
+            respond_pending = true;
+    }
+
+    // Parse resource records 
+    
+    while (rrcount--) {
+        uint16_t name_offset = offset;
+        bool match = reader.name_matches(offset, query + 12);
+        
+        if (!(offset = reader.skip_name(offset)))
+            return 0;
+        
+        // TYPE 2 bytes with resource record type.
+        // CLASS 2 bytes indicating the class of the data
+        // TTL a 32 bit unsigned integer giving expiry time in seconds
+        // RDLENGTH 16 bits indicating the length of the RDATA field in bytes.
+        // RDATA varies depending on the type and class of the resource record.
+
+        if (!reader.read(offset, buffer, 10))
+            return 0;
+
+        offset += 10;
+        uint16_t rtype = buffer[0]; rtype <<= 8; rtype |= buffer[1];
+        uint32_t time2live = buffer[4];
+        time2live <<= 8; time2live |= buffer[5];
+        time2live <<= 8; time2live |= buffer[6];
+        time2live <<= 8; time2live |= buffer[7];
+        uint16_t rdlength = buffer[8]; rdlength <<= 8; rdlength |= buffer[9];
+        
+        // a TTL of zero means the record is going away, RFC 6762
+        // says to delete it in a second to allow for updates
+        if (time2live > MDNS_MAX_TTL)
+            time2live = MDNS_MAX_TTL;
+            
+        unsigned long expires_at = now + (time2live ? 1000 * time2live : 1000);
+        
+        if (rtype == DNS_TYPE_SRV && match) {
+            // DNS SRV record - priority, weight, port and target
+            if (rdlength < 7 || !reader.read(offset, buffer, 6))
+                return 0;
+
+            uint16_t name = reader.hash_name(name_offset);
+            uint16_t target = reader.hash_name(offset + 6);
+
+            if (!name || !target)
+                return 0;
+                
+            update_srv(name, target, 256 * buffer[4] + buffer[5], expires_at);
+            refreshed = true;
+        } else if (rtype == DNS_TYPE_A) {
+            // DNS A record - IPv4 address for any of the SRV targets
+            uint16_t name = reader.hash_name(name_offset);
+            
+            if (rdlength != 4 || !name || !reader.read(offset, buffer, 4))
+                return 0;
+
+            uint32_t ip = buffer[0];
+            ip <<= 8; ip |= buffer[1];
+            ip <<= 8; ip |= buffer[2];
+            ip <<= 8; ip |= buffer[3];
+            
+            if (update_a(name, ip, expires_at))
+                refreshed = true;
+        }
+        
+        offset += rdlength;
+    }
+    
+    // found gateway?
+    
+    if (refreshed && found()) {
+        // query again at 80% of the TTL
+        schedule(now, 80);
+        
+        Serial.print(F("mDNS peeks = "));
+        Serial.println(reader.get_peeks());
+    }
+                
+    return 1;
+}
@@ -0,0 +1,91 @@
+// mDNS discovery of the gateway
+
+#ifndef _WOTF_DISCOVERY
+#define _WOTF_DISCOVERY
+
+/*
+   Discovery runs in the background on the driver's UDP socket. Once
+   started, it queries for _wot._tcp.local at increasing intervals
+   until a gateway is found, and then again at 80% of the records'
+   TTL to keep them fresh. Announcements and responses to queries from
+   other clients update the cache at any time, and a TTL of zero, as
+   sent when a gateway goes away, expires the record after a second.
+
+   Every instance of the service goes in a small table. Names aren't
+   stored, instead the entries are keyed by a hash of the instance
+   name from the SRV record, and the A record is matched by a hash of
+   the SRV target, so the records can arrive in separate messages.
+   GatewayLink probes each entry for its round trip time, which it
+   keeps in the entry. Whenever an entry is added or removed, or its
+   address or port changes, Gateway_Changed_Event_t is queued.
+
+   It also answers queries for the device's own _wotthing._tcp.local
+   service with PTR, SRV and A records for HOST_NAME.
+
+   The queries, the response and the expiry of the records run on a
+   timer from the event queue that is set for whichever is due first,
+   so nothing is polled between them. The socket is checked when the
+   timer fires and when it reports a timeout or disconnect.
+*/
+
+#define MDNS_MIN_INTERVAL 1000   // ms, doubled until the gateway is found
+#define MDNS_MAX_INTERVAL 60000
+#define MDNS_MAX_TTL 86400       // seconds, so that expiry fits millis()
+#define MDNS_DEVICE_TTL 120      // for the records describing the device
+#define MDNS_MAX_GATEWAYS 3
+
+// round trip times for gateways that haven't been or couldn't be probed
+#define GATEWAY_UNPROBED 0xFFFE
+#define GATEWAY_UNREACHABLE 0xFFFF
+
+typedef struct {
+    uint16_t name_hash;    // of the instance name, 0 when free
+    uint16_t target_hash;  // of the host name for the A record
+    uint32_t ip;           // 0 until the A record arrives
+    uint16_t port;
+    uint16_t rtt;          // ms
+    unsigned long srv_expires_at, a_expires_at;
+} GatewayEntry;
+
+class Discovery
+{
+    private:
+        NetDriver *net;
+        EventQueue *events;
+        uint8_t socket;
+        bool started;
+        bool respond_pending;   // a query for the device's service arrived
+        bool changed;           // the table changed since the last event
+        GatewayEntry gateways[MDNS_MAX_GATEWAYS];
+        unsigned long query_at;  // time for the next query
+        unsigned long responded_at;
+        uint16_t interval;       // ms between queries whilst searching
+        Timer timer;             // for whatever is due next
+
+        static void on_timer(void *data);
+        void run();
+        void reschedule(unsigned long now);
+        void open();
+        void query();
+        void respond();
+        void expire(unsigned long now);
+        void notify();
+        bool found();
+        void update_srv(uint16_t name, uint16_t target, uint16_t port,
+                        unsigned long expires_at);
+        bool update_a(uint16_t name, uint32_t ip, unsigned long expires_at);
+        void schedule(unsigned long now, uint8_t percent);
+        uint8_t handle_response(const uint8_t *query);
+
+    public:
+        Discovery();
+        void begin(NetDriver *driver, uint8_t s, EventQueue *queue);
+        void start();
+        void closed();
+        void readable();
+        uint8_t gateway_count();
+        GatewayEntry *get_gateway(uint8_t i);
+        void print_gateways();
+};
+
+#endif
@@ -0,0 +1,180 @@
+#include <Arduino.h>
+#include "NetDriver.h"
+#include "DnsReader.h"
+
+// starts reading the next datagram on socket s, returns its
+// length including the UDP header, or 0 if there isn't one
+uint16_t DnsReader::begin(NetDriver *driver, uint8_t s)
+{
+    uint8_t header[DNS_MESSAGE];
+
+    net = driver;
+    socket = s;
+    end = DNS_MESSAGE;
+    window_offset = 0;
+    window_size = 0;
+    peeks = 0;
+
+    if (!read(0, header, DNS_MESSAGE))
+        return 0;
+
+    end = DNS_MESSAGE + 256 * header[6] + header[7];
+    return end;
+}
+
+// copies length bytes, which must be no more than the window,
+// peeking at the RX buffer only when they aren't in the window
+bool DnsReader::read(uint16_t offset, uint8_t *dst, uint8_t length)
+{
+    if (offset < window_offset || offset + length > window_offset + window_size) {
+        uint16_t n = DNS_WINDOW_SIZE;
+
+        if (offset + length > end)
+            return false;
+
+        if (offset + n > end)
+            n = end - offset;
+
+        ++peeks;
+        window_offset = offset;
+        window_size = net->peek(socket, offset, (char *)window, n);
+
+        if (window_size < length)
+            return false;
+    }
+
+    memcpy(dst, window + (offset - window_offset), length);
+    return true;
+}
+
+// follows any compression pointers from offset to the next label,
+// returns the offset of its length byte, or 0 if the name is invalid
+uint16_t DnsReader::label(uint16_t offset, uint8_t *hops)
+{
+    uint8_t c[2];
+
+    for (;;) {
+        if (!read(offset, c, 1))
+            return 0;
+
+        if (c[0] <= DNS_MAX_LABEL)
+            return offset;
+
+        // 0x40 and 0x80 are reserved label types
+        if (c[0] < 0xC0 || !read(offset, c, 2))
+            return 0;
+
+        uint16_t target = DNS_MESSAGE + 256 * (c[0] & 0x3F) + c[1];
+
+        // pointers must go backwards, which rules out loops
+        if (target < DNS_MESSAGE + DNS_HEADER_SIZE || target >= offset ||
+            ++*hops > DNS_MAX_POINTERS)
+            return 0;
+
+        offset = target;
+    }
+}
+
+// checks the name at offset, returns the offset just after
+// it in the message, or 0 if the name is invalid
+uint16_t DnsReader::skip_name(uint16_t offset)
+{
+    uint16_t next = 0, length = 0;
+    uint8_t hops = 0, c;
+
+    for (;;) {
+        uint16_t at = label(offset, &hops);
+
+        if (!at)
+            return 0;
+
+        // the name continues after its first pointer
+        if (at != offset && !next)
+            next = offset + 2;
+
+        read(at, &c, 1);
+        length += 1 + c;
+
+        if (length > DNS_MAX_NAME || at + 1 + c > end)
+            return 0;
+
+        if (!c)
+            return (next ? next : at + 1);
+
+        offset = at + 1 + c;
+    }
+}
+
+// compares the name at offset with name, a sequence of labels
+// in RAM ending with a 0 length, ignoring case as for DNS
+bool DnsReader::compare(uint16_t offset, const uint8_t *name)
+{
+    uint8_t hops = 0, c, b;
+
+    for (;;) {
+        if (!(offset = label(offset, &hops)) || !read(offset, &c, 1))
+            return false;
+
+        if (c != *name++)
+            return false;
+
+        if (!c)
+            return true;
+
+        while (c--) {
+            if (!read(++offset, &b, 1) || tolower(b) != tolower(*name++))
+                return false;
+        }
+
+        ++offset;
+    }
+}
+
+// true if the name at offset is name, or an instance of it,
+// i.e. one label followed by name
+bool DnsReader::name_matches(uint16_t offset, const uint8_t *name)
+{
+    uint8_t hops = 0, c;
+
+    if (compare(offset, name))
+        return true;
+
+    if (!(offset = label(offset, &hops)) || !read(offset, &c, 1) || !c)
+        return false;
+
+    return compare(offset + 1 + c, name);
+}
+
+// a 16 bit hash of the name at offset, ignoring case, so that names
+// can be recognised across messages without storing them, or 0 if
+// the name is invalid
+uint16_t DnsReader::hash_name(uint16_t offset)
+{
+    uint16_t hash = 0;
+    uint8_t hops = 0, c, b;
+
+    for (;;) {
+        if (!(offset = label(offset, &hops)) || !read(offset, &c, 1))
+            return 0;
+
+        hash = 31 * hash + c;
+
+        if (!c)
+            return (hash ? hash : 1);
+
+        while (c--) {
+            if (!read(++offset, &b, 1))
+                return 0;
+
+            hash = 31 * hash + tolower(b);
+        }
+
+        ++offset;
+    }
+}
+
+// the number of times the driver was asked for data
+uint8_t DnsReader::get_peeks()
+{
+    return peeks;
+}
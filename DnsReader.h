@@ -0,0 +1,52 @@
+// buffered reader for DNS messages in a socket's RX buffer
+
+#ifndef _WOTF_DNS_READER
+#define _WOTF_DNS_READER
+
+/*
+   DNS messages are parsed in place in the RX buffer, as names need
+   random access to follow compression pointers. Each peek() costs
+   several SPI transfers to read the receive size and read pointer
+   before the data, so the reader holds a window of the message and
+   only peeks again when a read falls outside it. The length of the
+   datagram is taken once from its UDP header, so reads are bounds
+   checked without asking the driver.
+
+   Offsets are from the start of the UDP header, and the DNS message
+   starts at DNS_MESSAGE. Names are checked as they are read: labels
+   must be at most 63 bytes, names at most 255 bytes, and compression
+   pointers must point backwards, which rules out loops, and at most
+   DNS_MAX_POINTERS are followed per name.
+*/
+
+#define DNS_MESSAGE 8         // after the UDP header
+#define DNS_HEADER_SIZE 12
+#define DNS_WINDOW_SIZE 32
+#define DNS_MAX_LABEL 63
+#define DNS_MAX_NAME 255
+#define DNS_MAX_POINTERS 8
+
+class DnsReader
+{
+    private:
+        NetDriver *net;
+        uint8_t socket;
+        uint16_t end;            // end of the datagram
+        uint16_t window_offset;  // offset of window[0]
+        uint8_t window_size;     // bytes in the window
+        uint8_t window[DNS_WINDOW_SIZE];
+        uint8_t peeks;           // reads from the driver
+
+        uint16_t label(uint16_t offset, uint8_t *hops);
+        bool compare(uint16_t offset, const uint8_t *name);
+
+    public:
+        uint16_t begin(NetDriver *driver, uint8_t s);
+        bool read(uint16_t offset, uint8_t *dst, uint8_t length);
+        uint16_t skip_name(uint16_t offset);
+        bool name_matches(uint16_t offset, const uint8_t *name);
+        uint16_t hash_name(uint16_t offset);
+        uint8_t get_peeks();
+};
+
+#endif
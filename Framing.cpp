@@ -0,0 +1,188 @@
+#include <Arduino.h>
+#include "MessageCoder.h"
+#include "NetDriver.h"
+#include "Framing.h"
+
+#if defined(__AVR__)
+#include <util/crc16.h>
+#endif
+
+// the number of bytes needed for a varint length
+uint8_t Framing::length_size(uint16_t length)
+{
+    if (length < 0x80)
+        return 1;
+
+    if (length < 0x4000)
+        return 2;
+
+    return 3;
+}
+
+// writes length as a varint padded to size bytes, which must be
+// at least length_size(length), returns the number of bytes written
+uint8_t Framing::put_length(uint8_t *dst, uint16_t length, uint8_t size)
+{
+    for (uint8_t i = 1; i < size; ++i) {
+        *dst++ = 0x80 | (length & 0x7F);
+        length >>= 7;
+    }
+
+    *dst = length & 0x7F;
+    return size;
+}
+
+// reads a varint length from up to available bytes, returns the
+// number of bytes it took, 0 if more are needed, or 0xFF if invalid
+uint8_t Framing::get_length(const uint8_t *src, uint16_t available, uint16_t *length)
+{
+    uint32_t value = 0;
+
+    for (uint8_t i = 0; i < FRAME_MAX_LENGTH_SIZE; ++i) {
+        if (i >= available)
+            return 0;
+
+        value |= (uint32_t)(src[i] & 0x7F) << (7 * i);
+
+        if (!(src[i] & 0x80)) {
+            if (value > 0xFFFF)
+                break;
+
+            *length = value;
+            return i + 1;
+        }
+    }
+
+    return 0xFF;
+}
+
+// CRC-16/CCITT with polynomial 0x1021, start with FRAME_CRC_INITIAL
+uint16_t Framing::crc16(uint16_t crc, const uint8_t *data, uint16_t length)
+{
+    while (length--) {
+#if defined(__AVR__)
+        crc = _crc_xmodem_update(crc, *data++);
+#else
+        crc ^= (uint16_t)*data++ << 8;
+
+        for (uint8_t i = 0; i < 8; ++i)
+            crc = (crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1);
+#endif
+    }
+
+    return crc;
+}
+
+// buf holds partial frames between reads, and must be large
+// enough for the longest frame, flags is 0 or FRAME_CRC
+void FrameReader::begin(uint8_t *buf, uint16_t length, uint8_t flags)
+{
+    buffer = buf;
+    size = length;
+    used = start = discard = 0;
+    options = flags;
+}
+
+// moves any partial frame to the start of the buffer
+void FrameReader::compact()
+{
+    if (start) {
+        memmove(buffer, buffer + start, used - start);
+        used -= start;
+        start = 0;
+    }
+}
+
+// adds data as it arrives, returns the number of bytes taken,
+// which is less than length when the buffer is full, in which
+// case call next() until it returns FRAME_NONE and feed the rest
+uint16_t FrameReader::feed(const uint8_t *data, uint16_t length)
+{
+    uint16_t taken = 0, n;
+
+    compact();
+
+    if (discard) {
+        n = (length < discard ? length : discard);
+        discard -= n;
+        data += n;
+        length -= n;
+        taken = n;
+    }
+
+    n = size - used;
+
+    if (n > length)
+        n = length;
+
+    memcpy(buffer + used, data, n);
+    used += n;
+    return taken + n;
+}
+
+// reads what has arrived on socket s directly into the buffer,
+// returns the number of bytes read
+uint16_t FrameReader::receive(NetDriver *net, uint8_t s)
+{
+    uint16_t n = 0;
+
+    compact();
+
+    if (discard) {
+        n = net->skip(s, discard);
+        discard -= n;
+
+        if (discard)
+            return n;
+    }
+
+    uint16_t length = net->receive(s, (char *)buffer + used, size - used);
+    used += length;
+    return n + length;
+}
+
+// sets frame to the next complete message and returns FRAME_OK, the
+// message stays valid until the next call to feed() or receive()
+uint8_t FrameReader::next(MessageBuffer *frame)
+{
+    uint16_t available = used - start;
+    uint16_t length;
+    uint8_t n = Framing::get_length(buffer + start, available, &length);
+
+    if (!n)
+        return FRAME_NONE;
+
+    if (n == 0xFF) {
+        used = start = 0;
+        return FRAME_BAD_LENGTH;
+    }
+
+    // drop frames that will never fit, including what's yet to come
+    if (n + (uint32_t)length > size) {
+        uint32_t total = n + (uint32_t)length;
+        uint16_t drop = (total < available ? total : available);
+        start += drop;
+        discard = total - drop;
+        return FRAME_TOO_LONG;
+    }
+
+    if (available < n + length)
+        return FRAME_NONE;
+
+    uint8_t *message = buffer + start + n;
+    start += n + length;
+
+    if (options & FRAME_CRC) {
+        if (length < FRAME_CRC_SIZE)
+            return FRAME_BAD_CRC;
+
+        length -= FRAME_CRC_SIZE;
+        uint16_t crc = Framing::crc16(FRAME_CRC_INITIAL, message, length);
+
+        if (crc != (uint16_t)(256 * message[length] + message[length + 1]))
+            return FRAME_BAD_CRC;
+    }
+
+    frame->set_data(message, length);
+    return FRAME_OK;
+}
@@ -0,0 +1,64 @@
+// framing for binary messages over a TCP byte stream
+
+#ifndef _WOTF_FRAMING
+#define _WOTF_FRAMING
+
+/*
+   TCP delivers a stream of bytes with no message boundaries, so a
+   read may return part of a message or several messages at once.
+   Each message is therefore sent as a frame: its length as a varint,
+   i.e. 7 bits per byte, least significant first, with the top bit set
+   on all but the last byte, then the message itself. With FRAME_CRC
+   the message is followed by a big endian CRC-16/CCITT of the message,
+   which is included in the length.
+
+   A writer that only knows the length once the message is encoded can
+   reserve room for the largest length and pad it with 0x80 bytes, as
+   put_length() does, and readers accept such padded lengths.
+
+   FrameReader reassembles frames from whatever sized pieces arrive,
+   and next() returns each complete frame in turn, so that several
+   back to back frames can be decoded from the one read.
+*/
+
+#define FRAME_CRC 1   // option for frames ending with a CRC-16
+#define FRAME_CRC_SIZE 2
+#define FRAME_CRC_INITIAL 0xFFFF
+#define FRAME_MAX_LENGTH_SIZE 3  // for lengths up to 65535
+
+// results from FrameReader::next()
+#define FRAME_NONE 0        // no complete frame yet
+#define FRAME_OK 1
+#define FRAME_BAD_CRC 2     // the frame was dropped
+#define FRAME_TOO_LONG 3    // the frame was dropped as it won't fit
+#define FRAME_BAD_LENGTH 4  // stream is corrupt, so drop the connection
+
+class Framing
+{
+    public:
+        static uint8_t length_size(uint16_t length);
+        static uint8_t put_length(uint8_t *dst, uint16_t length, uint8_t size);
+        static uint8_t get_length(const uint8_t *src, uint16_t available, uint16_t *length);
+        static uint16_t crc16(uint16_t crc, const uint8_t *data, uint16_t length);
+};
+
+class FrameReader
+{
+    private:
+        uint8_t *buffer;
+        uint16_t size;
+        uint16_t used;     // bytes in the buffer
+        uint16_t start;    // start of the next frame
+        uint16_t discard;  // bytes still to drop from a frame too long
+        uint8_t options;
+
+        void compact();
+
+    public:
+        void begin(uint8_t *buf, uint16_t length, uint8_t flags);
+        uint16_t feed(const uint8_t *data, uint16_t length);
+        uint16_t receive(NetDriver *net, uint8_t s);
+        uint8_t next(MessageBuffer *frame);
+};
+
+#endif
@@ -0,0 +1,456 @@
+#include <Arduino.h>
+#include "Strings.h"
+#include "WSEvent.h"
+#include "MessageCoder.h"
+#include "NetDriver.h"
+#include "Discovery.h"
+#include "Framing.h"
+#include "TxSink.h"
+#include "GatewayLink.h"
+
+// link states
+#define LINK_IDLE 0
+#define LINK_BACKOFF 1
+#define LINK_PROBING 2
+#define LINK_CONNECTING 3
+#define LINK_CONNECTED 4
+
+GatewayLink::GatewayLink()
+{
+    net = NULL;
+    discovery = NULL;
+    events = NULL;
+    state = LINK_IDLE;
+    current = -1;
+    next_id = 0;
+    backoff = LINK_MIN_BACKOFF;
+    responses = 0;
+    total_latency = max_latency = 0;
+
+    for (uint8_t i = 0; i < LINK_MAX_REQUESTS; ++i)
+        requests[i].id = 0;
+
+    memset(&timer, 0, sizeof(timer));
+}
+
+// s is the socket for the link, the gateways' addresses and ports are
+// taken from discovery once they are found, and the timeouts run on
+// a timer from queue
+void GatewayLink::begin(NetDriver *driver, uint8_t s, Discovery *finder,
+                        EventQueue *queue)
+{
+    net = driver;
+    socket = s;
+    discovery = finder;
+    events = queue;
+    backoff = LINK_MIN_BACKOFF;
+    retry_at = millis();
+    state = LINK_BACKOFF;
+    reschedule();
+}
+
+bool GatewayLink::is_connected()
+{
+    return state == LINK_CONNECTED;
+}
+
+// true whilst probing or connecting, as the round trip
+// time needs millis() to keep running
+bool GatewayLink::is_connecting()
+{
+    return state == LINK_PROBING || state == LINK_CONNECTING;
+}
+
+// the index of the gateway connected to, for
+// Discovery::get_gateway(), or -1 if not connected
+int8_t GatewayLink::current_gateway()
+{
+    return (state == LINK_CONNECTED ? current : -1);
+}
+
+void GatewayLink::on_timer(void *data)
+{
+    ((GatewayLink *)data)->run();
+}
+
+// reconnects and times out requests as they fall due
+void GatewayLink::run()
+{
+    unsigned long now = millis();
+
+    if (state == LINK_BACKOFF && (long)(now - retry_at) >= 0)
+        start();
+
+    if ((state == LINK_PROBING || state == LINK_CONNECTING) &&
+        now - connect_at >= LINK_CONNECT_TIMEOUT)
+        drop(true);
+
+    for (uint8_t i = 0; i < LINK_MAX_REQUESTS; ++i) {
+        LinkRequest *request = requests + i;
+
+        if (request->id && now - request->sent_at >= LINK_REQUEST_TIMEOUT) {
+            uint8_t id = request->id;
+            request->id = 0;
+            request->handler(id, NULL);
+        }
+    }
+
+    reschedule();
+}
+
+// sets the timer for the end of the backoff or the connect timeout,
+// or the first request to time out, whichever is first
+void GatewayLink::reschedule()
+{
+    unsigned long now = millis();
+    unsigned long wait = TIMER_NONE;
+
+    if (state == LINK_BACKOFF)
+        wait = ((long)(retry_at - now) > 0 ? retry_at - now : 0);
+    else if (is_connecting())
+        wait = (now - connect_at < LINK_CONNECT_TIMEOUT ?
+                LINK_CONNECT_TIMEOUT - (now - connect_at) : 0);
+
+    for (uint8_t i = 0; i < LINK_MAX_REQUESTS; ++i) {
+        LinkRequest *request = requests + i;
+
+        if (request->id) {
+            unsigned long left = (now - request->sent_at < LINK_REQUEST_TIMEOUT ?
+                                  LINK_REQUEST_TIMEOUT - (now - request->sent_at) : 0);
+
+            if (left < wait)
+                wait = left;
+        }
+    }
+
+    if (wait == TIMER_NONE)
+        events->cancel_timer(&timer);
+    else
+        events->start_timer(&timer, wait, 0, on_timer, this);
+}
+
+// probes the next gateway that hasn't been, else connects to the
+// fastest, or backs off if none can be reached
+void GatewayLink::start()
+{
+    uint8_t count = discovery->gateway_count();
+    GatewayEntry *entry;
+    int8_t i;
+
+    for (i = 0; i < count; ++i) {
+        entry = discovery->get_gateway(i);
+
+        if (entry && entry->rtt == GATEWAY_UNPROBED) {
+            if (connect(i)) {
+                state = LINK_PROBING;
+                return;
+            }
+
+            entry->rtt = GATEWAY_UNREACHABLE;
+        }
+    }
+
+    while ((i = fastest()) >= 0) {
+        if (connect(i)) {
+            state = LINK_CONNECTING;
+            return;
+        }
+
+        discovery->get_gateway(i)->rtt = GATEWAY_UNREACHABLE;
+    }
+
+    // try them all again after the backoff
+    for (i = 0; i < count; ++i) {
+        entry = discovery->get_gateway(i);
+
+        if (entry && entry->rtt == GATEWAY_UNREACHABLE)
+            entry->rtt = GATEWAY_UNPROBED;
+    }
+
+    current = -1;
+    retry_later();
+}
+
+// starts connecting to gateway i, completed by connected(),
+// or closed() if refused, or run() on timeout
+bool GatewayLink::connect(uint8_t i)
+{
+    GatewayEntry *entry = discovery->get_gateway(i);
+    uint32_t ip = entry->ip;
+
+    net->open(socket);
+    reader.begin(buffer, LINK_BUFFER_SIZE, LINK_FRAME_OPTIONS);
+    current = i;
+    gateway_ip = ip;
+    gateway_port = entry->port;
+    connect_at = millis();
+
+    if (net->connect(socket, (ip >> 24) & 255, (ip >> 16) & 255,
+                     (ip >> 8) & 255, ip & 255, entry->port))
+        return true;
+
+    net->close(socket);
+    return false;
+}
+
+// the reachable gateway with the shortest round trip, or -1
+int8_t GatewayLink::fastest()
+{
+    int8_t best = -1;
+    uint16_t rtt = GATEWAY_UNPROBED;
+
+    for (uint8_t i = 0; i < discovery->gateway_count(); ++i) {
+        GatewayEntry *entry = discovery->get_gateway(i);
+
+        if (entry && entry->rtt < rtt) {
+            rtt = entry->rtt;
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+// true if the gateway probed or connected to has gone,
+// or its address or port has changed
+bool GatewayLink::current_changed()
+{
+    GatewayEntry *entry = (current >= 0 ? discovery->get_gateway(current) : NULL);
+
+    return !entry || entry->ip != gateway_ip || entry->port != gateway_port;
+}
+
+// closes the connection, fails any requests and moves on to the next
+// gateway, marking the current one unreachable if it was at fault
+void GatewayLink::drop(bool unreachable)
+{
+    if (unreachable && !current_changed())
+        discovery->get_gateway(current)->rtt = GATEWAY_UNREACHABLE;
+
+    net->close(socket);
+    fail_requests();
+    start();
+    reschedule();
+}
+
+// doubles the time before each attempt to reconnect
+void GatewayLink::retry_later()
+{
+    retry_at = millis() + backoff;
+    backoff = (backoff < LINK_MAX_BACKOFF / 2 ? 2 * backoff : LINK_MAX_BACKOFF);
+    state = LINK_BACKOFF;
+}
+
+void GatewayLink::fail_requests()
+{
+    for (uint8_t i = 0; i < LINK_MAX_REQUESTS; ++i) {
+        uint8_t id = requests[i].id;
+
+        if (id) {
+            requests[i].id = 0;
+            requests[i].handler(id, NULL);
+        }
+    }
+}
+
+LinkRequest *GatewayLink::find_request(uint8_t id)
+{
+    for (uint8_t i = 0; i < LINK_MAX_REQUESTS; ++i) {
+        if (requests[i].id == id)
+            return requests + i;
+    }
+
+    return NULL;
+}
+
+// returns a buffer for encoding a request of up to length bytes
+// straight into the TX buffer, or NULL if the link isn't connected,
+// too many requests are in flight, or there isn't room to send it
+MessageBuffer *GatewayLink::start_request(uint16_t length)
+{
+    static const char padding[FRAME_MAX_LENGTH_SIZE] = {0, 0, 0};
+
+    if (state != LINK_CONNECTED || !find_request(0))
+        return NULL;
+
+    // the frame holds the request id, the message and maybe a CRC
+    length += 1 + (LINK_FRAME_OPTIONS & FRAME_CRC ? FRAME_CRC_SIZE : 0);
+    length_size = Framing::length_size(length);
+
+    if (sink.begin(net, socket, length_size + length) < length_size + length)
+        return NULL;
+
+    // ids are never 0, as that marks a free request
+    if (!++next_id)
+        next_id = 1;
+
+    // the length is filled in by send_request()
+    sink.put_bytes(padding, length_size);
+    sink.start_crc();
+    sink.put_byte(next_id);
+    message.set_sink(&sink);
+    return &message;
+}
+
+// sends the request encoded since start_request() and returns
+// its id, or 0 if it overflowed its length and wasn't sent
+uint8_t GatewayLink::send_request(LinkHandler handler)
+{
+    LinkRequest *request = find_request(0);
+    uint16_t length = 1 + message.get_size();
+    uint8_t header[FRAME_MAX_LENGTH_SIZE];
+
+    if (message.overflowed() || !request)
+        return 0;
+
+    if (LINK_FRAME_OPTIONS & FRAME_CRC) {
+        uint16_t crc = sink.get_crc();
+        char check[FRAME_CRC_SIZE] = {(char)(crc >> 8), (char)(crc & 255)};
+
+        sink.put_bytes(check, FRAME_CRC_SIZE);
+        length += FRAME_CRC_SIZE;
+    }
+
+    Framing::put_length(header, length, length_size);
+    sink.patch(0, (char *)header, length_size);
+
+    if (!sink.commit())
+        return 0;
+
+    request->id = next_id;
+    request->handler = handler;
+    request->sent_at = millis();
+    reschedule();
+    return next_id;
+}
+
+void GatewayLink::connected()
+{
+    if (state == LINK_PROBING) {
+        unsigned long rtt = millis() - connect_at;
+
+        if (!current_changed()) {
+            discovery->get_gateway(current)->rtt =
+                (rtt < GATEWAY_UNPROBED ? rtt : GATEWAY_UNPROBED - 1);
+
+            Serial.print(F("gateway "));
+            Serial.print(current);
+            Serial.print(F(" rtt = "));
+            Serial.print(rtt);
+            Serial.println(F("ms"));
+        }
+
+        // keep the connection if there is nothing faster to probe
+        if (current_changed() || fastest() != current) {
+            drop(false);
+            return;
+        }
+
+        for (uint8_t i = 0; i < discovery->gateway_count(); ++i) {
+            GatewayEntry *entry = discovery->get_gateway(i);
+
+            if (entry && entry->rtt == GATEWAY_UNPROBED) {
+                drop(false);
+                return;
+            }
+        }
+
+        state = LINK_CONNECTING;
+    }
+
+    if (state == LINK_CONNECTING) {
+        Serial.print(F("connected to gateway "));
+        Serial.println(current);
+        state = LINK_CONNECTED;
+        backoff = LINK_MIN_BACKOFF;
+        reschedule();
+    }
+}
+
+// handles each complete response frame, several may arrive
+// together, and partial frames are kept until the rest arrives
+void GatewayLink::readable()
+{
+    uint16_t received;
+    uint8_t result;
+
+    do {
+        received = reader.receive(net, socket);
+
+        while ((result = reader.next(&response)) != FRAME_NONE) {
+            if (result == FRAME_BAD_LENGTH) {
+                Serial.println(F("Error: bad frame from gateway"));
+                net->disconnect(socket);
+                return;
+            }
+
+            // the request will time out
+            if (result != FRAME_OK || !response.get_size()) {
+                Serial.println(F("Error: dropped response from gateway"));
+                continue;
+            }
+
+            // the frame starts with the request id
+            unsigned char *frame = response.get_pointer();
+            LinkRequest *request = (frame[0] ? find_request(frame[0]) : NULL);
+
+            if (!request)
+                continue;
+
+            unsigned long latency = millis() - request->sent_at;
+            ++responses;
+            total_latency += latency;
+
+            if (latency > max_latency)
+                max_latency = latency;
+
+            request->id = 0;
+            response.set_data(frame + 1, response.get_size() - 1);
+            request->handler(frame[0], &response);
+        }
+    } while (received);
+}
+
+// the connection was lost or couldn't be made,
+// so fail over to the next fastest gateway
+void GatewayLink::closed()
+{
+    if (state == LINK_IDLE || state == LINK_BACKOFF)
+        return;
+
+    if (state == LINK_CONNECTED)
+        Serial.println(F("lost connection to gateway"));
+
+    drop(true);
+}
+
+// called for Gateway_Changed_Event_t, switches at once if the gateway
+// probed or connected to has changed, and otherwise tries any new
+// gateways straight away when none could be reached
+void GatewayLink::gateway_changed()
+{
+    if (state == LINK_IDLE)
+        return;
+
+    if (state == LINK_BACKOFF) {
+        backoff = LINK_MIN_BACKOFF;
+        start();
+        reschedule();
+    } else if (current_changed()) {
+        if (state == LINK_CONNECTED)
+            Serial.println(F("switching gateway"));
+
+        drop(false);
+    }
+}
+
+void GatewayLink::print_stats()
+{
+    Serial.print(F("responses = "));
+    Serial.print(responses);
+    Serial.print(F(", mean latency = "));
+    Serial.print(responses ? total_latency / responses : 0);
+    Serial.print(F("ms, max latency = "));
+    Serial.print(max_latency);
+    Serial.println(F("ms"));
+}
@@ -0,0 +1,109 @@
+// persistent connection to the gateway with pipelined requests
+
+#ifndef _WOTF_GATEWAY_LINK
+#define _WOTF_GATEWAY_LINK
+
+/*
+   The link connects to a gateway found by mDNS discovery and keeps
+   the connection open, so that each exchange doesn't pay for a TCP
+   handshake. Several requests can be in flight at once. Each one is
+   sent as a frame, see Framing.h, holding a 1 byte request id and
+   then the encoded message. The gateway replies with a frame carrying
+   the same id.
+
+   With several gateways, the link first probes each new one in turn
+   by timing a TCP connect, which is closed again, and then connects
+   to the one with the shortest round trip. If the connection is lost,
+   the requests in flight fail, that gateway is marked unreachable and
+   the link fails over to the next fastest at once. Only when none are
+   reachable does it back off exponentially, and then probes them all
+   again. When discovery reports that the gateway connected to has
+   changed or gone, the link switches straight away. Gateways found
+   whilst connected are probed at the next failover.
+
+   The backoff, the connect timeout and the request timeouts share a
+   timer on the event queue, set for whichever is due first.
+*/
+
+#define LINK_MAX_REQUESTS 4    // requests in flight
+#define LINK_BUFFER_SIZE 96    // for reassembling responses
+#define LINK_REQUEST_TIMEOUT 5000
+#define LINK_MIN_BACKOFF 500
+#define LINK_MAX_BACKOFF 32000
+#define LINK_CONNECT_TIMEOUT 2000  // a gateway slower than this is unreachable
+
+// TCP has its own checksum, so set this to FRAME_CRC only
+// if the gateway is reached over a less reliable hop
+#define LINK_FRAME_OPTIONS 0
+
+// called with the response, or NULL if the request failed
+typedef void (*LinkHandler)(uint8_t id, MessageBuffer *response);
+
+typedef struct {
+    uint8_t id;  // 0 when free
+    LinkHandler handler;
+    unsigned long sent_at;
+} LinkRequest;
+
+class GatewayLink
+{
+    private:
+        NetDriver *net;
+        Discovery *discovery;
+        EventQueue *events;
+        uint8_t socket;
+        uint8_t state;
+        uint8_t next_id;
+        uint8_t length_size;  // for the request being encoded
+        uint16_t backoff;  // ms before the next reconnect
+        int8_t current;    // index of the gateway probed or connected to
+        uint32_t gateway_ip;  // its address and port
+        uint16_t gateway_port;
+        unsigned long retry_at;
+        unsigned long connect_at;  // for the round trip time
+        LinkRequest requests[LINK_MAX_REQUESTS];
+        Timer timer;           // for whatever is due next
+        TxSink sink;
+        FrameReader reader;
+        MessageBuffer message;  // request being encoded
+        MessageBuffer response;
+        uint8_t buffer[LINK_BUFFER_SIZE];
+
+        // latency statistics
+        uint16_t responses;
+        unsigned long total_latency;
+        unsigned long max_latency;
+
+        static void on_timer(void *data);
+        void run();
+        void reschedule();
+        void start();
+        bool connect(uint8_t i);
+        int8_t fastest();
+        bool current_changed();
+        void drop(bool unreachable);
+        void retry_later();
+        void fail_requests();
+        LinkRequest *find_request(uint8_t id);
+
+    public:
+        GatewayLink();
+        void begin(NetDriver *driver, uint8_t s, Discovery *finder,
+                   EventQueue *queue);
+        bool is_connected();
+        bool is_connecting();
+        int8_t current_gateway();
+
+        MessageBuffer *start_request(uint16_t length);
+        uint8_t send_request(LinkHandler handler);
+
+        // called by the transport for events on the link's socket
+        void connected();
+        void readable();
+        void closed();
+        void gateway_changed();
+
+        void print_stats();
+};
+
+#endif
@@ -0,0 +1,239 @@
+#include <Arduino.h>
+#include "WSEvent.h"
+#include "NetDriver.h"
+#include "Idle.h"
+
+#if defined(__AVR__)
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+
+// kept by the Arduino core's Timer0 interrupt, which
+// stops in power down, so they are moved on by hand
+extern volatile unsigned long timer0_millis;
+extern volatile unsigned long timer0_overflow_count;
+
+static volatile bool watchdog_fired;
+
+ISR(WDT_vect)
+{
+    watchdog_fired = true;
+}
+
+static void stop_watchdog()
+{
+    wdt_reset();
+    MCUSR &= ~_BV(WDRF);
+    WDTCSR = _BV(WDCE) | _BV(WDE);
+    WDTCSR = 0;
+}
+#endif
+
+IdleManager::IdleManager()
+{
+    events = NULL;
+    net = NULL;
+    sources = WAKE_NETWORK | WAKE_TIMER;
+    mode = IDLE_AWAKE;
+    sleeps[IDLE_AWAKE] = sleeps[IDLE_IDLE] = sleeps[IDLE_POWER_DOWN] = 0;
+    asleep = asleep_us = 0;
+    wakes = total_latency = max_latency = 0;
+}
+
+void IdleManager::begin(EventQueue *queue, NetDriver *driver)
+{
+    events = queue;
+    net = driver;
+    started_at = millis();
+}
+
+// the sources that can and need to wake the MCU, by default the
+// network and timers, without WAKE_NETWORK the network is polled
+// and WAKE_PERIPHERAL needs the clocks running, so either
+// limits the MCU to idle
+void IdleManager::set_wake_sources(uint8_t wake_sources)
+{
+    sources = wake_sources;
+}
+
+// call at the end of loop(), with busy set if the caller has work
+// that needs the clocks running, see Transport::is_idle()
+void IdleManager::sleep(bool busy)
+{
+    unsigned long ms = 0;
+    uint8_t next = choose_mode(busy, &ms);
+
+    if (next == IDLE_AWAKE)
+        return;
+
+    // the loop has handled the last wake
+    if (mode != IDLE_AWAKE) {
+        unsigned long latency = micros() - woke_at;
+
+        ++wakes;
+        total_latency += latency;
+
+        if (latency > max_latency)
+            max_latency = latency;
+    }
+
+    mode = next;
+    ++sleeps[mode];
+
+    if (mode == IDLE_POWER_DOWN)
+        power_down(ms);
+    else
+        idle(ms);
+
+    woke_at = micros();
+}
+
+// the deepest mode allowed, with the time to sleep in ms
+uint8_t IdleManager::choose_mode(bool busy, unsigned long *ms)
+{
+    unsigned long wait = events->idle_time();
+
+    // the driver's interrupt is masked until service() handles it
+    if (!wait || net->has_deferred())
+        return IDLE_AWAKE;
+
+    if (busy || wait < IDLE_MIN_SLEEP || !(sources & WAKE_NETWORK) ||
+        (sources & WAKE_PERIPHERAL)) {
+        *ms = 1;
+        return IDLE_IDLE;
+    }
+
+    *ms = (wait < IDLE_MAX_SLEEP ? wait : IDLE_MAX_SLEEP);
+    return IDLE_POWER_DOWN;
+}
+
+#if defined(__AVR__)
+
+// powers down for the largest watchdog period up to ms, returns the
+// time asleep if the watchdog woke the MCU, or 0 if something else did
+unsigned long IdleManager::power_down(unsigned long ms)
+{
+    uint8_t period = 0, adc = ADCSRA;
+    unsigned long slept = 0;
+
+    // 16ms doubled up to 9 times
+    while (period < 9 && ((unsigned long)IDLE_MIN_SLEEP << (period + 1)) <= ms)
+        ++period;
+
+    Serial.flush();  // the UART stops too
+    ADCSRA &= ~_BV(ADEN);
+    watchdog_fired = false;
+
+    cli();
+
+    // an event may have been queued, or an interrupt deferred
+    // during SPI transfers, since choose_mode()
+    if (!events->is_empty() || net->has_deferred()) {
+        sei();
+        ADCSRA = adc;
+        return 0;
+    }
+
+    wdt_reset();
+    WDTCSR = _BV(WDCE) | _BV(WDE);
+    WDTCSR = _BV(WDIE) | (period & 8 ? _BV(WDP3) : 0) | (period & 7);
+    set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+    sleep_enable();
+    sei();       // the next instruction runs before any interrupt
+    sleep_cpu();
+    sleep_disable();
+
+    cli();
+    stop_watchdog();
+
+    if (watchdog_fired) {
+        slept = (unsigned long)IDLE_MIN_SLEEP << period;
+        timer0_millis += slept;
+        timer0_overflow_count += slept * 125 / 128;  // 1024us each
+    }
+
+    sei();
+    ADCSRA = adc;
+    add_asleep(slept * 1000);
+    return slept;
+}
+
+// sleeps until the next interrupt
+void IdleManager::idle(unsigned long ms)
+{
+    unsigned long start = micros();
+
+    cli();
+
+    if (!events->is_empty() || net->has_deferred()) {
+        sei();
+        return;
+    }
+
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
+    add_asleep(micros() - start);
+}
+
+#else
+
+// emulated by waiting for network activity for the watchdog period
+unsigned long IdleManager::power_down(unsigned long ms)
+{
+    uint8_t period = 0;
+    unsigned long start = micros(), slept;
+
+    while (period < 9 && ((unsigned long)IDLE_MIN_SLEEP << (period + 1)) <= ms)
+        ++period;
+
+    net->wait_for_activity((unsigned long)IDLE_MIN_SLEEP << period);
+    slept = micros() - start;
+    add_asleep(slept);
+    return slept / 1000;
+}
+
+// emulated by waiting for up to a tick of millis()
+void IdleManager::idle(unsigned long ms)
+{
+    unsigned long start = micros();
+
+    net->wait_for_activity(ms);
+    add_asleep(micros() - start);
+}
+
+#endif
+
+void IdleManager::add_asleep(unsigned long us)
+{
+    asleep_us += us;
+    asleep += asleep_us / 1000;
+    asleep_us %= 1000;
+}
+
+// the percentage of the time since begin() spent awake
+uint8_t IdleManager::get_duty_cycle()
+{
+    unsigned long total = millis() - started_at;
+
+    if (!total || asleep >= total)
+        return (total ? 0 : 100);
+
+    return 100 - (uint8_t)(asleep * 100 / total);
+}
+
+void IdleManager::print_stats()
+{
+    Serial.print(F("idle sleeps = "));
+    Serial.print(sleeps[IDLE_IDLE]);
+    Serial.print(F(", power downs = "));
+    Serial.print(sleeps[IDLE_POWER_DOWN]);
+    Serial.print(F(", duty cycle = "));
+    Serial.print(get_duty_cycle());
+    Serial.print(F("%, mean wake latency = "));
+    Serial.print(wakes ? total_latency / wakes : 0);
+    Serial.print(F("us, max wake latency = "));
+    Serial.print(max_latency);
+    Serial.println(F("us"));
+}
@@ -0,0 +1,81 @@
+// low power idling when there is nothing to do
+
+#ifndef _WOTF_IDLE
+#define _WOTF_IDLE
+
+/*
+   loop() calls sleep() after dispatching events and serving the
+   transport. When no event is queued, no task is ready, no timer is
+   due and the driver hasn't deferred an interrupt, which leaves its
+   interrupt masked until service(), it puts the MCU into the deepest
+   sleep mode that the application's wake sources allow:
+
+   - power down stops the clocks, and only external interrupts, such
+     as the W5100 INT pin, pin change interrupts and the watchdog can
+     wake the MCU. The watchdog is set for the largest period up to the
+     next timer, up to IDLE_MAX_SLEEP when none are running. The
+     transport's deadlines are all timers, so nothing else limits it.
+     millis() is stopped too, so it is moved on by the watchdog period
+     on waking, but when an interrupt wakes the MCU first, the time
+     asleep isn't known and millis() falls behind. Timers are then
+     late, but never early.
+
+   - idle stops the CPU but not the peripherals, so anything can wake
+     it, and the millis() interrupt does every 1024us. It is used when
+     a timer is due within the shortest watchdog period, when the
+     caller is busy, e.g. with data waiting to be sent, and when the
+     application needs other wake sources such as serial input.
+
+   The statistics give the duty cycle, the fraction of the time awake,
+   and the wake latency, from waking until the loop has handled
+   whatever woke it and is ready to sleep again. On hosts, sleeping is
+   emulated by waiting for network activity for the same periods.
+*/
+
+#define IDLE_MAX_SLEEP 8192 // ms, the longest watchdog period
+#define IDLE_MIN_SLEEP 16   // ms, the shortest watchdog period
+
+// wake sources needed by the application, see set_wake_sources()
+#define WAKE_NETWORK 1      // the W5100 INT pin, on INT0 or INT1
+#define WAKE_TIMER 2        // timers on the event queue
+#define WAKE_PIN_CHANGE 4
+#define WAKE_PERIPHERAL 8   // anything else, e.g. serial input
+
+// sleep modes
+#define IDLE_AWAKE 0
+#define IDLE_IDLE 1
+#define IDLE_POWER_DOWN 2
+
+class IdleManager
+{
+    private:
+        EventQueue *events;
+        NetDriver *net;
+        uint8_t sources;
+        uint8_t mode;            // of the last sleep
+        unsigned long started_at;  // ms, for the duty cycle
+        unsigned long woke_at;     // us
+
+        // statistics
+        unsigned long sleeps[3];   // by mode
+        unsigned long asleep;      // ms
+        unsigned long asleep_us;   // part of a ms
+        unsigned long wakes;
+        unsigned long total_latency;  // us
+        unsigned long max_latency;
+
+        uint8_t choose_mode(bool busy, unsigned long *ms);
+        unsigned long power_down(unsigned long ms);
+        void idle(unsigned long ms);
+        void add_asleep(unsigned long us);
+
+    public:
+        IdleManager();
+        void begin(EventQueue *queue, NetDriver *driver);
+        void set_wake_sources(uint8_t wake_sources);
+        void sleep(bool busy);
+        uint8_t get_duty_cycle();
+        void print_stats();
+};
+
+#endif
@@ -4,6 +4,7 @@
 #include <Arduino.h>
 #include "Strings.h"
 #include "NodePool.h"
+#include "StringPool.h"
 #include "AvlNode.h"
 #include "Names.h"
 #include "JSON.h"
@@ -11,6 +12,7 @@
 
 static WotNodePool *node_pool;
 static boolean gc_phase;
+static CoreThing *print_thing; // for printing names in place of symbols
 
 void JSON::initialise_pool(WotNodePool *wot_node_pool)
 {
@@ -85,9 +87,13 @@ JSON * JSON::parse_object(Lexer *lexer)
         if (token != String_token)
             break;
             
-        Symbol symbol = lexer->table->symbol(lexer->token_src,
+        unsigned int symbol = lexer->table->symbol(lexer->token_src,
                                         lexer->token_len);
-                                        
+
+        // symbols are used as AVL keys with 0 reserved for null
+        if (symbol >= AVL_MAX_INDEX)
+            break;
+
         token = lexer->get_token();
         
         if (token != Colon_token)
@@ -98,7 +104,7 @@ JSON * JSON::parse_object(Lexer *lexer)
         if (!value)
             break;
             
-        object->insert_property(symbol, value);
+        object->insert_property((Symbol)symbol, value);
         token = lexer->get_token();
         
         if (token == Object_stop_token)
@@ -151,19 +157,27 @@ JSON * JSON::parse_array(Lexer *lexer)
 
 void JSON::print_string(const char *name, unsigned int length)
 {
-    unsigned int i;
-    
     Serial.print(F("\""));
-
-    for (i = 0; i < length; ++i)
-        Serial.print((Strings::get_char(name++)));
-        
+    Strings::write(name, length);
     Serial.print(F("\""));
 }
 
 void JSON::print_name_value(AvlKey key, AvlValue value, void *context)
 {
-    Serial.print(F(" ")); Serial.print((unsigned int)key); Serial.print(F(" : "));
+    unsigned int length;
+    const char *name = null;
+
+    if (print_thing)
+        name = print_thing->get_name((Symbol)(key - 1), &length);
+
+    Serial.print(F(" "));
+
+    if (name)
+        print_string(name, length);
+    else
+        Serial.print((unsigned int)key);
+
+    Serial.print(F(" : "));
     ((JSON *)value)->print();
     
     if ((void *)value != context)
@@ -178,6 +192,14 @@ void JSON::print_array_item(AvlKey key, AvlValue value, void *context)
         Serial.print(F(","));
 }
 
+// print using the thing's names for the object properties
+void JSON::print(CoreThing *thing)
+{
+    print_thing = thing;
+    print();
+    print_thing = null;
+}
+
 void JSON::print()
 {
     switch (get_tag())
@@ -320,6 +342,11 @@ void JSON::free()
 {
     Serial.print("freeing JSON node, tag "); Serial.println(get_tag());
     
+    // drop reference to interned string, the tag is Unused_t
+    // if this node has already been freed
+    if (get_tag() == String_t)
+        StringPool::release(variant.str, get_str_length());
+    
     // safe against already freed node
     node_pool->free((wot_node_pool_t *)this);
 }
@@ -419,20 +446,36 @@ JSON * JSON::new_string(char *str)
     return new_string(str, Strings::strlen(str));
 }
 
+// strings are interned, so that strings in RAM, e.g. in a
+// receive buffer, are copied, and equal strings are shared
 JSON * JSON::new_string(char *str, unsigned int length)
 {
+    const char *interned = StringPool::intern(str, length);
+    
+    if (!interned)
+        return null;
+        
     JSON *node = JSON::new_node();
     
     if (node)
     {
         node->set_tag(String_t);
-        node->variant.str = str;
+        node->variant.str = (char *)interned;
         node->set_str_length(length);
     }
+    else
+        StringPool::release(interned, length);
     
     return node;
 }
 
+// interned strings are equal if and only if they share storage
+boolean JSON::same_string(JSON *other)
+{
+    return get_tag() == String_t && other && other->get_tag() == String_t &&
+            variant.str == other->variant.str;
+}
+
 
 JSON * JSON::new_object()
 {
@@ -822,18 +865,20 @@ Json_Token JSON::Lexer::get_string()
 {
     next_byte();
     token_src = (char *)src;
-    token_len = 0;
     
-    while (length > 0)
+    const char *quote = Strings::find(src, length, '"');
+    
+    if (quote)
     {
-        --length;
-        
-        if (Strings::get_char(src++) == '"')
-            return String_token;
-        
-        ++token_len;
+        token_len = quote - src;
+        length -= token_len + 1;
+        src = quote + 1;
+        return String_token;
     }
     
+    token_len = length;
+    src += length;
+    length = 0;
     Serial.println(F("Missing trailing quote mark"));
     return Error_token;
 }
@@ -26,6 +26,7 @@ typedef uint8_t Symbol;  // used in place of names to save memory & message size
 #define JSON_SYMBOL_BASE 10
 
 // forward references
+class CoreThing;
 class Thing;
 class Proxy;
 
@@ -61,7 +62,9 @@ class JSON
         boolean marked(boolean phase);
 
         void print();
+        void print(CoreThing *thing);
         Json_Tag get_tag();
+        boolean same_string(JSON *other);
         
         void insert_property(Symbol symbol, JSON *value);
         JSON * retrieve_property(Symbol symbol);
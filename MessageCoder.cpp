@@ -50,6 +50,7 @@
 
 #include <stdint.h>
 #include <Arduino.h>
+#include "Strings.h"
 #include "MessageCoder.h"
 
 void MessageBuffer::set_buffer(unsigned char *buf, unsigned len)
@@ -59,6 +60,7 @@ void MessageBuffer::set_buffer(unsigned char *buf, unsigned len)
         uint16_t u;
     } num;
 
+    sink = NULL;
     buffer = buf;
     length = len;
     size = index = 0;
@@ -68,6 +70,21 @@ void MessageBuffer::set_buffer(unsigned char *buf, unsigned len)
     big_endian = (num.bytes[0] == 1 ? true : false);
 }
 
+// wraps len bytes of received data for decoding
+void MessageBuffer::set_data(unsigned char *buf, unsigned len)
+{
+    set_buffer(buf, len);
+    size = len;
+}
+
+// encode into the sink rather than RAM, only the size is tracked
+// so the buffer can't then be decoded, set_buffer() clears the sink
+void MessageBuffer::set_sink(MessageSink *dst)
+{
+    set_buffer(NULL, 0);
+    sink = dst;
+}
+
 void MessageBuffer::restart()
 {
     index = 0;
@@ -122,7 +139,13 @@ unsigned int MessageBuffer::view_byte()
 
 boolean MessageBuffer::put_byte(unsigned char c)
 {
-    if (size < length)
+    if (sink) {
+        if (sink->put_byte(c)) {
+            ++size;
+            return true;
+        }
+    }
+    else if (size < length)
     {
         buffer[size++] = c & 255;
         return true;
@@ -132,6 +155,26 @@ boolean MessageBuffer::put_byte(unsigned char c)
     return false;
 }
 
+// copy a string from RAM or flash in one go
+boolean MessageBuffer::put_bytes(const char *src, unsigned int len)
+{
+    if (sink) {
+        if (sink->put_bytes(src, len)) {
+            size += len;
+            return true;
+        }
+    }
+    else if (len <= length - size)
+    {
+        Strings::memcpy((char *)buffer + size, src, len);
+        size += len;
+        return true;
+    }
+
+    overflow = true;
+    return false;
+}
+
 boolean MessageCoder::decode_object(MessageBuffer *buffer)
 {
     unsigned int c;
@@ -582,27 +625,17 @@ void MessageCoder::encode_false(MessageBuffer *buffer)
 
 void MessageCoder::encode_string(MessageBuffer *buffer, unsigned char *str)
 {
-    unsigned char c, *p = (unsigned char *)str;
+    const char *p = (const char *)str;
     
     buffer->put_byte(WOT_STRING);
-    
-    while ((c = *p++))
-        buffer->put_byte(c);
-        
+    buffer->put_bytes(p, Strings::strlen(p));
     buffer->put_byte(0);
 }
 
 #if defined(pgm_read_byte)
 void MessageCoder::encode_string(MessageBuffer *buffer, const __FlashStringHelper * str)
 {
-    unsigned char c, *p = (unsigned char *)str;
-    
-    buffer->put_byte(WOT_STRING);
-    
-    while ((c = pgm_read_byte(p++)))
-        buffer->put_byte(c);
-        
-    buffer->put_byte(0);
+    encode_string(buffer, ((unsigned char *)str)+PROGMEM_BOUNDARY);
 }
 #endif
 
@@ -35,9 +35,21 @@
 
 #define WOT_SYM_BASE 55
 
+// destination for encoded bytes in place of the buffer's RAM,
+// e.g. TxSink writes them straight into a socket's TX buffer
+
+class MessageSink
+{
+    public:
+        virtual ~MessageSink() {}
+        virtual bool put_byte(unsigned char c) = 0;
+        virtual bool put_bytes(const char *src, unsigned int len) = 0;
+};
+
 class MessageBuffer
 {
     private:
+        MessageSink *sink;
         unsigned char *buffer;
         unsigned int length;
         unsigned int index;
@@ -48,6 +60,8 @@ class MessageBuffer
     public:
         boolean is_big_endian();
         void set_buffer(unsigned char *buf, unsigned len);
+        void set_sink(MessageSink *dst);
+        void set_data(unsigned char *buf, unsigned len);
         void reset();
         void restart();
         unsigned char * get_pointer();
@@ -57,6 +71,7 @@ class MessageBuffer
         unsigned int view_byte();
         unsigned int remaining();
         bool put_byte(unsigned char c);
+        bool put_bytes(const char *src, unsigned int len);
 };
 
 class MessageCoder
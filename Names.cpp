@@ -1,41 +1,137 @@
 /* simple fixed size hashtable with no chaining for use on constrained devices */
 
 #include <Arduino.h>
+#if !defined(WOT_GATEWAY) && defined(__AVR__)
+#include <avr/eeprom.h>
+#endif
 #include "Strings.h"
 #include "Names.h"
 
+#if defined(WOT_GATEWAY)
+static Names shared_names; // dictionary shared by all things and proxies
+#elif defined(__AVR__)
+static unsigned int eeprom_next = NAMES_EEPROM_START;
+#endif
+
 Names::Names()
 {
     this->entries = 0;
+#if defined(WOT_GATEWAY)
+    this->view = null;
+    this->owner = (this == &shared_names);
+    this->capacity = 0;
+    this->room = 0;
+    this->slots = null;
+    this->table = null;
+#else
     memset(&table[0], 0, sizeof(HashEntry) * HASH_TABLE_SIZE);    
+#endif
+}
+
+#if defined(WOT_GATEWAY)
+// per-thing table which interns names in the shared dictionary
+Names::Names(SymbolView *view)
+{
+    this->entries = 0;
+    this->view = view;
+    this->owner = false;
+    this->capacity = 0;
+    this->room = 0;
+    this->slots = null;
+    this->table = null;
+}
+
+Names::~Names()
+{
+    if (owner)
+    {
+        for (unsigned int i = 0; i < entries; ++i)
+            ::free((void *)table[i].name);
+    }
+
+    ::free(slots);
+    ::free(table);
+}
+
+Names *Names::dictionary()
+{
+    return &shared_names;
+}
+
+// returns null if the symbol isn't defined
+const char *Names::name(unsigned int symbol, unsigned int *length)
+{
+    if (view)
+        return shared_names.name(view->shared(symbol), length);
+
+    if (symbol >= entries)
+        return null;
+
+    *length = table[symbol].length;
+    return table[symbol].name;
 }
+#endif
 
 float Names::used()
 {
     // return percentage table is filled
+#if defined(WOT_GATEWAY)
+    if (view)
+        return shared_names.used();
+
+    if (!capacity)
+        return 0.0;
+
+    return 100.0 * entries / (1.0 * capacity);
+#else
     return 100.0 * entries / (1.0 * HASH_TABLE_SIZE);
+#endif
 }
 
 void Names::print()
 {
+#if defined(WOT_GATEWAY)
+    if (view)
+    {
+        Serial.print(F("Thing view has "));
+        Serial.print(view->size());
+        Serial.println(F(" symbols"));
+
+        for (unsigned int i = view->size(); i > 0; )
+        {
+            unsigned int length;
+            const char *p = name(--i, &length);
+            Serial.print("  ");
+            Strings::write(p, length);
+
+            Serial.print(" : ");
+            Serial.print(i);
+            Serial.print(" -> ");
+            Serial.println(view->shared(i));
+        }
+
+        return;
+    }
+#endif
+
     Serial.print(F("Hash table has "));
     Serial.print(entries);
     Serial.print(F(" entries, "));
     Serial.print(used());
     Serial.println(F("% full"));
     
+#if defined(WOT_GATEWAY)
+    for (unsigned int i = entries; i > 0; )
+#else
     for (int i = HASH_TABLE_SIZE; i > 0; )
+#endif
     {
         HashEntry *entry = table + (--i);
         
         if (entry->name)
         {
-            char *p = (char *)entry->name;
             Serial.print("  ");
-            
-            for (int j = entry->length; j; --j)
-                Serial.print(Strings::get_char(p++));
-                          
+            Strings::write(entry->name, entry->length);
             Serial.print(" : ");
             Serial.println(entry->symbol);
         }
@@ -43,23 +139,10 @@ void Names::print()
 
 }
 
-unsigned int Names::hash(const char *name, unsigned int length)
+unsigned int Names::overflow()
 {
-    // Jenkins One-at-a-Time hash
-    unsigned h = 0;
-
-    while (length--)
-    {
-        h += (unsigned char)Strings::get_char(name++);
-        h += ( h << 10 );
-        h ^= ( h >> 6 );
-    }
-
-    h += ( h << 3 );
-    h ^= ( h >> 11 );
-    h += ( h << 15 );
-
-    return h;
+    Serial.println(F("Error: exhausted symbol table"));
+    return NAMES_OVERFLOW;
 }
 
 #if defined(pgm_read_byte)
@@ -74,10 +157,241 @@ unsigned int Names::symbol(const char *name)
     return symbol(name, Strings::strlen(name));
 }
 
+#if defined(WOT_GATEWAY)
+
+unsigned int Names::symbol(const char *name, unsigned int length)
+{
+    if (view)
+    {
+        unsigned int shared = shared_names.symbol(name, length);
+
+        if (shared == NAMES_OVERFLOW)
+            return shared;
+
+        return view->define(shared);
+    }
+
+    unsigned int hashval = Strings::hash(name, length);
+    unsigned int mask = capacity - 1;
+    unsigned int index = hashval & mask;
+
+    if (capacity)
+    {
+        while (slots[index])
+        {
+            HashEntry *entry = table + slots[index] - 1;
+
+            // symbol already defined
+            if (entry->hash == hashval &&
+                !Strings::strcmp(entry->name, entry->length, name, length))
+                return entry->symbol;
+
+            index = (index + 1) & mask;
+        }
+    }
+
+    // need to define new symbol, first growing the table if this
+    // would take it past the load factor, as beyond that the probe
+    // sequences get long and each probe costs a cache miss
+    if (100 * (entries + 1) > NAMES_MAX_LOAD * capacity)
+    {
+        if (!grow())
+            return overflow();
+
+        mask = capacity - 1;
+        index = hashval & mask;
+
+        while (slots[index])
+            index = (index + 1) & mask;
+    }
+
+    if (entries >= room)
+    {
+        unsigned int more = (room ? 2 * room : NAMES_INITIAL_SIZE);
+        HashEntry *bigger = (HashEntry *)realloc(table, more * sizeof(HashEntry));
+
+        if (!bigger)
+            return overflow();
+
+        table = bigger;
+        room = more;
+    }
+
+    // the shared dictionary outlives the models, e.g. those
+    // received for proxies, so it needs its own copy of names
+    if (owner)
+    {
+        char *copy = (char *)malloc(length ? length : 1);
+
+        if (!copy)
+            return overflow();
+
+        Strings::memcpy(copy, name, length);
+        name = copy;
+    }
+
+    HashEntry *entry = table + entries;
+    entry->name = name;
+    entry->length = length;
+    entry->hash = hashval;
+    entry->symbol = entries++;
+    slots[index] = entries;
+    return entry->symbol;
+}
+
+// double the number of slots and reinsert the entries using
+// their stored hash values, the entries themselves don't move
+boolean Names::grow()
+{
+    unsigned int size = (capacity ? 2 * capacity : NAMES_INITIAL_SIZE);
+
+    if (size > NAMES_MAX_SIZE)
+        return false;
+
+    unsigned int *bigger = (unsigned int *)calloc(size, sizeof(unsigned int));
+
+    if (!bigger)
+        return false;
+
+    unsigned int mask = size - 1;
+
+    for (unsigned int i = 0; i < entries; ++i)
+    {
+        unsigned int index = table[i].hash & mask;
+
+        while (bigger[index])
+            index = (index + 1) & mask;
+
+        bigger[index] = i + 1;
+    }
+
+    ::free(slots);
+    slots = bigger;
+    capacity = size;
+    return true;
+}
+
+SymbolView::SymbolView()
+{
+    count = 0;
+    room = 0;
+    capacity = 0;
+    shared_symbols = null;
+    slots = null;
+}
+
+void SymbolView::clear()
+{
+    ::free(shared_symbols);
+    ::free(slots);
+    count = room = capacity = 0;
+    shared_symbols = slots = null;
+}
+
+unsigned int SymbolView::size()
+{
+    return count;
+}
+
+// returns NAMES_OVERFLOW if the shared symbol isn't in this view
+unsigned int SymbolView::local(unsigned int shared)
+{
+    if (capacity)
+    {
+        // shared symbols are assigned sequentially and thus
+        // already well distributed without further hashing
+        unsigned int mask = capacity - 1;
+        unsigned int index = shared & mask;
+
+        while (slots[index])
+        {
+            unsigned int symbol = slots[index] - 1;
+
+            if (shared_symbols[symbol] == shared)
+                return symbol;
+
+            index = (index + 1) & mask;
+        }
+    }
+
+    return NAMES_OVERFLOW;
+}
+
+unsigned int SymbolView::shared(unsigned int local)
+{
+    if (local < count)
+        return shared_symbols[local];
+
+    return NAMES_OVERFLOW;
+}
+
+// get local symbol, assigning the next one if needed
+unsigned int SymbolView::define(unsigned int shared)
+{
+    unsigned int symbol = local(shared);
+
+    if (symbol != NAMES_OVERFLOW)
+        return symbol;
+
+    if (100 * (count + 1) > NAMES_MAX_LOAD * capacity && !grow())
+        return NAMES_OVERFLOW;
+
+    if (count >= room)
+    {
+        unsigned int more = (room ? 2 * room : NAMES_VIEW_SIZE);
+        unsigned int *bigger = (unsigned int *)realloc(shared_symbols,
+                                        more * sizeof(unsigned int));
+
+        if (!bigger)
+            return NAMES_OVERFLOW;
+
+        shared_symbols = bigger;
+        room = more;
+    }
+
+    unsigned int mask = capacity - 1;
+    unsigned int index = shared & mask;
+
+    while (slots[index])
+        index = (index + 1) & mask;
+
+    shared_symbols[count] = shared;
+    slots[index] = ++count;
+    return count - 1;
+}
+
+boolean SymbolView::grow()
+{
+    unsigned int size = (capacity ? 2 * capacity : NAMES_VIEW_SIZE);
+    unsigned int *bigger = (unsigned int *)calloc(size, sizeof(unsigned int));
+
+    if (!bigger)
+        return false;
+
+    unsigned int mask = size - 1;
+
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        unsigned int index = shared_symbols[i] & mask;
+
+        while (bigger[index])
+            index = (index + 1) & mask;
+
+        bigger[index] = i + 1;
+    }
+
+    ::free(slots);
+    slots = bigger;
+    capacity = size;
+    return true;
+}
+
+#else
+
 unsigned int Names::symbol(const char *name, unsigned int length)
 {
     unsigned int i = HASH_TABLE_SIZE;
-    unsigned int hashval = hash(name, length);
+    unsigned int hashval = Strings::hash(name, length);
     unsigned int index = hashval % HASH_TABLE_SIZE;
     HashEntry *entry = 0;
     
@@ -87,11 +401,11 @@ unsigned int Names::symbol(const char *name, unsigned int length)
         if (!Strings::strcmp(entry->name, entry->length, name, length))
             return entry->symbol;
             
-        index = ++index % HASH_TABLE_SIZE;
+        index = (index + 1) % HASH_TABLE_SIZE;
     }
     
     // need to define new symbol
-    if (i && entry)
+    if (entry && !entry->name)
     {
         entry->name = name;
         entry->length = length;
@@ -99,5 +413,86 @@ unsigned int Names::symbol(const char *name, unsigned int length)
         return entry->symbol;
     }
     
+    return overflow();
+}
+
+
+// Save the offset and length of each name in the model to EEPROM
+// so that names can later be looked up from their symbols. Each
+// table is the model's address and the number of symbols followed
+// by a 16 bit offset and 8 bit length for each one. The tables are
+// saved in order of registration, and things are registered in the
+// same order on each restart, so the same addresses are used, and
+// EEPROM is only written if changed. Returns the table's address
+// for lookup(), or 0 if there is no room or a name is too long.
+#if defined(__AVR__)
+unsigned int Names::save(const char *model)
+{
+    unsigned int index = eeprom_next;
+
+    if (index + NAMES_TABLE_HEADER + NAMES_TABLE_ENTRY * entries > E2END + 1)
+    {
+        Serial.println(F("Error: no room in EEPROM for names"));
+        return 0;
+    }
+
+    for (unsigned int i = 0; i < HASH_TABLE_SIZE; ++i)
+    {
+        if (table[i].name && table[i].length > NAMES_MAX_LENGTH)
+        {
+            Serial.println(F("Error: name too long to save to EEPROM"));
+            return 0;
+        }
+    }
+
+    eeprom_update_word((uint16_t *)index, (uint16_t)model);
+    eeprom_update_word((uint16_t *)(index + 2), entries);
+
+    for (unsigned int i = 0; i < HASH_TABLE_SIZE; ++i)
+    {
+        HashEntry *entry = table + i;
+
+        if (entry->name)
+        {
+            unsigned int at = index + NAMES_TABLE_HEADER +
+                              NAMES_TABLE_ENTRY * entry->symbol;
+
+            eeprom_update_word((uint16_t *)at, (uint16_t)(entry->name - model));
+            eeprom_update_byte((uint8_t *)(at + 2), entry->length);
+        }
+    }
+
+    eeprom_next = index + NAMES_TABLE_HEADER + NAMES_TABLE_ENTRY * entries;
+    return index;
+}
+
+// find the name for a symbol in the table saved at address by
+// save(), the name is in the same memory as the model and isn't
+// null terminated, returns null if not found
+const char *Names::lookup(unsigned int address, unsigned int symbol,
+                            unsigned int *length)
+{
+    if (address && symbol < eeprom_read_word((const uint16_t *)(address + 2)))
+    {
+        unsigned int at = address + NAMES_TABLE_HEADER + NAMES_TABLE_ENTRY * symbol;
+
+        *length = eeprom_read_byte((const uint8_t *)(at + 2));
+        return (const char *)eeprom_read_word((const uint16_t *)address) +
+               eeprom_read_word((const uint16_t *)at);
+    }
+
+    return null;
+}
+#else
+unsigned int Names::save(const char *)
+{
     return 0;
 }
+
+const char *Names::lookup(unsigned int, unsigned int, unsigned int *)
+{
+    return null;
+}
+#endif
+
+#endif
@@ -12,19 +12,86 @@
 
 #define HASH_TABLE_SIZE  31
 
+// returned by symbol() when there is no room for a new name
+// note that 0 is a valid symbol and can't be used for this
+
+#define NAMES_OVERFLOW 0xFFFF
+
+// gateway builds have plenty of RAM and a heap, and can hold
+// thousands of names across many models, so WOT_GATEWAY selects
+// a table that grows as needed in place of the fixed size table
+
+#if defined(WOT_GATEWAY)
+#define NAMES_INITIAL_SIZE 32   // slots, must be a power of two
+#define NAMES_MAX_SIZE 16384    // slots, must be a power of two
+#define NAMES_MAX_LOAD 75       // percent full before growing
+#define NAMES_VIEW_SIZE 16      // initial slots for per-thing views
+#else
+// the table is discarded after setup, so the offset and length of
+// each name within its model is saved to EEPROM when the thing is
+// registered, allowing names to be recovered from symbols without
+// using RAM, EEPROM below NAMES_EEPROM_START is left free for
+// configuration
+#define NAMES_EEPROM_START 0x100
+#define NAMES_TABLE_HEADER 4    // model address and number of symbols
+#define NAMES_TABLE_ENTRY 3     // offset and length of each name
+#define NAMES_MAX_LENGTH 255    // to fit the length byte
+#endif
+
 #if defined(pgm_read_byte)
 #define PROGMEM_BOUNDARY 0x8000
 #endif
 
+#if defined(WOT_GATEWAY)
+
+// On a gateway, names are interned in a single dictionary shared by
+// all things and proxies, so that common names are only hashed and
+// stored once, and the shared symbols can be compared across things.
+// Each thing has a view that maps the shared symbols to and from the
+// symbols used for that thing's model, which are the ones sent in
+// messages, and which thus remain independent of other models.
+
+class SymbolView
+{
+    public:
+        SymbolView();
+        void clear();
+        unsigned int size();
+        unsigned int local(unsigned int shared);
+        unsigned int shared(unsigned int local);
+        unsigned int define(unsigned int shared);
+
+    private:
+        unsigned int count;
+        unsigned int room;
+        unsigned int capacity;
+        unsigned int *shared_symbols; // indexed by local symbol
+        unsigned int *slots; // local symbol + 1 indexed by shared symbol
+        boolean grow();
+};
+
+#endif
+
 class Names
 {
     public:
         Names();
+#if defined(WOT_GATEWAY)
+        Names(SymbolView *view);
+        ~Names();
+        static Names *dictionary();
+        const char *name(unsigned int symbol, unsigned int *length);
+#endif
 #if defined(pgm_read_byte)
         unsigned int symbol(const __FlashStringHelper *name);
 #endif
         unsigned int symbol(const char *name);
         unsigned int symbol(const char *name, unsigned int length);
+#if !defined(WOT_GATEWAY)
+        unsigned int save(const char *model);
+        static const char *lookup(unsigned int address, unsigned int symbol,
+                                    unsigned int *length);
+#endif
         void print();
         float used();
             
@@ -36,11 +103,32 @@ class Names
             const char *name;
             unsigned int length;
             unsigned int symbol;
+#if defined(WOT_GATEWAY)
+            unsigned int hash;  // saves calling strcmp on mismatches
+#endif
         };
 
         unsigned int entries;
+#if defined(WOT_GATEWAY)
+        SymbolView *view;  // null except for per-thing tables
+        boolean owner;  // true if names are copied into the table
+
+        // open addressing with linear probing over a power of two
+        // number of slots, each holding the symbol + 1 or 0 if empty,
+        // the entries themselves are kept in order of their symbols
+        unsigned int capacity;
+        unsigned int room;
+        unsigned int *slots;
+        HashEntry *table;
+        boolean grow();
+
+        // not defined, as copies would free the same memory twice
+        Names(const Names &);
+        Names &operator=(const Names &);
+#else
         HashEntry table[HASH_TABLE_SIZE];
-        unsigned int hash(const char *name, unsigned int length);
+#endif
+        unsigned int overflow();
 };
 
-#endif
\ No newline at end of file
+#endif
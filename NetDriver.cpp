@@ -0,0 +1,156 @@
+// methods shared by the network drivers
+
+#include <Arduino.h>
+#include "NetDriver.h"
+
+// MAC address - fixed for now but should be loaded from EEPROM
+const uint8_t NetDriver::default_mac[6] = {0x61, 0xf8, 0x1d, 0xbc, 0xf4, 0x2f};
+
+uint8_t NetDriver::udp_socket()
+{
+    return socket_count() - 1;
+}
+
+// configures the MAC address but no IP address, which
+// is then acquired in the background, see DHCP::begin()
+void NetDriver::begin(uint16_t port)
+{
+    delay(200); // not needed, here for luck
+    
+    const uint8_t zero[4] = {0, 0, 0, 0};
+    configure(default_mac, zero, zero, zero);
+    local_port = port;
+}
+
+void NetDriver::begin(uint8_t n0, uint8_t n1, uint8_t n2, uint8_t n3, uint16_t port)
+{
+    const uint8_t ip[4] = {n0, n1, n2, n3};
+    const uint8_t subnet[4] = {255, 255, 255, 0};
+    const uint8_t gateway[4] = {n0, n1, n2, 254};
+    
+    delay(200); // not needed, here for luck
+    
+    configure(default_mac, ip, subnet, gateway);
+    local_port = port;
+}
+
+// used on hosts to emulate sleeping until an interrupt, drivers
+// that can't tell when there is activity just wait for the time
+void NetDriver::wait_for_activity(unsigned long ms)
+{
+    delay(ms);
+}
+
+// true if the ISR left work for service(), such as an interrupt that
+// arrived during an SPI transfer, in which case the driver's interrupt
+// is masked and can't wake the MCU
+bool NetDriver::has_deferred()
+{
+    return false;
+}
+
+uint16_t NetDriver::get_local_port()
+{
+    return local_port;
+}
+
+void NetDriver::print_config()
+{
+    uint8_t n0, n1, n2, n3;
+    get_local_ip(&n0, &n1, &n2, &n3);
+    Serial.print(F("IP = "));
+    Serial.print(n0);
+    Serial.print(F("."));
+    Serial.print(n1);
+    Serial.print(F("."));
+    Serial.print(n2);
+    Serial.print(F("."));
+    Serial.print(n3);
+    Serial.print(F(", port = "));
+    Serial.println(local_port);
+}
+
+// use ip(192, 43, 244, 18) for "192.43.244.18"
+void NetDriver::set_ip(uint8_t s, uint8_t n0, uint8_t n1, uint8_t n2, uint8_t n3)
+{
+    uint32_t ip = n0;
+    ip <<= 8; ip |= n1;
+    ip <<= 8; ip |= n2;
+    ip <<= 8; ip |= n3;
+    set_ip(s, ip);
+}
+
+// returns how much of length bytes will fit in the socket's TX buffer,
+// the data is then written there with write_reserved() at offsets from
+// 0 up to the reserved length, and sent with commit(). Nothing is sent
+// until commit(), so a message can be encoded straight into the buffer.
+uint16_t NetDriver::reserve(uint8_t s, uint16_t length)
+{
+    uint16_t size = send_available(s);
+
+    return (length < size ? length : size);
+}
+
+// wait for data until ms milliseconds then return 0
+uint16_t NetDriver::wait_available(uint8_t s, uint16_t ms)
+{
+    unsigned long last_time = 0, now = millis();
+
+    while (ms) {
+        uint16_t size = receive_available(s);
+
+        if (size)
+            return size;
+
+        now = millis();
+
+        if (now != last_time)
+            --ms;
+
+        last_time = now;
+    }
+
+    return 0;
+}
+
+uint16_t NetDriver::flush_receive(uint8_t s)
+{
+    return skip(s, receive_available(s));
+}
+
+// receives the next UDP datagram, any part of it that doesn't fit
+// in the buffer is discarded, returns the length of data received
+uint16_t NetDriver::receive_from(uint8_t s, char *buffer, uint16_t length,
+                                  uint32_t *ip, uint16_t *port)
+{
+    uint8_t header[8];
+
+    if (peek(s, 0, (char *)header, 8) != 8)
+        return 0;
+
+    // ip is little endian but the header is big endian
+    *ip = header[0];
+    *ip <<= 8; *ip |= header[1];
+    *ip <<= 8; *ip |= header[2];
+    *ip <<= 8; *ip |= header[3];
+    *port = 256 * header[4] + header[5];
+    uint16_t size = 256 * header[6] + header[7];
+
+    if (size > length)
+        size = length;
+
+    size = peek(s, 8, buffer, size);
+    skip_datagram(s);
+    return size;
+}
+
+// discards the next UDP datagram including its header
+uint16_t NetDriver::skip_datagram(uint8_t s)
+{
+    uint8_t header[8];
+
+    if (peek(s, 0, (char *)header, 8) != 8)
+        return 0;
+
+    return skip(s, 8 + 256 * header[6] + header[7]);
+}
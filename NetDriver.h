@@ -0,0 +1,113 @@
+#ifndef _WOTF_NET_DRIVER
+#define _WOTF_NET_DRIVER
+
+/*
+   Socket level interface to network controllers, so that the
+   transport, DHCP and discovery code can be shared between them.
+
+   WiznetTCP is the implementation for the W5100, W5500TCP for the
+   W5500 and PosixTCP uses BSD sockets for testing on a host. Each
+   follows the W5100 socket model: sockets are numbered from 0, the
+   last socket is reserved for UDP, i.e. discovery, and the others
+   open as TCP sockets on the local port passed to begin(), or as UDP
+   sockets, e.g. the one that the transport gives to DHCP.
+
+   For UDP, the received data for each datagram is preceded by an 8
+   byte header with the sender's IPv4 address, port and the length of
+   the data, all big endian, as for the W5100.
+
+   Network events are queued with the socket number as their data.
+*/
+
+// socket status as for the W5100
+
+#define SOCK_CLOSED 0
+#define SOCK_INIT 19
+#define SOCK_LISTEN 20
+#define SOCK_SYNSENT 21
+#define SOCK_SYNRECV 22
+#define SOCK_ESTABLISHED 23
+#define SOCK_FIN_WAIT 24
+#define SOCK_CLOSING 26
+#define SOCK_TIME_WAIT 27
+#define SOCK_CLOSE_WAIT 28
+#define SOCK_LAST_ACK 29
+#define SOCK_UDP 34
+#define SOCK_IPRAW 50
+#define SOCK_MACRAW 66
+#define SOCK_PPPOE 95
+
+// largest number of sockets for any of the drivers
+#define NET_MAX_SOCKETS 8
+
+// used for DHCP and mDNS - should be loaded from EEPROM
+// *** FIX ME with EEPROM config module
+#define HOST_NAME "DAVES-ARDUINO"
+
+class EventQueue;
+
+class NetDriver
+{
+    protected:
+        uint16_t local_port;  // shared by the TCP sockets
+
+    public:
+        static const uint8_t default_mac[6];
+
+        virtual ~NetDriver() {}
+
+        virtual uint8_t socket_count() = 0;
+        uint8_t udp_socket();
+
+        virtual void begin(uint16_t port);  // for DHCP
+        virtual void begin(uint8_t n0, uint8_t n1, uint8_t n2, uint8_t n3, uint16_t port);
+        virtual void configure(const uint8_t *mac, const uint8_t *ip,
+                               const uint8_t *subnet, const uint8_t *gateway) = 0;
+        virtual void get_local_ip(uint8_t *n0, uint8_t *n1, uint8_t *n2, uint8_t *n3) = 0;
+        uint16_t get_local_port();
+
+        virtual void set_event_queue(EventQueue *queue) = 0;
+        virtual void enable_interrupts() = 0;
+        virtual void service() = 0;
+        virtual void wait_for_activity(unsigned long ms);  // see Idle.h
+        virtual bool has_deferred();
+
+        virtual bool has_buffers(uint8_t s) = 0;
+        virtual void open(uint8_t s) = 0;
+        virtual void open_udp(uint8_t s, uint16_t port, uint32_t group) = 0;
+        virtual bool listen(uint8_t s) = 0;
+        virtual bool connect(uint8_t s, uint8_t n0, uint8_t n1, uint8_t n2, uint8_t n3, uint16_t port) = 0;
+        virtual void disconnect(uint8_t s) = 0;
+        virtual void close(uint8_t s) = 0;
+        virtual uint8_t get_socket_status(uint8_t s) = 0;
+
+        virtual uint16_t send_available(uint8_t s) = 0;
+        virtual uint16_t send(uint8_t s, char *buffer, uint16_t length) = 0;
+        virtual uint16_t send_async(uint8_t s, char *buffer, uint16_t length) = 0;
+        virtual bool is_sending(uint8_t s) = 0;
+        virtual void keep_alive(uint8_t s) = 0;
+
+        // zero copy sending, see TxSink
+        uint16_t reserve(uint8_t s, uint16_t length);
+        virtual void write_reserved(uint8_t s, uint16_t offset, const char *buffer, uint16_t length) = 0;
+        virtual uint16_t commit(uint8_t s, uint16_t length) = 0;
+
+        virtual uint16_t receive_available(uint8_t s) = 0;
+        virtual uint16_t skip(uint8_t s, uint16_t length) = 0;
+        virtual uint16_t peek(uint8_t s, uint16_t offset, char *buffer, uint16_t length) = 0;
+        virtual uint16_t receive(uint8_t s, char *buffer, uint16_t length) = 0;
+
+        virtual void set_ip(uint8_t s, uint32_t ip) = 0;
+        virtual void set_port(uint8_t s, uint16_t port) = 0;
+
+        // shared by all of the drivers
+        void set_ip(uint8_t s, uint8_t n0, uint8_t n1, uint8_t n2, uint8_t n3);
+        void print_config();
+        uint16_t wait_available(uint8_t s, uint16_t ms);
+        uint16_t flush_receive(uint8_t s);
+        uint16_t receive_from(uint8_t s, char *buffer, uint16_t length,
+                               uint32_t *ip, uint16_t *port);
+        uint16_t skip_datagram(uint8_t s);
+};
+
+#endif
@@ -55,6 +55,35 @@ void *WotNodePool::allocate_node()
     return 0;
 }
 
+// allocate a run of adjacent nodes, e.g. for copies of strings
+void *WotNodePool::allocate_nodes(unsigned int count)
+{
+    if (count == 1)
+        return allocate_node();
+        
+    for (unsigned int attempt = 0; attempt < 2; ++attempt) {
+        if (used + count <= WOT_NODE_POOL_SIZE) {
+            unsigned int run = 0;
+            
+            for (unsigned int i = 0; i < WOT_NODE_POOL_SIZE; ++i) {
+                if (wot_pool[i].byte[0])
+                    run = 0;
+                else if (++run == count) {
+                    used += count;
+                    last_allocated = i;
+                    return (void *)(wot_pool + i + 1 - count);
+                }
+            }
+        }
+        
+        if (!attempt)
+            WebThings::collect_garbage();
+    }
+    
+    Serial.println(F("Error: no run of free nodes in pool"));
+    return 0;
+}
+
 void *WotNodePool::get_node(unsigned int index)
 {
     if (index < WOT_NODE_POOL_SIZE)
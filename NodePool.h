@@ -23,6 +23,7 @@ class WotNodePool
         unsigned int size();
         float percent_used();
         void *allocate_node();
+        void *allocate_nodes(unsigned int count);
         void *get_node(unsigned int index);
         wot_node_pool_t *get_pool();
         void free(void *node);
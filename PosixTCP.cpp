@@ -0,0 +1,561 @@
+#include <Arduino.h>
+#include "WSEvent.h"
+#include "NetDriver.h"
+#include "PosixTCP.h"
+
+// only for hosts with BSD sockets
+#if !defined(__AVR__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static void set_non_blocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+PosixTCP::PosixTCP()
+{
+    listener = -1;
+
+    for (uint8_t s = 0; s < POSIX_SOCKETS; ++s) {
+        fds[s] = -1;
+        status[s] = SOCK_CLOSED;
+        dest_ip[s] = 0;
+        dest_port[s] = 0;
+        rx_length[s] = 0;
+    }
+
+    // the kernel picks the interface so report the loopback address
+    local_ip[0] = 127;
+    local_ip[1] = 0;
+    local_ip[2] = 0;
+    local_ip[3] = 1;
+
+    events = NULL;
+    sending = 0;
+    local_port = 0;
+}
+
+PosixTCP::~PosixTCP()
+{
+    for (uint8_t s = 0; s < POSIX_SOCKETS; ++s)
+        close(s);
+
+    if (listener >= 0)
+        ::close(listener);
+}
+
+uint8_t PosixTCP::socket_count()
+{
+    return POSIX_SOCKETS;
+}
+
+bool PosixTCP::has_buffers(uint8_t)
+{
+    return true;
+}
+
+void PosixTCP::set_event_queue(EventQueue *queue)
+{
+    events = queue;
+}
+
+// there are no interrupts, service() polls the sockets instead
+void PosixTCP::enable_interrupts()
+{
+}
+
+// there's no DHCP as the host is already configured
+void PosixTCP::begin(uint16_t port)
+{
+    Serial.print(F("port = "));
+    Serial.println(port);
+    local_port = port;
+}
+
+// only the IP address is kept, and just for get_local_ip()
+void PosixTCP::configure(const uint8_t *, const uint8_t *ip,
+                         const uint8_t *, const uint8_t *)
+{
+    memcpy(local_ip, ip, 4);
+}
+
+void PosixTCP::get_local_ip(uint8_t *n0, uint8_t *n1, uint8_t *n2, uint8_t *n3)
+{
+    *n0 = local_ip[0];
+    *n1 = local_ip[1];
+    *n2 = local_ip[2];
+    *n3 = local_ip[3];
+}
+
+void PosixTCP::open(uint8_t s)
+{
+    close(s);
+    status[s] = SOCK_INIT;
+}
+
+void PosixTCP::open_udp(uint8_t s, uint16_t port, uint32_t group)
+{
+    struct sockaddr_in addr;
+    int on = 1;
+
+    close(s);
+
+    if ((fds[s] = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        Serial.println(F("Error: couldn't create UDP socket"));
+        return;
+    }
+
+    // share the port with other responders, e.g. for mDNS
+    setsockopt(fds[s], SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+    setsockopt(fds[s], SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
+    setsockopt(fds[s], SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(fds[s], (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        Serial.println(F("Error: couldn't bind UDP socket"));
+        close(s);
+        return;
+    }
+
+    if (group) {
+        struct ip_mreq mreq;
+
+        mreq.imr_multiaddr.s_addr = htonl(group);
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+
+        if (setsockopt(fds[s], IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+            Serial.println(F("Error: couldn't join multicast group"));
+
+        set_ip(s, group);
+        set_port(s, port);
+    }
+
+    status[s] = SOCK_UDP;
+}
+
+// the listener is opened for the first listening socket
+bool PosixTCP::open_listener()
+{
+    struct sockaddr_in addr;
+    int on = 1;
+
+    if (listener >= 0)
+        return true;
+
+    if ((listener = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return false;
+
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(local_port);
+
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        ::listen(listener, POSIX_SOCKETS) < 0) {
+        ::close(listener);
+        listener = -1;
+        return false;
+    }
+
+    set_non_blocking(listener);
+    return true;
+}
+
+bool PosixTCP::listen(uint8_t s)
+{
+    if (status[s] == SOCK_INIT && open_listener()) {
+        status[s] = SOCK_LISTEN;
+        return true;
+    }
+
+    return false;
+}
+
+bool PosixTCP::connect(uint8_t s, uint8_t n0, uint8_t n1, uint8_t n2, uint8_t n3, uint16_t port)
+{
+    struct sockaddr_in addr;
+
+    if (status[s] != SOCK_INIT || (fds[s] = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return false;
+
+    set_non_blocking(fds[s]);
+    set_ip(s, n0, n1, n2, n3);
+    set_port(s, port);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(dest_ip[s]);
+    addr.sin_port = htons(port);
+
+    if (::connect(fds[s], (struct sockaddr *)&addr, sizeof(addr)) < 0 &&
+        errno != EINPROGRESS) {
+        close(s);
+        return false;
+    }
+
+    // completed by check_connect()
+    status[s] = SOCK_SYNSENT;
+    return true;
+}
+
+// queues Connected or Timeout once a connect has completed
+void PosixTCP::check_connect(uint8_t s)
+{
+    struct pollfd p;
+    int error = 0;
+    socklen_t length = sizeof(error);
+
+    p.fd = fds[s];
+    p.events = POLLOUT;
+
+    if (poll(&p, 1, 0) <= 0)
+        return;
+
+    getsockopt(fds[s], SOL_SOCKET, SO_ERROR, &error, &length);
+
+    if (error) {
+        close(s);
+
+        if (events)
+            events->enqueue(Network_Timeout_Event_t, (void *)(size_t)s);
+    } else {
+        status[s] = SOCK_ESTABLISHED;
+
+        if (events)
+            events->enqueue(Network_Connected_Event_t, (void *)(size_t)s);
+    }
+}
+
+// sends FIN, Disconnected is queued when the peer closes its end
+void PosixTCP::disconnect(uint8_t s)
+{
+    if (status[s] == SOCK_ESTABLISHED) {
+        shutdown(fds[s], SHUT_WR);
+        status[s] = SOCK_FIN_WAIT;
+    } else
+        close(s);
+
+    sending &= ~(1 << s);
+}
+
+void PosixTCP::close(uint8_t s)
+{
+    if (fds[s] >= 0)
+        ::close(fds[s]);
+
+    fds[s] = -1;
+    status[s] = SOCK_CLOSED;
+    rx_length[s] = 0;
+    sending &= ~(1 << s);
+}
+
+uint8_t PosixTCP::get_socket_status(uint8_t s)
+{
+    return status[s];
+}
+
+void PosixTCP::set_ip(uint8_t s, uint32_t ip)
+{
+    dest_ip[s] = ip;
+}
+
+void PosixTCP::set_port(uint8_t s, uint16_t port)
+{
+    dest_port[s] = port;
+}
+
+// reads what the kernel has for the socket into its buffer,
+// one datagram at a time for UDP, returns the number of bytes
+uint16_t PosixTCP::fill(uint8_t s)
+{
+    uint16_t space = POSIX_RX_BUFFER - rx_length[s];
+    uint8_t *p = rx_buffer[s] + rx_length[s];
+    ssize_t n;
+
+    if (fds[s] < 0)
+        return 0;
+
+    if (status[s] == SOCK_UDP) {
+        uint8_t datagram[POSIX_RX_BUFFER];
+        struct sockaddr_in from;
+        socklen_t length = sizeof(from);
+
+        n = recvfrom(fds[s], datagram, sizeof(datagram), MSG_DONTWAIT,
+                     (struct sockaddr *)&from, &length);
+
+        // as for the W5100, datagrams are dropped when there's no room
+        if (n < 0 || n + 8 > space)
+            return 0;
+
+        uint32_t ip = ntohl(from.sin_addr.s_addr);
+        uint16_t port = ntohs(from.sin_port);
+
+        p[0] = (ip >> 24) & 255;
+        p[1] = (ip >> 16) & 255;
+        p[2] = (ip >> 8) & 255;
+        p[3] = ip & 255;
+        p[4] = port >> 8;
+        p[5] = port & 255;
+        p[6] = (n >> 8) & 255;
+        p[7] = n & 255;
+        memcpy(p + 8, datagram, n);
+        rx_length[s] += 8 + n;
+        return 8 + n;
+    }
+
+    if (status[s] != SOCK_ESTABLISHED && status[s] != SOCK_FIN_WAIT)
+        return 0;
+
+    if (!space)
+        return 0;
+
+    n = recv(fds[s], p, space, MSG_DONTWAIT);
+
+    if (n > 0) {
+        rx_length[s] += n;
+        return n;
+    }
+
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        // the peer has closed its end of the connection
+        status[s] = (status[s] == SOCK_FIN_WAIT ? SOCK_CLOSED : SOCK_CLOSE_WAIT);
+
+        if (events)
+            events->enqueue(Network_Disconnected_Event_t, (void *)(size_t)s);
+    }
+
+    return 0;
+}
+
+// accepts connections, completes connects and queues events for
+// received data and for sends that have been handed to the kernel
+void PosixTCP::service()
+{
+    for (uint8_t s = 0; s < POSIX_SOCKETS; ++s) {
+        uint8_t bit = 1 << s;
+        uint16_t received = 0, n;
+
+        if (status[s] == SOCK_LISTEN && listener >= 0) {
+            int fd = accept(listener, NULL, NULL);
+
+            if (fd >= 0) {
+                fds[s] = fd;
+                status[s] = SOCK_ESTABLISHED;
+
+                if (events)
+                    events->enqueue(Network_Connected_Event_t, (void *)(size_t)s);
+            }
+        } else if (status[s] == SOCK_SYNSENT)
+            check_connect(s);
+
+        if (sending & bit) {
+            sending &= ~bit;
+
+            if (events)
+                events->enqueue(Network_Sent_Event_t, (void *)(size_t)s);
+        }
+
+        while ((n = fill(s)))
+            received += n;
+
+        if (received && events)
+            events->enqueue(Network_Readable_Event_t, (void *)(size_t)s);
+    }
+}
+
+// waits for up to ms for anything that service() would act on,
+// which stands in for the W5100's INT pin when sleeping is emulated
+void PosixTCP::wait_for_activity(unsigned long ms)
+{
+    struct pollfd fds_to_poll[POSIX_SOCKETS + 1];
+    nfds_t n = 0;
+    bool listening = false;
+
+    if (sending)
+        return;
+
+    for (uint8_t s = 0; s < POSIX_SOCKETS; ++s) {
+        if (status[s] == SOCK_LISTEN)
+            listening = true;
+        else if (fds[s] >= 0) {
+            fds_to_poll[n].fd = fds[s];
+            fds_to_poll[n].events = (status[s] == SOCK_SYNSENT ? POLLOUT : POLLIN);
+            ++n;
+        }
+    }
+
+    if (listening && listener >= 0) {
+        fds_to_poll[n].fd = listener;
+        fds_to_poll[n].events = POLLIN;
+        ++n;
+    }
+
+    poll(fds_to_poll, n, ms);
+}
+
+uint16_t PosixTCP::send_available(uint8_t s)
+{
+    if (status[s] == SOCK_ESTABLISHED || status[s] == SOCK_UDP)
+        return POSIX_TX_BUFFER;
+
+    return 0;
+}
+
+// blocks until the kernel has taken all of the data
+uint16_t PosixTCP::send(uint8_t s, char *buffer, uint16_t length)
+{
+    uint16_t size = 0;
+    ssize_t n;
+
+    if (fds[s] < 0)
+        return 0;
+
+    if (status[s] == SOCK_UDP) {
+        struct sockaddr_in to;
+
+        memset(&to, 0, sizeof(to));
+        to.sin_family = AF_INET;
+        to.sin_addr.s_addr = htonl(dest_ip[s]);
+        to.sin_port = htons(dest_port[s]);
+
+        n = sendto(fds[s], buffer, length, 0, (struct sockaddr *)&to, sizeof(to));
+        return (n < 0 ? 0 : n);
+    }
+
+    while (size < length) {
+        n = ::send(fds[s], buffer + size, length - size, MSG_NOSIGNAL);
+
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                struct pollfd p;
+
+                p.fd = fds[s];
+                p.events = POLLOUT;
+                poll(&p, 1, 100);
+                continue;
+            }
+
+            Serial.println(F("send failed"));
+            break;
+        }
+
+        size += n;
+    }
+
+    return size;
+}
+
+// the send completes at once, but Sent is left for service()
+// so that the caller sees the same sequence as for the W5100
+uint16_t PosixTCP::send_async(uint8_t s, char *buffer, uint16_t length)
+{
+    uint16_t size = send(s, buffer, length);
+
+    if (size)
+        sending |= 1 << s;
+
+    return size;
+}
+
+bool PosixTCP::is_sending(uint8_t s)
+{
+    return (sending & (1 << s)) != 0;
+}
+
+// the kernel sends the keep alive packets once asked to
+void PosixTCP::keep_alive(uint8_t s)
+{
+    int on = 1;
+
+    if (status[s] == SOCK_ESTABLISHED)
+        setsockopt(fds[s], SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+}
+
+// the kernel has no TX ring to write into, so the reserved
+// data is staged in tx_buffer until it is committed
+void PosixTCP::write_reserved(uint8_t s, uint16_t offset, const char *buffer, uint16_t length)
+{
+    if (offset < POSIX_TX_BUFFER) {
+        if (length > POSIX_TX_BUFFER - offset)
+            length = POSIX_TX_BUFFER - offset;
+
+        memcpy(tx_buffer[s] + offset, buffer, length);
+    }
+}
+
+uint16_t PosixTCP::commit(uint8_t s, uint16_t length)
+{
+    if (length > POSIX_TX_BUFFER)
+        length = POSIX_TX_BUFFER;
+
+    return send_async(s, (char *)tx_buffer[s], length);
+}
+
+uint16_t PosixTCP::receive_available(uint8_t s)
+{
+    while (fill(s));
+
+    return rx_length[s];
+}
+
+uint16_t PosixTCP::skip(uint8_t s, uint16_t length)
+{
+    uint16_t size = receive_available(s);
+
+    if (size > length)
+        size = length;
+
+    memmove(rx_buffer[s], rx_buffer[s] + size, rx_length[s] - size);
+    rx_length[s] -= size;
+    return size;
+}
+
+uint16_t PosixTCP::peek(uint8_t s, uint16_t offset, char *buffer, uint16_t length)
+{
+    uint16_t size = receive_available(s);
+
+    if (size > offset) {
+        size -= offset;
+
+        if (size > length)
+            size = length;
+
+        memcpy(buffer, rx_buffer[s] + offset, size);
+    }
+    else
+        size = 0;
+
+    return size;
+}
+
+uint16_t PosixTCP::receive(uint8_t s, char *buffer, uint16_t length)
+{
+    uint16_t size = peek(s, 0, buffer, length);
+
+    if (size)
+        skip(s, size);
+
+    return size;
+}
+
+#endif
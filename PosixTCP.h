@@ -0,0 +1,84 @@
+#ifndef _POSIX_TCP
+#define _POSIX_TCP
+
+/*
+   NetDriver implementation over BSD sockets for running the
+   transport on a Linux or Mac host, e.g. for testing without a
+   W5100. It needs an Arduino compatibility header for Serial and
+   millis(), such as host/Arduino.h. The sockets are emulated as for the W5100: listening
+   sockets share a non-blocking listener on the local port, and the
+   connections are accepted by service(), which also polls for data
+   and queues the network events, so call it from the main loop.
+
+   Each socket buffers up to POSIX_RX_BUFFER bytes of received data.
+   UDP datagrams are stored with the same 8 byte header as the W5100
+   so that DHCP and discovery work unchanged. Sends are handed to the
+   kernel and complete straight away.
+*/
+
+#define POSIX_SOCKETS 4
+#define POSIX_RX_BUFFER 2048
+#define POSIX_TX_BUFFER 2048
+
+class PosixTCP : public NetDriver
+{
+    private:
+        int listener;  // shared by the listening sockets
+        int fds[POSIX_SOCKETS];
+        uint8_t status[POSIX_SOCKETS];
+        uint8_t local_ip[4];
+        uint32_t dest_ip[POSIX_SOCKETS];
+        uint16_t dest_port[POSIX_SOCKETS];
+        uint8_t rx_buffer[POSIX_SOCKETS][POSIX_RX_BUFFER];
+        uint16_t rx_length[POSIX_SOCKETS];
+        uint8_t tx_buffer[POSIX_SOCKETS][POSIX_TX_BUFFER];  // for commit()
+        EventQueue *events;
+        uint8_t sending;  // bit per socket with a Sent event to queue
+
+        bool open_listener();
+        uint16_t fill(uint8_t s);
+        void check_connect(uint8_t s);
+
+    public:
+        PosixTCP();
+        ~PosixTCP();
+        uint8_t socket_count();
+        bool has_buffers(uint8_t s);
+        void set_event_queue(EventQueue *queue);
+        void enable_interrupts();
+        void service();
+        void wait_for_activity(unsigned long ms);
+
+        using NetDriver::begin;
+        void begin(uint16_t port);
+        void configure(const uint8_t *mac, const uint8_t *ip,
+                       const uint8_t *subnet, const uint8_t *gateway);
+        void get_local_ip(uint8_t *n0, uint8_t *n1, uint8_t *n2, uint8_t *n3);
+
+        void open(uint8_t s);
+        void open_udp(uint8_t s, uint16_t port, uint32_t group);
+        bool listen(uint8_t s);
+        bool connect(uint8_t s, uint8_t n0, uint8_t n1, uint8_t n2, uint8_t n3, uint16_t port);
+        void disconnect(uint8_t s);
+        void close(uint8_t s);
+        uint8_t get_socket_status(uint8_t s);
+
+        uint16_t send_available(uint8_t s);
+        uint16_t send(uint8_t s, char *buffer, uint16_t length);
+        uint16_t send_async(uint8_t s, char *buffer, uint16_t length);
+        bool is_sending(uint8_t s);
+        void keep_alive(uint8_t s);
+        void write_reserved(uint8_t s, uint16_t offset, const char *buffer, uint16_t length);
+        uint16_t commit(uint8_t s, uint16_t length);
+
+        uint16_t receive_available(uint8_t s);
+        uint16_t skip(uint8_t s, uint16_t length);
+        uint16_t peek(uint8_t s, uint16_t offset, char *buffer, uint16_t length);
+        uint16_t receive(uint8_t s, char *buffer, uint16_t length);
+
+        using NetDriver::set_ip;
+        void set_ip(uint8_t s, uint32_t ip);
+        void set_port(uint8_t s, uint16_t port);
+};
+
+#endif
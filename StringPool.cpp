@@ -0,0 +1,135 @@
+/* interned strings allocated from the node pool */
+
+#include <Arduino.h>
+#include "Strings.h"
+#include "NodePool.h"
+#include "StringPool.h"
+
+#define STRING_NODE(i) ((StringNode *)(node_pool + (i) - 1))
+#define STRING_INDEX(node) ((NPIndex)((wot_node_pool_t *)(node) - node_pool + 1))
+
+// hash is split between choosing the bucket and checking entries
+#define HASHLEN(hash, length) \
+    ((((hash) / STRING_POOL_BUCKETS) & 0x1F) << 11 | (length))
+
+static wot_node_pool_t *node_pool;
+static WotNodePool *node_pool_manager;
+
+unsigned int StringPool::strings;
+NPIndex StringPool::buckets[STRING_POOL_BUCKETS];
+
+void StringPool::initialise_pool(WotNodePool *pool)
+{
+    node_pool_manager = pool;
+    node_pool = pool->get_pool();
+}
+
+unsigned int StringPool::count()
+{
+    return strings;
+}
+
+// returns the shared copy of the string or null if there is no room
+const char *StringPool::intern(const char *str, unsigned int length)
+{
+    if (length > STRING_MAX_LENGTH)
+    {
+        Serial.println(F("Error: string too long"));
+        return null;
+    }
+
+    unsigned int hash = Strings::hash(str, length);
+    uint16_t hashlen = HASHLEN(hash, length);
+    NPIndex *bucket = buckets + (hash & (STRING_POOL_BUCKETS - 1));
+
+    for (NPIndex i = *bucket; i; )
+    {
+        StringNode *node = STRING_NODE(i);
+
+        if (node->hashlen == hashlen &&
+            (node->str == str || !Strings::memcmp(node->str, str, length)))
+        {
+            if (node->refs < 255)
+                ++node->refs;
+
+            return node->str;
+        }
+
+        i = node->next;
+    }
+
+    // strings in flash are immutable and need not be copied
+    // note that nodes with a null in their first byte are seen
+    // as free by the node pool, so such strings can't be copied
+    boolean copy = (length && !Strings::in_flash(str));
+
+    if (copy && Strings::find(str, length, '\0'))
+    {
+        Serial.println(F("Error: can't intern string with null"));
+        return null;
+    }
+
+    unsigned int size = sizeof(wot_node_pool_t);
+    StringNode *node = (StringNode *)node_pool_manager->allocate_nodes(
+                                1 + (copy ? (length + size - 1)/size : 0));
+
+    if (!node)
+        return null;
+
+    if (copy)
+    {
+        Strings::memcpy((char *)(node + 1), str, length);
+        str = (const char *)(node + 1);
+    }
+
+    node->refs = 1;
+    node->hashlen = hashlen;
+    node->str = str;
+    node->next = *bucket;
+    *bucket = STRING_INDEX(node);
+    ++strings;
+    return str;
+}
+
+// drop reference to an interned string and free it if unused
+void StringPool::release(const char *str, unsigned int length)
+{
+    unsigned int hash = Strings::hash(str, length);
+    NPIndex *link = buckets + (hash & (STRING_POOL_BUCKETS - 1));
+
+    while (*link)
+    {
+        StringNode *node = STRING_NODE(*link);
+
+        if (node->str == str)
+        {
+            if (node->refs == 255)
+                return;  // saturated so keep it forever
+
+            if (node->refs > 1)
+            {
+                --node->refs;
+                return;
+            }
+
+            *link = node->next;
+            --strings;
+
+            // free nodes holding the copy, then the header node,
+            // while refs is non-zero as free() checks for that
+            if ((char *)(node + 1) == str)
+            {
+                unsigned int size = sizeof(wot_node_pool_t);
+                wot_node_pool_t *p = (wot_node_pool_t *)(node + 1);
+
+                for (unsigned int n = (length + size - 1)/size; n; --n)
+                    node_pool_manager->free(p++);
+            }
+
+            node_pool_manager->free(node);
+            return;
+        }
+
+        link = &node->next;
+    }
+}
@@ -0,0 +1,41 @@
+// interned strings allocated from the node pool
+
+#ifndef _WOTF_STRINGPOOL
+#define _WOTF_STRINGPOOL
+
+#ifndef null
+#define null 0
+#endif
+
+// Equal strings share a single copy, so that comparing strings is
+// just a matter of comparing pointers. Strings in flash are used in
+// place, whilst strings in RAM, e.g. in a receive buffer, are copied
+// into a run of nodes following the string's header node. Strings
+// are reference counted and their nodes freed when no longer used.
+
+#define STRING_POOL_BUCKETS 8  // must be a power of two
+#define STRING_MAX_LENGTH 2047 // as JSON nodes use 11 bits for this
+
+// same size as wot_node_pool_t with refs in the first byte
+// as the node pool treats nodes with a zero there as free
+typedef struct {
+    uint8_t refs;  // saturates at 255 which is never released
+    NPIndex next;  // next string in same bucket or 0
+    uint16_t hashlen;  // 11 bits for length and 5 bits of hash
+    const char *str;  // string in flash or in the following nodes
+} StringNode;
+
+class StringPool
+{
+    public:
+        static void initialise_pool(WotNodePool *wot_node_pool);
+        static const char *intern(const char *str, unsigned int length);
+        static void release(const char *str, unsigned int length);
+        static unsigned int count();
+
+    private:
+        static unsigned int strings;
+        static NPIndex buckets[STRING_POOL_BUCKETS];
+};
+
+#endif
@@ -4,6 +4,11 @@
 #include <Arduino.h>
 #include "Strings.h"
 
+#if defined(pgm_read_byte)
+#define IN_FLASH(p) ((unsigned int)(p) >= PROGMEM_BOUNDARY)
+#define FLASH_ADDRESS(p) ((p) - PROGMEM_BOUNDARY)
+#endif
+
 char Strings::get_char(const char *p)
 {
 #if defined(pgm_read_byte)
@@ -16,25 +21,53 @@ char Strings::get_char(const char *p)
 #endif
 }
 
+#if defined(pgm_read_byte)
+bool Strings::in_flash(const char *p)
+{
+    return IN_FLASH(p);
+}
+#else
+bool Strings::in_flash(const char *)
+{
+    return false;
+}
+#endif
+
 unsigned int Strings::strlen(const char *s)
 {
-    unsigned int len = 0;
+#if defined(pgm_read_byte)
+    if (IN_FLASH(s))
+        return strlen_P(FLASH_ADDRESS(s));
+#endif
     
-    while (get_char(s++))
-        ++len;
-        
-    return len;
+    return ::strlen(s);
 }
 
 void Strings::print(const char *s, unsigned int len)
 {
     Serial.print(len);
     Serial.print(F(" \""));
-    while (len--)
-        Serial.print(get_char(s++));
+    write(s, len);
     Serial.print(F("\""));
 }
 
+// print string without quotes
+void Strings::write(const char *s, unsigned int len)
+{
+#if defined(pgm_read_byte)
+    if (IN_FLASH(s)) {
+        s = FLASH_ADDRESS(s);
+        
+        while (len--)
+            Serial.write((uint8_t)pgm_read_byte(s++));
+            
+        return;
+    }
+#endif
+
+    Serial.write((const uint8_t *)s, len);
+}
+
 // for null terminated strings
 int Strings::strcmp(const char *s1, const char *s2)
 {
@@ -56,21 +89,12 @@ int Strings::strcmp(const char *s1, const char *s2)
 int Strings::strcmp(const char *s1, unsigned int len1,
                     const char *s2, unsigned int len2)
 {
-    if (len1 && len2)
-    {
-        while(--len1 && --len2 && (get_char(s1)==get_char(s2)))
-        {
-            s1++;
-            s2++;
-        }
+    int diff = memcmp(s1, s2, (len1 < len2 ? len1 : len2));
         
-        return ((unsigned)get_char(s1)-(unsigned)get_char(s2));
-    }
+    if (diff || len1 == len2)
+        return diff;
         
-    if (!(len1 | len2))
-        return 0;
-
-    return (len1 ? 1 : -1);
+    return (len1 > len2 ? 1 : -1);
 }
 
 char *Strings::strcpy(char *dst, const char *src)
@@ -80,3 +104,87 @@ char *Strings::strcpy(char *dst, const char *src)
         
     return dst;
 }
+
+// copy from RAM or flash into RAM
+void Strings::memcpy(char *dst, const char *src, unsigned int len)
+{
+#if defined(pgm_read_byte)
+    if (IN_FLASH(src)) {
+        memcpy_P(dst, FLASH_ADDRESS(src), len);
+        return;
+    }
+#endif
+
+    ::memcpy(dst, src, len);
+}
+
+// compare len bytes where either string may be in flash
+int Strings::memcmp(const char *s1, const char *s2, unsigned int len)
+{
+#if defined(pgm_read_byte)
+    if (IN_FLASH(s1)) {
+        if (!IN_FLASH(s2))
+            return -memcmp_P(s2, FLASH_ADDRESS(s1), len);
+            
+        // avr-libc has nothing for comparing two flash strings
+        s1 = FLASH_ADDRESS(s1);
+        s2 = FLASH_ADDRESS(s2);
+        
+        while (len--) {
+            int diff = (int)pgm_read_byte(s1++) - (int)pgm_read_byte(s2++);
+            
+            if (diff)
+                return diff;
+        }
+        
+        return 0;
+    }
+    
+    if (IN_FLASH(s2))
+        return memcmp_P(s1, FLASH_ADDRESS(s2), len);
+#endif
+
+    return ::memcmp(s1, s2, len);
+}
+
+// returns pointer to first occurrence of c within len bytes or null
+const char *Strings::find(const char *s, unsigned int len, char c)
+{
+#if defined(pgm_read_byte)
+    if (IN_FLASH(s)) {
+        const char *p = (const char *)memchr_P(FLASH_ADDRESS(s), c, len);
+        return (p ? p + PROGMEM_BOUNDARY : 0);
+    }
+#endif
+
+    return (const char *)memchr(s, c, len);
+}
+
+// Jenkins One-at-a-Time hash
+#define HASH_STEP(h, c) { h += (c); h += (h << 10); h ^= (h >> 6); }
+
+unsigned int Strings::hash(const char *s, unsigned int len)
+{
+    unsigned h = 0;
+
+#if defined(pgm_read_byte)
+    if (IN_FLASH(s)) {
+        s = FLASH_ADDRESS(s);
+        
+        while (len--)
+            HASH_STEP(h, (unsigned char)pgm_read_byte(s++));
+    } else
+#endif
+    {
+        const unsigned char *p = (const unsigned char *)s;
+        
+        while (len--)
+            HASH_STEP(h, *p++);
+    }
+
+    h += ( h << 3 );
+    h ^= ( h >> 11 );
+    h += ( h << 15 );
+
+    return h;
+}
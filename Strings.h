@@ -11,11 +11,21 @@ class Strings
     public:
     
     static char get_char(const char *p);
+    static bool in_flash(const char *p);
     static void print(const char *s, unsigned int len);
+    static void write(const char *s, unsigned int len);
     static unsigned int strlen(const char *p);
     static int strcmp(const char *s1, const char *s2);
     static int strcmp(const char *s1, unsigned int len1,
                       const char *s2, unsigned int len2);
     static char *strcpy(char *dst, const char *src);
+    
+    // bulk operations decide between RAM and flash once per call
+    // rather than once per character as get_char() does
+    
+    static void memcpy(char *dst, const char *src, unsigned int len);
+    static int memcmp(const char *s1, const char *s2, unsigned int len);
+    static const char *find(const char *s, unsigned int len, char c);
+    static unsigned int hash(const char *s, unsigned int len);
 };
 #endif
\ No newline at end of file
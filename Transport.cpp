@@ -5,78 +5,359 @@
 #include "Names.h"
 #include "JSON.h"
 #include "WSEvent.h"
-#include "WiznetTCP.h"
+#include "NetDriver.h"
+#include "Discovery.h"
+#include "MessageCoder.h"
+#include "Framing.h"
+#include "TxSink.h"
+#include "GatewayLink.h"
+#include "DHCP.h"
 #include "WebThings.h"
 #include "Transport.h"
 
-void Transport::start()
+// writes are coalesced in the TX buffer and sent as one segment once
+// COALESCE_SIZE bytes are queued, or, as for Nagle's algorithm, when
+// the previous segment has gone, but after at most COALESCE_DELAY ms
+#define COALESCE_SIZE 256
+#define COALESCE_DELAY 20
+
+// socket for the persistent connection to the gateway, this is
+// given the larger buffers for bulk transfers such as models
+#define GATEWAY_SOCKET 0
+
+// idle connections are probed with SEND_KEEP at this interval in ms
+#define KEEP_ALIVE_TIME 30000
+
+// the event handlers are plain functions and need the transport
+static Transport *transport;
+
+static void on_connected(void *data)
+{
+    transport->connected((uint8_t)(size_t)data);
+}
+
+static void on_readable(void *data)
 {
-  delay(1000);
-  tcp.begin(192,168,1,127, 1234);
-  //tcp.begin(1234); // using DHCP for IP config
-  tcp.discover_gateway();
-  Serial.println(F("started server"));
+    transport->readable((uint8_t)(size_t)data);
+}
+
+static void on_sent(void *data)
+{
+    transport->sent((uint8_t)(size_t)data);
+}
+
+static void on_closed(void *data)
+{
+    transport->closed((uint8_t)(size_t)data);
+}
+
+static void on_gateway_changed(void *)
+{
+    transport->gateway_link()->gateway_changed();
+}
+
+static void on_address_changed(void *)
+{
+    transport->address_changed();
+}
+
+static void on_keep_alive(void *)
+{
+    transport->keep_alive();
+}
+
+// the handlers for the network events, indexed by event, the
+// application can add its own with set_handler() or subscribe()
+static const Event_hander_t network_handlers[EVENT_TYPES] PROGMEM = {
+    on_readable,         // Network_Readable_Event_t
+    on_sent,             // Network_Sent_Event_t
+    on_closed,           // Network_Timeout_Event_t
+    on_connected,        // Network_Connected_Event_t
+    on_closed,           // Network_Disconnected_Event_t
+    on_gateway_changed,  // Gateway_Changed_Event_t
+    on_address_changed,  // Address_Changed_Event_t
+    NULL,                // Timer_Event_t
+    NULL,                // Sensor_Ready_Event_t
+    NULL                 // Send_Complete_Event_t
+};
+
+// the transport is driven by network events queued by the driver,
+// e.g. from the W5100 interrupt, and by timers, so that nothing is
+// polled when idle, the driver's buffer sizes should be set first
+void Transport::start(NetDriver *driver, EventQueue *queue)
+{
+    delay(1000);
+    transport = this;
+    net = driver;
+    events = queue;
+    closing = 0;
+    messages = packets = 0;
+    net->set_event_queue(events);
+    
+#if USE_DHCP
+    net->begin(1234);
+    dhcp.begin(net, tcp_sockets(), events);
+#else
+    net->begin(192,168,1,127, 1234);
+#endif
+    
+    // discovery runs in the background, and with DHCP
+    // it starts once there is an address
+    discovery.begin(net, net->udp_socket(), events);
+    
+#if !USE_DHCP
+    discovery.start();
+#endif
+        
+    gateway.begin(net, GATEWAY_SOCKET, &discovery, events);
+    
+    events->set_table(network_handlers);
+    
+    // the other TCP sockets serve clients
+    for (uint8_t s = GATEWAY_SOCKET + 1; s < tcp_sockets(); ++s) {
+        if (net->has_buffers(s))
+            listen(s);
+    }
+    
+    events->start_timer(&keep_alive_timer, KEEP_ALIVE_TIME, 0, on_keep_alive, NULL);
+    net->enable_interrupts();
+    Serial.println(F("started server"));
 }
 
 void Transport::stop()
 {
-    tcp.close();
+    for (uint8_t s = 0; s < net->socket_count(); ++s)
+        net->close(s);
 }
 
 #define TCP_BUF_LEN 256
 
+// handles any interrupts that arrived during an SPI transfer and
+// sends coalesced writes, everything else runs on events and timers
 void Transport::serve()
 {
-  unsigned int n;
-  
-  switch (tcp.get_socket_status()) {
-    case SOCK_INIT:
-      tcp.listen();
-      break;
-      
-    case SOCK_CLOSED:
-      tcp.open();
-      break;
-      
-    case SOCK_LISTEN:
-        break;
-      
-    case SOCK_ESTABLISHED:
-      n = tcp.receive_available();
-    
-      if (n) {
-        char buffer[TCP_BUF_LEN];
+    unsigned long now = millis();
+    
+    net->service();
+    
+    for (uint8_t s = 0; s < tcp_sockets(); ++s) {
+        if (queued[s] && (!net->is_sending(s) || now - queued_at[s] >= COALESCE_DELAY))
+            flush(s);
+    }
+}
+
+// probes the connections that have been idle for KEEP_ALIVE_TIME, and
+// sets the timer for the next one to reach it, writes are flushed by
+// serve() so sockets with some queued are left until then
+void Transport::keep_alive()
+{
+    unsigned long now = millis();
+    unsigned long wait = KEEP_ALIVE_TIME;
+    
+    for (uint8_t s = 0; s < tcp_sockets(); ++s) {
+        unsigned long idle = now - active_at[s];
+        
+        if (queued[s])
+            continue;
+            
+        if (idle >= KEEP_ALIVE_TIME) {
+            active_at[s] = now;
+            net->keep_alive(s);
+        } else if (KEEP_ALIVE_TIME - idle < wait) {
+            wait = KEEP_ALIVE_TIME - idle;
+        }
+    }
+    
+    events->start_timer(&keep_alive_timer, wait, 0, on_keep_alive, NULL);
+}
+
+// queues data to send on socket s, returns the number of bytes
+// queued, which is less than length when the TX buffer is full
+uint16_t Transport::write(uint8_t s, const char *buffer, uint16_t length)
+{
+    uint16_t avail = net->reserve(s, queued[s] + length);
+    
+    // the TX buffer may have less room than is already queued
+    if (avail <= queued[s])
+        return 0;
+        
+    if (length > avail - queued[s])
+        length = avail - queued[s];
+        
+    if (length) {
+        if (!queued[s])
+            queued_at[s] = millis();
+            
+        net->write_reserved(s, queued[s], buffer, length);
+        queued[s] += length;
+        ++messages;
+        
+        if (queued[s] >= COALESCE_SIZE)
+            flush(s);
+    }
+    
+    return length;
+}
 
+// sends whatever has been written to socket s
+void Transport::flush(uint8_t s)
+{
+    if (queued[s] && net->commit(s, queued[s])) {
+        queued[s] = 0;
+        active_at[s] = millis();
+        ++packets;
+    }
+}
+
+// true if serve() has no coalesced writes to send and no round trip
+// is being timed, so the MCU can power down, the transport's other
+// deadlines are timers, see IdleManager::sleep()
+bool Transport::is_idle()
+{
+    for (uint8_t s = 0; s < tcp_sockets(); ++s) {
+        if (queued[s])
+            return false;
+    }
+    
+    return !gateway.is_connecting();
+}
+
+void Transport::print_stats()
+{
+    Serial.print(F("messages = "));
+    Serial.print(messages);
+    Serial.print(F(", packets = "));
+    Serial.print(packets);
+    Serial.print(F(", packets per message = "));
+    Serial.println(messages ? (float)packets / messages : 0.0);
+    discovery.print_gateways();
+}
+    
+// opens the socket and listens for the next client
+void Transport::listen(uint8_t s)
+{
+    closing &= ~(1 << s);
+    queued[s] = 0;
+    active_at[s] = millis();
+    net->open(s);
+    
+    if (!net->listen(s))
+        Serial.println(F("Error: couldn't listen on socket"));
+}
+
+// the sockets for TCP, all but the last, which is for mDNS, and
+// with DHCP, the one before it
+uint8_t Transport::tcp_sockets()
+{
+#if USE_DHCP
+    return net->udp_socket() - 1;
+#else
+    return net->udp_socket();
+#endif
+}
+
+GatewayLink *Transport::gateway_link()
+{
+    return &gateway;
+}
+
+uint8_t Transport::gateway_count()
+{
+    return discovery.gateway_count();
+}
+
+const GatewayEntry *Transport::get_gateway(uint8_t i)
+{
+    return discovery.get_gateway(i);
+}
+
+// called for Address_Changed_Event_t, discovery starts
+// again on the new address
+void Transport::address_changed()
+{
+    discovery.start();
+}
+
+void Transport::connected(uint8_t s)
+{
+    if (s == GATEWAY_SOCKET)
+        gateway.connected();
+}
+
+void Transport::readable(uint8_t s)
+{
+    if (s == net->udp_socket()) {
+        discovery.readable();
+        return;
+    }
+    
+#if USE_DHCP
+    if (s == tcp_sockets()) {
+        dhcp.readable();
+        return;
+    }
+#endif
+    
+    if (s == GATEWAY_SOCKET) {
+        gateway.readable();
+        return;
+    }
+        
+    // ignore data once the reply has been sent
+    if (closing & (1 << s))
+        return;
+
+    unsigned int n = net->receive_available(s);
+    
+    if (n) {
+        char buffer[TCP_BUF_LEN];
+            
         if (n > TCP_BUF_LEN - 1)
-          n = TCP_BUF_LEN - 1;
-          
-        n = tcp.receive(buffer, n);
+            n = TCP_BUF_LEN - 1;
+            
+        n = net->receive(s, buffer, n);
         buffer[n] = '\0';
-        
+            
         Serial.print("received ");
         Serial.print(n);
         Serial.print(" bytes: \"");
         Serial.print(buffer);
         Serial.println("\"");
+                
+        active_at[s] = millis();
+        write(s, buffer, n);
+        flush(s);
             
-        tcp.send(buffer, n);
-        
         // assume no further requests
-        tcp.disconnect();
-      }
-      
-      break;
-      
-    case SOCK_FIN_WAIT:
-    case SOCK_CLOSING:
-    case SOCK_TIME_WAIT:
-    case SOCK_CLOSE_WAIT:
-    case SOCK_LAST_ACK:
-      // force socket to close
-      tcp.close();
-      break;
-      
-    default:
-      break;
-  }
+        closing |= 1 << s;
+    }
+}
+
+// sends anything written since, or disconnects once the reply has gone
+void Transport::sent(uint8_t s)
+{
+    if (queued[s])
+        flush(s);
+    else if (closing & (1 << s))
+        net->disconnect(s);
+}
+
+// called when the client disconnects or the connection times out
+void Transport::closed(uint8_t s)
+{
+    if (s == net->udp_socket()) {
+        discovery.closed();
+        return;
+    }
+    
+    if (s >= tcp_sockets())
+        return;
+        
+    if (s == GATEWAY_SOCKET) {
+        gateway.closed();
+        return;
+    }
+        
+    net->close(s);
+    listen(s);
 }
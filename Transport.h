@@ -3,15 +3,55 @@
 #ifndef _WOTF_TRANSPORT
 #define _WOTF_TRANSPORT
 
+// set to 1 to get the IP address from DHCP rather than using a fixed
+// address, it is acquired and renewed in the background, and DHCP
+// takes the socket before the one for mDNS
+#define USE_DHCP 0
+
 class Transport
 {
     private:
-        WiznetTCP tcp;
+        NetDriver *net;
+        EventQueue *events;
+        Discovery discovery;
+#if USE_DHCP
+        DHCP dhcp;
+#endif
+        GatewayLink gateway;
+        uint8_t closing;  // bit per socket to disconnect once sent
+        uint16_t queued[NET_MAX_SOCKETS];  // bytes written but not sent
+        unsigned long queued_at[NET_MAX_SOCKETS];  // time of first write
+        unsigned long active_at[NET_MAX_SOCKETS];  // time of last traffic
+        unsigned long messages, packets;  // send statistics
+        Timer keep_alive_timer;
+        void listen(uint8_t s);
+        uint8_t tcp_sockets();
             
     public:
-        void start();
+        void start(NetDriver *driver, EventQueue *queue);
         void stop();
         void serve();
+        bool is_idle();
+        
+        // coalesced sending
+        uint16_t write(uint8_t s, const char *buffer, uint16_t length);
+        void flush(uint8_t s);
+        void print_stats();
+        
+        GatewayLink *gateway_link();
+        
+        // gateways found by discovery, entries without both an
+        // address and a port are NULL
+        uint8_t gateway_count();
+        const GatewayEntry *get_gateway(uint8_t i);
+        
+        // called from the network event and timer handlers
+        void address_changed();
+        void keep_alive();
+        void connected(uint8_t s);
+        void readable(uint8_t s);
+        void sent(uint8_t s);
+        void closed(uint8_t s);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,116 @@
+#include <Arduino.h>
+#include "Strings.h"
+#include "MessageCoder.h"
+#include "NetDriver.h"
+#include "Framing.h"
+#include "TxSink.h"
+
+// reserves up to length bytes in the TX buffer for socket s,
+// returns the number reserved, which is 0 if the buffer is full
+uint16_t TxSink::begin(NetDriver *driver, uint8_t s, uint16_t length)
+{
+    net = driver;
+    socket = s;
+    written = 0;
+    count = 0;
+    checking = false;
+    reserved = net->reserve(s, length);
+    return reserved;
+}
+
+void TxSink::flush()
+{
+    if (count) {
+        if (checking)
+            crc = Framing::crc16(crc, (uint8_t *)chunk, count);
+
+        net->write_reserved(socket, written, chunk, count);
+        written += count;
+        count = 0;
+    }
+}
+
+// the number of bytes put so far
+uint16_t TxSink::size()
+{
+    return written + count;
+}
+
+bool TxSink::put_byte(unsigned char c)
+{
+    if (size() >= reserved)
+        return false;
+
+    if (count == TX_SINK_CHUNK)
+        flush();
+
+    chunk[count++] = c;
+    return true;
+}
+
+// src may be in RAM or flash, large blocks from RAM are written
+// directly, whilst flash is copied via the chunk
+bool TxSink::put_bytes(const char *src, unsigned int len)
+{
+    if (len > (unsigned int)(reserved - size()))
+        return false;
+
+    if (len > TX_SINK_CHUNK && !Strings::in_flash(src)) {
+        flush();
+
+        if (checking)
+            crc = Framing::crc16(crc, (const uint8_t *)src, len);
+
+        net->write_reserved(socket, written, src, len);
+        written += len;
+        return true;
+    }
+
+    while (len) {
+        if (count == TX_SINK_CHUNK)
+            flush();
+
+        unsigned int n = TX_SINK_CHUNK - count;
+
+        if (n > len)
+            n = len;
+
+        Strings::memcpy(chunk + count, src, n);
+        count += n;
+        src += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+// overwrites bytes that have already been put, e.g. to fill in
+// a length prefix once the rest of the message has been encoded
+void TxSink::patch(uint16_t offset, const char *src, uint16_t len)
+{
+    flush();
+    net->write_reserved(socket, offset, src, len);
+}
+
+// the CRC-16 covers the bytes put from now on, see Framing
+void TxSink::start_crc()
+{
+    flush();
+    crc = FRAME_CRC_INITIAL;
+    checking = true;
+}
+
+uint16_t TxSink::get_crc()
+{
+    flush();
+    return crc;
+}
+
+// sends what has been put, returns the number of bytes sent,
+// or 0 if the driver couldn't send yet, e.g. for a UDP socket
+// with a send in flight, in which case try again later
+uint16_t TxSink::commit()
+{
+    flush();
+    return (written ? net->commit(socket, written) : 0);
+}
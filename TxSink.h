@@ -0,0 +1,53 @@
+// MessageSink that encodes straight into a socket's TX buffer
+
+#ifndef _WOTF_TX_SINK
+#define _WOTF_TX_SINK
+
+/*
+   Avoids staging a whole message in RAM before sending it:
+
+       TxSink sink;
+       MessageBuffer buffer;
+
+       if (sink.begin(net, s, 200)) {
+           buffer.set_sink(&sink);
+           MessageCoder::encode_object_start(&buffer);
+           ...
+           if (!buffer.overflowed())
+               sink.commit();
+       }
+
+   Bytes are gathered in a small chunk so that the driver's write
+   pointer is read once per chunk rather than once per byte. The
+   message is only sent by commit(), and is dropped if it would have
+   overflowed the reservation.
+*/
+
+#define TX_SINK_CHUNK 16
+
+class TxSink : public MessageSink
+{
+    private:
+        NetDriver *net;
+        uint8_t socket;
+        uint16_t reserved;  // bytes reserved in the TX buffer
+        uint16_t written;   // bytes written to the TX buffer
+        uint8_t count;      // bytes in the chunk
+        bool checking;      // crc is being updated
+        uint16_t crc;
+        char chunk[TX_SINK_CHUNK];
+
+        void flush();
+
+    public:
+        uint16_t begin(NetDriver *driver, uint8_t s, uint16_t length);
+        bool put_byte(unsigned char c);
+        bool put_bytes(const char *src, unsigned int len);
+        uint16_t size();
+        void patch(uint16_t offset, const char *src, uint16_t len);
+        void start_crc();
+        uint16_t get_crc();
+        uint16_t commit();
+};
+
+#endif
@@ -0,0 +1,696 @@
+#include <Arduino.h>
+#include "WSEvent.h"
+#include "NetDriver.h"
+#include "W5500TCP.h"
+
+// the SPI code is for the AVR, other MCUs would use the SPI library
+#if defined(__AVR__)
+
+// COMMON REGISTERS
+
+#define W5500_MODE_REGISTER 0x0000 // 1 byte
+#define W5500_GATEWAY 0x0001 // 4 bytes
+#define W5500_SUBNET_MASK 0x0005 // 4 bytes
+#define W5500_MAC_ADDRESS 0x0009 // 6 bytes
+#define W5500_LOCAL_IP_ADDRESS 0x000F // 4 bytes
+#define W5500_SOCKET_INTR 0x0017 // 1 bit per socket
+#define W5500_SOCKET_INTR_MASK 0x0018 // 1 bit per socket
+
+// SOCKET REGISTER OFFSETS
+
+#define SOCKET_MODE 0x00
+#define SOCKET_COMMAND 0x01
+#define SOCKET_INTERRUPT 0x02
+#define SOCKET_STATUS 0x03
+#define SOCKET_SRC_PORT 0x04
+#define SOCKET_MAC_ADDRESS 0x06
+#define SOCKET_IP_ADDRESS 0x0C
+#define SOCKET_DEST_PORT 0x10
+#define SOCKET_RX_BUF_SIZE 0x1E
+#define SOCKET_TX_BUF_SIZE 0x1F
+#define SOCKET_TX_FREE_SIZE 0x20
+#define SOCKET_TX_WRITE_PNTR 0x24
+#define SOCKET_RX_RECV_SIZE 0x26
+#define SOCKET_RX_READ_PNTR 0x28
+
+// STATUS FLAGs
+
+#define W5500_SEND_OK 16
+#define W5500_TIMEOUT 8
+#define W5500_RECV 4
+#define W5500_DISCON 2
+#define W5500_CON 1
+
+// BLOCK SELECT as the top 5 bits of the SPI control byte,
+// with bit 2 set for writes, and 0 in bits 1 and 0 for
+// variable length frames, which end when SS goes high
+
+#define COMMON_BLOCK 0x00
+#define SOCKET_BLOCK(s) (0x08 + ((s) << 5))
+#define TX_BLOCK(s) (0x10 + ((s) << 5))
+#define RX_BLOCK(s) (0x18 + ((s) << 5))
+#define WRITE_ACCESS 0x04
+
+// 16KB each for TX and RX shared between the sockets
+#define BUFFER_MEMORY 16
+
+// COMMANDs
+
+#define SOCKET_OPEN 0x01
+#define SOCKET_LISTEN 0x02
+#define SOCKET_CONNECT 0x04
+#define SOCKET_DISCONNECT 0x08
+#define SOCKET_CLOSE 0x10
+#define SOCKET_SEND 0x20
+#define SOCKET_SEND_KEEP 0x22
+#define SOCKET_RECEIVE 0x40
+
+// MODE
+
+#define SOCKET_TCP 0x01
+#define SOCKET_UDP 0x02
+#define SOCKET_MULTICAST 0x80
+#define IGMP_V2 0x00
+
+// forward reference to SPI data transfer functions
+static void read_block(uint8_t block, uint16_t addr, uint8_t *buffer, uint16_t length);
+static void write_block(uint8_t block, uint16_t addr, const uint8_t *buffer, uint16_t length);
+static uint8_t read_byte(uint8_t block, uint16_t addr);
+static void write_byte(uint8_t block, uint16_t addr, uint8_t data);
+static uint16_t read_word(uint8_t block, uint16_t addr);
+static void write_word(uint8_t block, uint16_t addr, uint16_t word);
+static uint16_t read_size(uint8_t block, uint16_t addr);
+
+// set whilst an SPI frame is in progress, as the ISR can't then use SPI
+static volatile uint8_t spi_busy = 0;
+static W5500TCP *interrupt_driver;
+
+// the level triggered interrupt is masked whilst it is being deferred,
+// or when the main code needs the socket interrupt flags to itself
+#define INT_MASK_BIT _BV(digitalPinToInterrupt(W5500_INT_PIN))
+#define mask_interrupt() (EIMSK &= ~INT_MASK_BIT)
+#define unmask_interrupt() (EIMSK |= INT_MASK_BIT)
+
+W5500TCP::W5500TCP()
+{
+    // wait until W5500 has started up and is ready for commands
+    delay(1);
+    spi_init();
+
+    write_byte(COMMON_BLOCK, W5500_MODE_REGISTER, 0x80); // reset
+
+    while (read_byte(COMMON_BLOCK, W5500_MODE_REGISTER) & 0x80);
+
+    // 8 sockets each with 2KB for RX and 2KB for TX
+    uint8_t sizes[W5500_SOCKETS] = {2, 2, 2, 2, 2, 2, 2, 2};
+    set_buffer_sizes(sizes, sizes);
+
+    events = NULL;
+    sending = pending = deferred = waiting = 0;
+    interrupts_enabled = false;
+    local_port = 0;
+}
+
+uint8_t W5500TCP::socket_count()
+{
+    return W5500_SOCKETS;
+}
+
+// sets the RX and TX buffer sizes for each socket in KB, which must
+// be 0, 1, 2, 4, 8 or 16 with no more than 16KB in total for each
+// direction, the last socket is needed for UDP and can't be 0KB,
+// returns false if the sizes are invalid
+bool W5500TCP::set_buffer_sizes(const uint8_t *rx_kb, const uint8_t *tx_kb)
+{
+    uint8_t rx_total = 0, tx_total = 0;
+    uint8_t s;
+
+    if (!rx_kb[W5500_SOCKETS - 1] || !tx_kb[W5500_SOCKETS - 1])
+        return false;
+
+    for (s = 0; s < W5500_SOCKETS; ++s) {
+        if ((rx_kb[s] & (rx_kb[s] - 1)) || rx_kb[s] > 16 ||
+            (tx_kb[s] & (tx_kb[s] - 1)) || tx_kb[s] > 16)
+            return false;
+
+        rx_total += rx_kb[s];
+        tx_total += tx_kb[s];
+    }
+
+    if (rx_total > BUFFER_MEMORY || tx_total > BUFFER_MEMORY)
+        return false;
+
+    for (s = 0; s < W5500_SOCKETS; ++s) {
+        rx_size[s] = rx_kb[s];
+        tx_size[s] = tx_kb[s];
+        write_byte(SOCKET_BLOCK(s), SOCKET_RX_BUF_SIZE, rx_kb[s]);
+        write_byte(SOCKET_BLOCK(s), SOCKET_TX_BUF_SIZE, tx_kb[s]);
+    }
+
+    return true;
+}
+
+// false if the socket was given 0KB for its buffers
+bool W5500TCP::has_buffers(uint8_t s)
+{
+    return rx_size[s] && tx_size[s];
+}
+
+// queue for the network events
+void W5500TCP::set_event_queue(EventQueue *queue)
+{
+    events = queue;
+}
+
+void W5500TCP::configure(const uint8_t *mac, const uint8_t *ip,
+                         const uint8_t *subnet, const uint8_t *gateway)
+{
+    write_block(COMMON_BLOCK, W5500_MAC_ADDRESS, mac, 6);
+    write_block(COMMON_BLOCK, W5500_LOCAL_IP_ADDRESS, ip, 4);
+    write_block(COMMON_BLOCK, W5500_SUBNET_MASK, subnet, 4);
+    write_block(COMMON_BLOCK, W5500_GATEWAY, gateway, 4);
+}
+
+void W5500TCP::get_local_ip(uint8_t *n0, uint8_t *n1, uint8_t *n2, uint8_t *n3)
+{
+    uint8_t ip[4];
+
+    read_block(COMMON_BLOCK, W5500_LOCAL_IP_ADDRESS, ip, 4);
+    *n0 = ip[0];
+    *n1 = ip[1];
+    *n2 = ip[2];
+    *n3 = ip[3];
+}
+
+// issue command and wait for it to be processed
+void W5500TCP::command(uint8_t s, uint8_t cmd)
+{
+    write_byte(SOCKET_BLOCK(s), SOCKET_COMMAND, cmd);
+
+    while (read_byte(SOCKET_BLOCK(s), SOCKET_COMMAND));
+}
+
+// all TCP sockets share the local port, so several clients
+// can be served at once by listening on more than one socket
+void W5500TCP::open(uint8_t s)
+{
+    write_word(SOCKET_BLOCK(s), SOCKET_SRC_PORT, local_port);
+    write_byte(SOCKET_BLOCK(s), SOCKET_MODE, SOCKET_TCP);
+    command(s, SOCKET_OPEN);
+}
+
+// opens a UDP socket on the given local port, if group isn't zero
+// the socket joins that IPv4 multicast group, which it also sends to
+void W5500TCP::open_udp(uint8_t s, uint16_t port, uint32_t group)
+{
+    uint8_t mode = SOCKET_UDP;
+
+    write_word(SOCKET_BLOCK(s), SOCKET_SRC_PORT, port);
+
+    if (group) {
+        uint8_t mac[6] = {0x01, 0x00, 0x5E, (uint8_t)((group >> 16) & 0x7F),
+                          (uint8_t)((group >> 8) & 255), (uint8_t)(group & 255)};
+
+        write_word(SOCKET_BLOCK(s), SOCKET_DEST_PORT, port);
+        write_block(SOCKET_BLOCK(s), SOCKET_MAC_ADDRESS, mac, 6);
+        set_ip(s, group);
+
+        // as for the W5100, the IGMP join and leave are sent
+        // automatically when the socket is opened and closed
+        mode |= SOCKET_MULTICAST|IGMP_V2;
+    }
+
+    write_byte(SOCKET_BLOCK(s), SOCKET_MODE, mode);
+    command(s, SOCKET_OPEN);
+}
+
+bool W5500TCP::listen(uint8_t s)
+{
+    if (get_socket_status(s) == SOCK_INIT)
+    {
+        command(s, SOCKET_LISTEN);
+
+        if (get_socket_status(s) == SOCK_LISTEN)
+            return true;
+
+        close(s);
+    }
+
+    return false;
+}
+
+bool W5500TCP::connect(uint8_t s, uint8_t n0, uint8_t n1, uint8_t n2, uint8_t n3, uint16_t port)
+{
+    if (get_socket_status(s) == SOCK_INIT)
+    {
+        set_ip(s, n0, n1, n2, n3);
+        set_port(s, port);
+        command(s, SOCKET_CONNECT);
+        return true;
+    }
+
+    return false;
+}
+
+void W5500TCP::disconnect(uint8_t s)
+{
+    command(s, SOCKET_DISCONNECT);
+
+    // clear interrupts
+    write_byte(SOCKET_BLOCK(s), SOCKET_INTERRUPT, 0xFF);
+    sending &= ~(1 << s);
+    pending &= ~(1 << s);
+    waiting &= ~(1 << s);
+}
+
+void W5500TCP::close(uint8_t s)
+{
+    command(s, SOCKET_CLOSE);
+
+    // clear interrupts
+    write_byte(SOCKET_BLOCK(s), SOCKET_INTERRUPT, 0xFF);
+    sending &= ~(1 << s);
+    pending &= ~(1 << s);
+    waiting &= ~(1 << s);
+}
+
+uint8_t W5500TCP::get_socket_status(uint8_t s)
+{
+    return read_byte(SOCKET_BLOCK(s), SOCKET_STATUS);
+}
+
+void W5500TCP::set_ip(uint8_t s, uint32_t ip)
+{
+    // ip is little endian but W5500 expects big endian
+    uint8_t addr[4] = {(uint8_t)((ip >> 24) & 255), (uint8_t)((ip >> 16) & 255),
+                       (uint8_t)((ip >> 8) & 255), (uint8_t)(ip & 255)};
+
+    write_block(SOCKET_BLOCK(s), SOCKET_IP_ADDRESS, addr, 4);
+}
+
+void W5500TCP::set_port(uint8_t s, uint16_t port)
+{
+    write_word(SOCKET_BLOCK(s), SOCKET_DEST_PORT, port);
+}
+
+uint16_t W5500TCP::send_available(uint8_t s)
+{
+    return read_size(SOCKET_BLOCK(s), SOCKET_TX_FREE_SIZE);
+}
+
+uint16_t W5500TCP::receive_available(uint8_t s)
+{
+    return read_size(SOCKET_BLOCK(s), SOCKET_RX_RECV_SIZE);
+}
+
+uint16_t W5500TCP::skip(uint8_t s, uint16_t length)
+{
+    uint16_t size = receive_available(s);
+
+    if (size) {
+        uint16_t ptr = read_word(SOCKET_BLOCK(s), SOCKET_RX_READ_PNTR);
+
+        if (size > length)
+            size = length;
+
+        // update socket's read pointer and re-enable receiving
+        write_word(SOCKET_BLOCK(s), SOCKET_RX_READ_PNTR, ptr+size);
+        command(s, SOCKET_RECEIVE);
+    }
+    return size;
+}
+
+// the W5500 wraps the pointer within the socket's buffer
+// so the data is read in a single burst
+uint16_t W5500TCP::peek(uint8_t s, uint16_t offset, char *buffer, uint16_t length)
+{
+    uint16_t size = receive_available(s);
+
+    if (size > offset) {
+        uint16_t ptr = offset + read_word(SOCKET_BLOCK(s), SOCKET_RX_READ_PNTR);
+        size -= offset;
+
+        if (size > length)
+            size = length;
+
+        read_block(RX_BLOCK(s), ptr, (uint8_t *)buffer, size);
+    }
+    else
+        size = 0;
+
+    return size;
+}
+
+// returns what's currently available
+uint16_t W5500TCP::receive(uint8_t s, char *buffer, uint16_t length)
+{
+    uint16_t size = peek(s, 0, buffer, length);
+
+    if (size)
+        skip(s, size);
+
+    return size;
+}
+
+// copies up to length bytes into the socket's TX buffer
+// without sending them, returns the number of bytes copied
+uint16_t W5500TCP::queue_data(uint8_t s, char *buffer, uint16_t length)
+{
+    uint16_t size = send_available(s);
+
+    // send up to the available space
+    if (length < size)
+        size = length;
+
+    uint16_t ptr = read_word(SOCKET_BLOCK(s), SOCKET_TX_WRITE_PNTR);
+
+    // buffer is NULL when the data was written by write_reserved()
+    if (buffer)
+        write_block(TX_BLOCK(s), ptr, (uint8_t *)buffer, size);
+
+    // update socket's send pointer
+    write_word(SOCKET_BLOCK(s), SOCKET_TX_WRITE_PNTR, ptr+size);
+    return size;
+}
+
+void W5500TCP::start_send(uint8_t s)
+{
+    command(s, SOCKET_SEND);
+}
+
+// blocks until the data has been sent or the send times out
+uint16_t W5500TCP::send(uint8_t s, char *buffer, uint16_t length)
+{
+    // stop the ISR from clearing the flags we are waiting for
+    if (interrupts_enabled)
+        mask_interrupt();
+
+    uint16_t size = queue_data(s, buffer, length);
+    start_send(s);
+
+    // wait for data to be sent or for a timeout
+    uint8_t flags;
+
+    while (!((flags = read_byte(SOCKET_BLOCK(s), SOCKET_INTERRUPT)) &
+                                    (W5500_SEND_OK|W5500_TIMEOUT)));
+
+    if (flags & W5500_TIMEOUT)
+        Serial.println(F("send timeout"));
+
+    write_byte(SOCKET_BLOCK(s), SOCKET_INTERRUPT, (W5500_SEND_OK|W5500_TIMEOUT));
+
+    if (interrupts_enabled && !deferred)
+        unmask_interrupt();
+
+    return size;
+}
+
+// as for WiznetTCP::send_async()
+uint16_t W5500TCP::send_async(uint8_t s, char *buffer, uint16_t length)
+{
+    uint8_t bit = 1 << s;
+    uint16_t size = 0;
+
+    // the ISR mustn't complete the send whilst we are adding to it
+    if (interrupts_enabled)
+        mask_interrupt();
+
+    if (!(sending & bit) ||
+        (read_byte(SOCKET_BLOCK(s), SOCKET_MODE) & 0x0F) != SOCKET_UDP)
+    {
+        size = queue_data(s, buffer, length);
+
+        // a waiting send takes all of the data in the buffer
+        if (size && (sending & bit) && !(waiting & bit))
+            pending |= bit;
+        else if (size) {
+            sending |= bit;
+            start_send(s);
+        }
+    }
+
+    if (interrupts_enabled && !deferred)
+        unmask_interrupt();
+
+    return size;
+}
+
+bool W5500TCP::is_sending(uint8_t s)
+{
+    return (sending & (1 << s)) != 0;
+}
+
+// as for WiznetTCP::keep_alive()
+void W5500TCP::keep_alive(uint8_t s)
+{
+    if (get_socket_status(s) == SOCK_ESTABLISHED)
+        command(s, SOCKET_SEND_KEEP);
+}
+
+// copies data into the TX buffer offset bytes past the write pointer
+void W5500TCP::write_reserved(uint8_t s, uint16_t offset, const char *buffer, uint16_t length)
+{
+    uint16_t ptr = read_word(SOCKET_BLOCK(s), SOCKET_TX_WRITE_PNTR);
+    write_block(TX_BLOCK(s), ptr + offset, (const uint8_t *)buffer, length);
+}
+
+// as for WiznetTCP::commit()
+uint16_t W5500TCP::commit(uint8_t s, uint16_t length)
+{
+    return send_async(s, NULL, length);
+}
+
+// the interrupt handling follows WiznetTCP, except that the W5500
+// has a separate register with an interrupt bit for each socket
+
+void W5500TCP::enable_interrupts()
+{
+    interrupt_driver = this;
+    deferred = 0;
+
+    // enable interrupts for the 8 sockets
+    write_byte(COMMON_BLOCK, W5500_SOCKET_INTR_MASK, 0xFF);
+
+    pinMode(W5500_INT_PIN, INPUT);
+    attachInterrupt(digitalPinToInterrupt(W5500_INT_PIN), isr, LOW);
+    interrupts_enabled = true;
+}
+
+void W5500TCP::isr()
+{
+    W5500TCP *tcp = interrupt_driver;
+
+    if (spi_busy) {
+        mask_interrupt();
+        tcp->deferred = 1;
+        return;
+    }
+
+    tcp->handle_interrupts();
+}
+
+void W5500TCP::handle_interrupts()
+{
+    uint8_t ir;
+
+    while ((ir = read_byte(COMMON_BLOCK, W5500_SOCKET_INTR))) {
+        for (uint8_t s = 0; s < W5500_SOCKETS; ++s) {
+            if (ir & (1 << s))
+                handle_socket(s, 0xFF);
+        }
+    }
+}
+
+void W5500TCP::handle_socket(uint8_t s, uint8_t mask)
+{
+    uint8_t bit = 1 << s;
+    uint8_t flags = read_byte(SOCKET_BLOCK(s), SOCKET_INTERRUPT) & mask;
+
+    if (!flags)
+        return;
+
+    write_byte(SOCKET_BLOCK(s), SOCKET_INTERRUPT, flags);
+
+    if (flags & W5500_CON && events)
+        events->enqueue(Network_Connected_Event_t, (void *)(size_t)s);
+
+    if (flags & W5500_RECV && events)
+        events->enqueue(Network_Readable_Event_t, (void *)(size_t)s);
+
+    if (flags & W5500_TIMEOUT) {
+        sending &= ~bit;
+        pending &= ~bit;
+        waiting &= ~bit;
+
+        if (events)
+            events->enqueue(Network_Timeout_Event_t, (void *)(size_t)s);
+    } else if (flags & W5500_SEND_OK && sending & bit) {
+        if (pending & bit) {
+            pending &= ~bit;
+
+            // don't overwrite a command the main code has just written
+            // for this socket, as for the W5100, see WiznetTCP.cpp
+            if (read_byte(SOCKET_BLOCK(s), SOCKET_COMMAND))
+                waiting |= bit;
+            else
+                start_send(s);
+        } else {
+            sending &= ~bit;
+
+            if (events)
+                events->enqueue(Network_Sent_Event_t, (void *)(size_t)s);
+        }
+    }
+
+    if (flags & W5500_DISCON && events)
+        events->enqueue(Network_Disconnected_Event_t, (void *)(size_t)s);
+}
+
+bool W5500TCP::has_deferred()
+{
+    return deferred || waiting;
+}
+
+// starts the sends that handle_socket() left as the socket was busy
+void W5500TCP::start_waiting()
+{
+    if (interrupts_enabled)
+        mask_interrupt();
+
+    for (uint8_t s = 0; s < W5500_SOCKETS; ++s) {
+        if (waiting & (1 << s)) {
+            waiting &= ~(1 << s);
+            start_send(s);
+        }
+    }
+
+    if (interrupts_enabled && !deferred)
+        unmask_interrupt();
+}
+
+void W5500TCP::service()
+{
+    if (interrupts_enabled) {
+        if (deferred) {
+            deferred = 0;
+            handle_interrupts();
+            unmask_interrupt();
+        }
+    } else {
+        for (uint8_t s = 0; s < W5500_SOCKETS; ++s) {
+            if (sending & (1 << s))
+                handle_socket(s, W5500_SEND_OK|W5500_TIMEOUT);
+        }
+    }
+
+    if (waiting)
+        start_waiting();
+}
+
+// SPI code, with the same pins as for the W5100
+
+void W5500TCP::spi_init()
+{
+    // configure SS, MOSI and SCK as output pins
+    DDRB = _BV(2) | _BV(3) | _BV(5);
+    PORTB |= _BV(2); // set W5500 slave select high
+    PORTC |= _BV(4); // activate internal pull up to disable SD Card
+
+    // no interrupt, enable SPI, MCU as master, SPI mode 0, 8 Mhz clock
+    SPCR = (1<<SPE)|(1<<MSTR);
+    SPSR = (1<<SPI2X);
+}
+
+inline static void setSS()
+{
+    spi_busy = 1;
+    PORTB &= ~_BV(2);
+}
+
+inline static void resetSS()
+{
+    PORTB |= _BV(2);
+    spi_busy = 0;
+}
+
+#define SPI_WAIT() while (!(SPSR & (1<<SPIF)))
+
+// each frame has a 16 bit address and the control byte followed
+// by any number of data bytes, the address incrementing for each
+inline static void start_frame(uint16_t addr, uint8_t control)
+{
+    setSS();
+    SPDR = addr >> 8;
+    SPI_WAIT();
+    SPDR = addr & 0xFF;
+    SPI_WAIT();
+    SPDR = control;
+    SPI_WAIT();
+}
+
+static void read_block(uint8_t block, uint16_t addr, uint8_t *buffer, uint16_t length)
+{
+    start_frame(addr, block);
+
+    while (length--) {
+        SPDR = 0;
+        SPI_WAIT();
+        *buffer++ = SPDR;
+    }
+
+    resetSS();
+}
+
+static void write_block(uint8_t block, uint16_t addr, const uint8_t *buffer, uint16_t length)
+{
+    start_frame(addr, block | WRITE_ACCESS);
+
+    while (length--) {
+        SPDR = *buffer++;
+        SPI_WAIT();
+    }
+
+    resetSS();
+}
+
+static uint8_t read_byte(uint8_t block, uint16_t addr)
+{
+    uint8_t data;
+
+    read_block(block, addr, &data, 1);
+    return data;
+}
+
+static void write_byte(uint8_t block, uint16_t addr, uint8_t data)
+{
+    write_block(block, addr, &data, 1);
+}
+
+static uint16_t read_word(uint8_t block, uint16_t addr)
+{
+    uint8_t data[2];
+
+    read_block(block, addr, data, 2);
+    return (data[0] << 8) | data[1];
+}
+
+static void write_word(uint8_t block, uint16_t addr, uint16_t word)
+{
+    uint8_t data[2] = {(uint8_t)(word >> 8), (uint8_t)(word & 255)};
+
+    write_block(block, addr, data, 2);
+}
+
+// the free and received sizes can change whilst they are
+// being read, so read them until two reads are the same
+static uint16_t read_size(uint8_t block, uint16_t addr)
+{
+    uint16_t size, last = read_word(block, addr);
+
+    while ((size = read_word(block, addr)) != last)
+        last = size;
+
+    return size;
+}
+
+#endif
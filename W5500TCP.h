@@ -0,0 +1,79 @@
+#ifndef _W5500_TCP
+#define _W5500_TCP
+
+/*
+   TCP driver for Wiznet W5500 chip via SPI interface
+
+   This is the W5500 implementation of NetDriver. The W5500 has 8
+   sockets and 16KB each for RX and TX buffers, and unlike the W5100,
+   its SPI frames can carry any number of data bytes, so buffers are
+   transferred in a single burst. It also wraps the buffer pointers
+   itself, so there is no need to split transfers at the buffer end.
+*/
+
+#define W5500_SOCKETS 8
+
+// the W5500 INT output is wired to this pin
+#define W5500_INT_PIN 2
+
+class W5500TCP : public NetDriver
+{
+    private:
+        uint8_t rx_size[W5500_SOCKETS]; // in KB
+        uint8_t tx_size[W5500_SOCKETS]; // in KB
+        EventQueue *events;
+        volatile uint8_t sending;  // bit per socket with a send in flight
+        volatile uint8_t pending;  // bit per socket with more data to send
+        volatile uint8_t deferred; // interrupt left for service()
+        volatile uint8_t waiting;  // bit per socket with a send left for service()
+        bool interrupts_enabled;
+
+        void spi_init();
+        uint16_t queue_data(uint8_t s, char *buffer, uint16_t length);
+        void start_send(uint8_t s);
+        void start_waiting();
+        void command(uint8_t s, uint8_t cmd);
+        void handle_interrupts();
+        void handle_socket(uint8_t s, uint8_t mask);
+        static void isr();
+
+    public:
+        W5500TCP();
+        uint8_t socket_count();
+        bool set_buffer_sizes(const uint8_t *rx_kb, const uint8_t *tx_kb);
+        bool has_buffers(uint8_t s);
+        void set_event_queue(EventQueue *queue);
+        void enable_interrupts();
+        void configure(const uint8_t *mac, const uint8_t *ip,
+                       const uint8_t *subnet, const uint8_t *gateway);
+        void get_local_ip(uint8_t *n0, uint8_t *n1, uint8_t *n2, uint8_t *n3);
+
+        void open(uint8_t s);
+        void open_udp(uint8_t s, uint16_t port, uint32_t group);
+        bool listen(uint8_t s);
+        bool connect(uint8_t s, uint8_t n0, uint8_t n1, uint8_t n2, uint8_t n3, uint16_t port);
+        void disconnect(uint8_t s);
+        void close(uint8_t s);
+        uint8_t get_socket_status(uint8_t s);
+
+        uint16_t send_available(uint8_t s);
+        uint16_t send(uint8_t s, char *buffer, uint16_t length);
+        uint16_t send_async(uint8_t s, char *buffer, uint16_t length);
+        bool is_sending(uint8_t s);
+        void keep_alive(uint8_t s);
+        void write_reserved(uint8_t s, uint16_t offset, const char *buffer, uint16_t length);
+        uint16_t commit(uint8_t s, uint16_t length);
+        void service();
+        bool has_deferred();
+
+        uint16_t receive_available(uint8_t s);
+        uint16_t skip(uint8_t s, uint16_t length);
+        uint16_t peek(uint8_t s, uint16_t offset, char *buffer, uint16_t length);
+        uint16_t receive(uint8_t s, char *buffer, uint16_t length);
+
+        using NetDriver::set_ip;
+        void set_ip(uint8_t s, uint32_t ip);
+        void set_port(uint8_t s, uint16_t port);
+};
+
+#endif
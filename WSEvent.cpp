@@ -3,75 +3,576 @@
 #include <Arduino.h>
 #include "WSEvent.h"
 
-static Event_hander_t network_readable_event_handler;
+// keeps the compiler from moving the writes to an entry past
+// the update to head, the AVR doesn't reorder memory accesses
+#if defined(__AVR__)
+#define memory_barrier() __asm__ __volatile__ ("" ::: "memory")
+#else
+#define memory_barrier() __sync_synchronize()
+#endif
+
+#if defined(pgm_read_ptr)
+#define table_handler(p) ((Event_hander_t)pgm_read_ptr(p))
+#else
+#define table_handler(p) (*(p))
+#endif
+
+static uint8_t priority(uint8_t event)
+{
+    if (event >= FIRST_APPLICATION_EVENT)
+        return PRIORITY_APPLICATION;
+        
+    return (event >= FIRST_TIMER_EVENT ? PRIORITY_TIMER : PRIORITY_NETWORK);
+}
+
+// the statistics saturate rather than wrap
+static void count(uint16_t *n)
+{
+    if (*n != 0xFFFF)
+        ++*n;
+}
 
 EventQueue::EventQueue()
 {
-    begin = count = 0;
-    network_readable_event_handler = NULL;
+    static const uint8_t lengths[EVENT_PRIORITIES] = {
+        EVENT_NETWORK_LENGTH, EVENT_TIMER_LENGTH, EVENT_APPLICATION_LENGTH
+    };
+    EventQueueEntry *entries = queue;
+    
+    // the rings share the entries
+    for (uint8_t i = 0; i < EVENT_PRIORITIES; ++i) {
+        rings[i].head = rings[i].tail = 0;
+        rings[i].mask = lengths[i] - 1;
+        rings[i].entries = entries;
+        entries += lengths[i];
+    }
+    
+    overflows = 0;
+    memset(wheel, 0, sizeof(wheel));
+    timer_tick = 0;
+    timer_ms = millis();
+    timers_running = 0;
+    timers_fired = total_jitter = max_jitter = 0;
+    table = NULL;
+    memset(events, 0, sizeof(events));
+    tasks = NULL;
 }
 
 boolean EventQueue::is_empty()
 {
-    return count == 0;
+    for (uint8_t i = 0; i < EVENT_PRIORITIES; ++i) {
+        if (rings[i].head != rings[i].tail)
+            return false;
+    }
+    
+    return true;
 }
 
 int EventQueue::get_size()
 {
-    return count;
+    int size = 0;
+    
+    for (uint8_t i = 0; i < EVENT_PRIORITIES; ++i)
+        size += (uint8_t)(rings[i].head - rings[i].tail);
+        
+    return size;
 }
 
+// safe to call from an ISR or the loop, returns false if the queue
+// for the event's priority is full, an event with the same data as
+// one already queued is merged with it, as its handler is yet to run
 boolean EventQueue::enqueue(Event_t event, void *data)
 {
+    EventRing *ring;
     EventQueueEntry *entry;
-    int index = begin + count;
+    boolean queued = true;
+    uint8_t index;
     
-    if (count >= EVENT_QUEUE_LENGTH) {
-        //cout << "** event queue overflow\n";
-        // should record error somewhere accessible
-        Serial.println("event queue overflow");
+    if (event >= EVENT_TYPES)
         return false;
+        
+    ring = rings + priority(event);
+    
+#if defined(__AVR__)
+    uint8_t sreg = SREG;
+    cli();
+#endif
+
+    count(&events[event].enqueued);
+    
+    for (index = ring->tail; index != ring->head; ++index) {
+        entry = ring->entries + (index & ring->mask);
+        
+        if (entry->event == event && entry->data == data)
+            break;
+    }
+    
+    if (index != ring->head) {
+        count(&events[event].coalesced);
+    } else if ((uint8_t)(ring->head - ring->tail) <= ring->mask) {
+        entry = ring->entries + (index & ring->mask);
+        entry->event = event;
+        entry->data = data;
+        entry->queued_at = micros();
+        memory_barrier();
+        ring->head = index + 1;
+    } else {
+        count(&events[event].dropped);
+        count(&overflows);
+        queued = false;
     }
     
-    if (index >= EVENT_QUEUE_LENGTH)
-        index -= EVENT_QUEUE_LENGTH;
-    entry = queue + index;
-    entry->event = event;
-    entry->data = data;
-    ++count;
+#if defined(__AVR__)
+    SREG = sreg;
+#endif
+
+    return queued;
+}
+
+// called from sketch loop function, network events come first, then
+// the timers, timer events and application events, with network events
+// checked again between each, no more events are handled from each
+// queue than it holds, so bursts of events can't keep dispatch() busy
+void EventQueue::dispatch()
+{
+    uint8_t budget[EVENT_PRIORITIES];
+    boolean timers_run = false;
+    
+    for (uint8_t i = 0; i < EVENT_PRIORITIES; ++i)
+        budget[i] = rings[i].mask + 1;
+        
+    for (;;) {
+        if (budget[PRIORITY_NETWORK] && run_event(PRIORITY_NETWORK)) {
+            --budget[PRIORITY_NETWORK];
+        } else if (!timers_run) {
+            timers_run = true;
+            
+            if (timers_running)
+                run_timers(millis());
+        } else if (budget[PRIORITY_TIMER] && run_event(PRIORITY_TIMER)) {
+            --budget[PRIORITY_TIMER];
+        } else if (budget[PRIORITY_APPLICATION] && run_event(PRIORITY_APPLICATION)) {
+            --budget[PRIORITY_APPLICATION];
+        } else {
+            break;
+        }
+    }
+    
+    if (tasks)
+        run_tasks();
+}
+
+// handles the next event of the given priority, if there is one
+boolean EventQueue::run_event(uint8_t priority)
+{
+    EventRing *ring = rings + priority;
+    uint8_t index = ring->tail;
+    
+    if (index == ring->head)
+        return false;
+        
+    memory_barrier();
+    
+    // copy the entry before freeing its slot for the producer
+    EventQueueEntry *entry = ring->entries + (index & ring->mask);
+    uint8_t event = entry->event;
+    EventEntry *e = events + event;
+    void *data = entry->data;
+    unsigned long latency = micros() - entry->queued_at;
+    Event_hander_t handler;
+    
+    memory_barrier();
+    ring->tail = index + 1;
+    
+    if (latency > e->max_latency)
+        e->max_latency = (latency < 0xFFFF ? latency : 0xFFFF);
+        
+    if (table && (handler = table_handler(table + event)))
+        handler(data);
+        
+    if (e->handler)
+        e->handler(data);
+        
+    for (EventSubscriber *s = e->subscribers; s; s = s->next)
+        s->handler(data);
+        
+    if (tasks)
+        wake_tasks(event, data);
+        
     return true;
 }
 
-EventQueueEntry *EventQueue::dequeue()
+// the one handler for the event set at run time, NULL to remove it
+void EventQueue::set_handler(Event_t event, Event_hander_t handler)
+{
+    if (event < EVENT_TYPES)
+        events[event].handler = handler;
+}
+
+// handlers fixed at compile time, an array in flash of EVENT_TYPES
+// handlers indexed by event, with NULL for events without one
+void EventQueue::set_table(const Event_hander_t *handlers)
 {
-    if (count == 0)
-        return NULL;
+    table = handlers;
+}
+
+// adds a handler for the event after any others, the subscriber
+// must remain valid until unsubscribe() is called
+void EventQueue::subscribe(Event_t event, EventSubscriber *subscriber,
+                           Event_hander_t handler)
+{
+    EventSubscriber **link;
+    
+    if (event >= EVENT_TYPES)
+        return;
         
-    noInterrupts();
-    int index = begin;
+    for (link = &events[event].subscribers; *link; link = &(*link)->next);
         
-    if (++begin >= EVENT_QUEUE_LENGTH)
-        begin = 0;
+    subscriber->next = NULL;
+    subscriber->handler = handler;
+    *link = subscriber;
+}
+
+void EventQueue::unsubscribe(Event_t event, EventSubscriber *subscriber)
+{
+    EventSubscriber **link;
+    
+    if (event >= EVENT_TYPES)
+        return;
         
-    --count;
-    interrupts();
-    return queue + index;
+    for (link = &events[event].subscribers; *link; link = &(*link)->next) {
+        if (*link == subscriber) {
+            *link = subscriber->next;
+            return;
+        }
+    }
 }
 
-// called from sketch loop function
-void EventQueue::dispatch()
+// the number of events dropped because their queue was full
+uint16_t EventQueue::get_overflows()
 {
-    EventQueueEntry *entry;
+    return overflows;
+}
+
+void EventQueue::print_event_stats()
+{
+    Serial.print(F("event queue overflows = "));
+    Serial.println(overflows);
     
-    while  ((entry = dequeue()))
-    {
-        if (entry->event == Network_Readable_Event_t && network_readable_event_handler)
-            (*network_readable_event_handler)(entry->data);
+    for (uint8_t i = 0; i < EVENT_TYPES; ++i) {
+        if (!events[i].enqueued)
+            continue;
+            
+        Serial.print(F("event "));
+        Serial.print(i);
+        Serial.print(F(": queued = "));
+        Serial.print(events[i].enqueued);
+        Serial.print(F(", dropped = "));
+        Serial.print(events[i].dropped);
+        Serial.print(F(", coalesced = "));
+        Serial.print(events[i].coalesced);
+        Serial.print(F(", max latency = "));
+        Serial.print(events[i].max_latency);
+        Serial.println(F("us"));
     }
 }
 
-void EventQueue::set_handler(Event_t event, Event_hander_t handler)
+// runs handler with data after delay ms, and then every period ms
+// if period isn't 0, restarting the timer if it is already running
+void EventQueue::start_timer(Timer *timer, unsigned long delay, unsigned long period,
+                             Event_hander_t handler, void *data)
 {
-    if (event == Network_Readable_Event_t )
-        network_readable_event_handler = handler;
+    unsigned long now = millis();
+
+    if (timer->link)
+        cancel_timer(timer);
+
+    // the clock stops when no timers are running, so move it on to
+    // the last tick before now, the wheel is empty so nothing cascades
+    if (!timers_running) {
+        unsigned long ticks = (now - timer_ms) >> TIMER_TICK_SHIFT;
+
+        timer_tick += ticks;
+        timer_ms += ticks << TIMER_TICK_SHIFT;
+    }
+
+    timer->due = now + delay;
+    timer->period = period;
+    timer->handler = handler;
+    timer->data = data;
+    insert_timer(timer);
+    ++timers_running;
+}
+
+void EventQueue::cancel_timer(Timer *timer)
+{
+    if (!timer->link)
+        return;
+        
+    *timer->link = timer->next;
+    
+    if (timer->next)
+        timer->next->link = timer->link;
+        
+    timer->link = NULL;
+    --timers_running;
+}
+
+// timers must be zeroed, as globals are, before their first use
+boolean EventQueue::is_running(Timer *timer)
+{
+    return timer->link != NULL;
+}
+
+// links the timer into the slot for its due time, rounded up to a tick
+void EventQueue::insert_timer(Timer *timer)
+{
+    long delta = (long)(timer->due - timer_ms);
+    unsigned long ticks = (delta < TIMER_TICK ? 1 : (delta + TIMER_TICK - 1) >> TIMER_TICK_SHIFT);
+    unsigned long tick;
+    Timer **slot;
+    
+    // relative to the next tick to be processed
+    if (ticks > 1UL << (TIMER_LEVELS * TIMER_SLOT_BITS))
+        ticks = 1UL << (TIMER_LEVELS * TIMER_SLOT_BITS);
+        
+    tick = timer_tick + ticks;
+    --ticks;
+    
+    if (ticks < TIMER_SLOTS)
+        slot = &wheel[0][tick & (TIMER_SLOTS - 1)];
+    else if (ticks < TIMER_SLOTS * TIMER_SLOTS)
+        slot = &wheel[1][(tick >> TIMER_SLOT_BITS) & (TIMER_SLOTS - 1)];
+    else
+        slot = &wheel[2][(tick >> (2 * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1)];
+        
+    timer->next = *slot;
+    
+    if (timer->next)
+        timer->next->link = &timer->next;
+        
+    *slot = timer;
+    timer->link = slot;
+}
+
+// moves the timers in a slot of a higher level down the wheel
+void EventQueue::cascade(uint8_t level, uint8_t slot)
+{
+    Timer *timer, *list = wheel[level][slot];
+    
+    wheel[level][slot] = NULL;
+    
+    while ((timer = list)) {
+        list = timer->next;
+        insert_timer(timer);
+    }
+}
+
+// processes each tick up to now, running the timers that are due
+void EventQueue::run_timers(unsigned long now)
+{
+    while (now - timer_ms >= TIMER_TICK) {
+        unsigned long tick = timer_tick + 1;
+        
+        if (!(tick & (TIMER_SLOTS * TIMER_SLOTS - 1)))
+            cascade(2, (tick >> (2 * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1));
+            
+        if (!(tick & (TIMER_SLOTS - 1)))
+            cascade(1, (tick >> TIMER_SLOT_BITS) & (TIMER_SLOTS - 1));
+            
+        // timers started by the handlers go after this tick
+        timer_tick = tick;
+        timer_ms += TIMER_TICK;
+        
+        // the handlers may cancel timers on the list, so it
+        // is linked from a local until each timer is run
+        Timer *timer, *list = wheel[0][tick & (TIMER_SLOTS - 1)];
+        wheel[0][tick & (TIMER_SLOTS - 1)] = NULL;
+        
+        if (list)
+            list->link = &list;
+            
+        while ((timer = list)) {
+            unsigned long jitter = now - timer->due;
+            
+            list = timer->next;
+            
+            if (list)
+                list->link = &list;
+                
+            ++timers_fired;
+            total_jitter += jitter;
+            
+            if (jitter > max_jitter)
+                max_jitter = jitter;
+                
+            if (timer->period) {
+                timer->due += timer->period;
+                
+                // skip any missed periods
+                if ((long)(now - timer->due) >= 0)
+                    timer->due = now + timer->period;
+                    
+                insert_timer(timer);
+            } else {
+                timer->link = NULL;
+                --timers_running;
+            }
+            
+            timer->handler(timer->data);
+        }
+    }
+}
+
+// ms until the next timer might be due, 0 if one is due now,
+// or TIMER_NONE if none are running, timers on the higher levels
+// count as due when they are next cascaded
+unsigned long EventQueue::next_timer()
+{
+    unsigned long wait = (TIMER_SLOTS - (timer_tick & (TIMER_SLOTS - 1))) * TIMER_TICK;
+    unsigned long now = millis();
+    
+    if (!timers_running)
+        return TIMER_NONE;
+        
+    for (uint8_t i = 1; i <= TIMER_SLOTS; ++i) {
+        if (wheel[0][(timer_tick + i) & (TIMER_SLOTS - 1)]) {
+            wait = i * TIMER_TICK;
+            break;
+        }
+    }
+    
+    wait += timer_ms;
+    return ((long)(wait - now) > 0 ? wait - now : 0);
+}
+
+// ms until dispatch() has something to do, 0 if it has now, or
+// TIMER_NONE if nothing will happen until an event is queued
+unsigned long EventQueue::idle_time()
+{
+    if (!is_empty() || tasks_ready())
+        return 0;
+        
+    return next_timer();
+}
+
+void EventQueue::print_timer_stats()
+{
+    Serial.print(F("timers running = "));
+    Serial.print(timers_running);
+    Serial.print(F(", fired = "));
+    Serial.print(timers_fired);
+    Serial.print(F(", mean jitter = "));
+    Serial.print(timers_fired ? total_jitter / timers_fired : 0);
+    Serial.print(F("ms, max jitter = "));
+    Serial.print(max_jitter);
+    Serial.println(F("ms"));
+}
+
+// resumes a task when its sleep or wait for an event times out
+static void task_timeout(void *data)
+{
+    Task *task = (Task *)data;
+    
+    if (task->state == TASK_WAITING)
+        task->event = EVENT_TYPES;
+        
+    task->state = TASK_READY;
+}
+
+// runs the task from TASK_BEGIN() on the next dispatch(),
+// restarting it if it is already running
+void EventQueue::start_task(Task *task, TaskFunction run, void *context)
+{
+    if (task->state == TASK_STOPPED) {
+        task->next = tasks;
+        tasks = task;
+    }
+    
+    cancel_timer(&task->timer);
+    task->queue = this;
+    task->run = run;
+    task->context = context;
+    task->resume = 0;
+    task->state = TASK_READY;
+}
+
+// the task is removed from the queue on the next dispatch()
+void EventQueue::stop_task(Task *task)
+{
+    if (task->state != TASK_STOPPED) {
+        cancel_timer(&task->timer);
+        task->state = TASK_DONE;
+    }
+}
+
+boolean EventQueue::is_running(Task *task)
+{
+    return task->state != TASK_STOPPED && task->state != TASK_DONE;
+}
+
+void EventQueue::sleep_task(Task *task, unsigned long ms)
+{
+    start_timer(&task->timer, ms, 0, task_timeout, task);
+}
+
+void EventQueue::wait_event(Task *task, uint8_t event, void *data,
+                            unsigned long timeout)
+{
+    task->event = event;
+    task->data = data;
+    
+    if (timeout)
+        start_timer(&task->timer, timeout, 0, task_timeout, task);
+}
+
+// readies the tasks waiting for the event
+void EventQueue::wake_tasks(uint8_t event, void *data)
+{
+    for (Task *task = tasks; task; task = task->next) {
+        if (task->state == TASK_WAITING && task->event == event &&
+            (task->data == TASK_ANY_DATA || task->data == data)) {
+            cancel_timer(&task->timer);
+            task->data = data;
+            task->state = TASK_READY;
+        }
+    }
+}
+
+// resumes the tasks that are ready or polling, and removes those
+// that are done, tasks started meanwhile run on the next call
+void EventQueue::run_tasks()
+{
+    Task **link = &tasks, *task;
+    
+    while ((task = *link)) {
+        if (task->state == TASK_DONE) {
+            *link = task->next;
+            task->state = TASK_STOPPED;
+            continue;
+        }
+        
+        if (task->state == TASK_READY || task->state == TASK_POLLING) {
+            task->state = task->run(task);
+            
+            if (task->state == TASK_DONE) {
+                cancel_timer(&task->timer);
+                continue;
+            }
+        }
+        
+        link = &task->next;
+    }
+}
+
+// true if a task will run on the next dispatch()
+boolean EventQueue::tasks_ready()
+{
+    for (Task *task = tasks; task; task = task->next) {
+        if (task->state == TASK_READY || task->state == TASK_POLLING ||
+            task->state == TASK_DONE)
+            return true;
+    }
+    
+    return false;
 }
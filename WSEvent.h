@@ -5,27 +5,207 @@
 Event queue support to provide non-overlapping software interrupts for a programming model similar to Web page scripts.
 
 Interrupt service handlers should disable the interrupt, and push an event onto the queue and then re-enable the interrupt. The loop() function should call dispatch() to handle the events from the queue
+
+Events have one of three priorities, network, timer and application, with a queue for each, so that a burst of sensor interrupts can't crowd out network events. dispatch() takes the next network event if there is one, else runs the timers that are due once, then takes the next timer event, and only then the next application event. It handles no more events of each priority than its queue holds, so its cost is bounded however fast events arrive. An event with the same id and data as one still waiting in the queue is merged with it, as its handler has yet to run.
+
+Each queue is a ring with separate head and tail indices, each only written by one side, so dispatch() never disables interrupts. The indices are single bytes, which the AVR reads and writes atomically, and run freely, wrapping at 256, so the length must be a power of two. Events may also be queued from the loop, so enqueue() saves the interrupt flag and disables interrupts while it writes the entry. Within an ISR, they are already disabled, so this costs nothing. When a queue is full, the event is dropped and counted rather than reported from the ISR.
+
+Timers are run by dispatch() too, after the network events and before the timer events, so their handlers never overlap with event handlers. The caller owns each Timer, which is linked into a hierarchical timer wheel, so starting and cancelling a timer take constant time however many are running. Level 0 has a slot per 16ms tick, and the slots of the higher levels each cover all of the level below. When the clock reaches a slot of a higher level, its timers are cascaded down. Timers further ahead than the wheel covers wait in the last slot and are cascaded again. The clock stands still whilst no timers are running, and start_timer() moves it on to the current tick. Timers never fire early, and one that is late by more than its period skips the missed periods rather than firing repeatedly.
+
+Handlers are found by indexing tables with the event, so adding an event only means adding it to Event_t. Each event can have a handler in a table in flash that is fixed at compile time, see set_table(), one set at run time with set_handler(), and any number of subscribers, which like timers are owned by the caller and linked in a list. They are called in that order. The queue counts the events queued and dropped for each event, and the longest time one waited in the queue.
+
+Tasks let a protocol flow be written as a sequence of steps, with waits for events or for time in between, instead of as a state machine. They are stackless coroutines, after Simon Tatham's and Adam Dunkels' protothreads: the task function is a switch on the line it last waited at, so each wait returns to dispatch() and the next call jumps back to it. Tasks cost a few bytes each rather than a stack. As with any protothread, local variables aren't kept across a wait, so state goes in the task's context, a wait can't be within a switch statement in the task, and only one wait can go on each line. For example:
+
+    uint8_t flow(Task *task)
+    {
+        TASK_BEGIN(task);
+        TASK_WAIT_EVENT(task, Network_Connected_Event_t, (void *)0, 5000);
+
+        if (TASK_TIMED_OUT(task))
+            return TASK_DONE;
+
+        TASK_SLEEP(task, 100);
+        TASK_END(task);
+    }
+
+A task waiting for an event is resumed after the event's handlers, and ready tasks are run at the end of dispatch().
+
+idle_time() tells an IdleManager, see Idle.h, how long the MCU can sleep before dispatch() has something to do.
 */
 
-#define EVENT_QUEUE_LENGTH  6
+// the queue lengths for each priority, powers of two up to 128
+#define EVENT_NETWORK_LENGTH 8
+#define EVENT_TIMER_LENGTH 4
+#define EVENT_APPLICATION_LENGTH 4
+#define EVENT_QUEUE_LENGTH (EVENT_NETWORK_LENGTH + EVENT_TIMER_LENGTH + EVENT_APPLICATION_LENGTH)
 
-// add additional event names this enum and update WSEvent.cpp to match
-enum Event_t { Network_Readable_Event_t };
+#if (EVENT_NETWORK_LENGTH & (EVENT_NETWORK_LENGTH - 1)) || \
+    (EVENT_TIMER_LENGTH & (EVENT_TIMER_LENGTH - 1)) || \
+    (EVENT_APPLICATION_LENGTH & (EVENT_APPLICATION_LENGTH - 1))
+#error event queue lengths must be powers of two
+#endif
+
+#define PRIORITY_NETWORK 0
+#define PRIORITY_TIMER 1
+#define PRIORITY_APPLICATION 2
+#define EVENT_PRIORITIES 3
+
+#define TIMER_TICK_SHIFT 4   // 16ms ticks
+#define TIMER_TICK (1 << TIMER_TICK_SHIFT)
+#define TIMER_SLOT_BITS 4
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS 3       // covering 16 x 16 x 16 ticks, about 65 seconds
+#define TIMER_NONE 0xFFFFFFFF
+
+// add additional event names to this enum in the section for their
+// priority, the network events come first, then the timer events from
+// FIRST_TIMER_EVENT and the application events from FIRST_APPLICATION_EVENT
+// for network events, the data is the socket number cast to a pointer
+// Gateway_Changed_Event_t is raised by mDNS discovery with NULL data
+// Address_Changed_Event_t is raised by DHCP with NULL data when an
+// address is acquired or changes
+// Timer_Event_t is for hardware timer interrupts, e.g. to take samples
+// the sensor and send events are for the application to raise
+enum Event_t { Network_Readable_Event_t, Network_Sent_Event_t,
+               Network_Timeout_Event_t, Network_Connected_Event_t,
+               Network_Disconnected_Event_t, Gateway_Changed_Event_t,
+               Address_Changed_Event_t,
+               Timer_Event_t,
+               Sensor_Ready_Event_t, Send_Complete_Event_t,
+               EVENT_TYPES };
+
+#define FIRST_TIMER_EVENT Timer_Event_t
+#define FIRST_APPLICATION_EVENT Sensor_Ready_Event_t
 
 typedef void (*Event_hander_t)(void *data);
 
+// for tables of handlers on builds without flash memory attributes
+#if !defined(PROGMEM)
+#define PROGMEM
+#endif
+
 typedef struct {
-    Event_t event;
+    uint8_t event;
     void *data;
+    unsigned long queued_at;  // us
 } EventQueueEntry;
 
+typedef struct {
+    volatile uint8_t head;  // written by enqueue()
+    volatile uint8_t tail;  // written by dispatch()
+    uint8_t mask;           // the length - 1
+    EventQueueEntry *entries;
+} EventRing;
+
+// for subscribe(), the fields are private to the queue
+typedef struct EventSubscriber {
+    struct EventSubscriber *next;
+    Event_hander_t handler;
+} EventSubscriber;
+
+typedef struct {
+    Event_hander_t handler;          // set_handler()
+    EventSubscriber *subscribers;
+    uint16_t enqueued;               // the counts stop at 65535
+    uint16_t dropped;                // when the queue was full
+    uint16_t coalesced;              // with one already queued
+    uint16_t max_latency;            // us, up to 65535
+} EventEntry;
+
+// set up by start_timer(), the fields are private to the queue
+typedef struct Timer {
+    struct Timer *next;
+    struct Timer **link;    // to this timer, NULL when not running
+    unsigned long due;      // ms
+    unsigned long period;   // ms, 0 for one-shot timers
+    Event_hander_t handler;
+    void *data;
+} Timer;
+
+// task states, a task function returns TASK_POLLING, TASK_WAITING,
+// TASK_SLEEPING or TASK_DONE, the wait macros below do this for it
+#define TASK_STOPPED 0    // not known to the queue
+#define TASK_READY 1
+#define TASK_POLLING 2    // run on each dispatch()
+#define TASK_WAITING 3    // for an event
+#define TASK_SLEEPING 4
+#define TASK_DONE 5
+
+#define TASK_ANY_DATA ((void *)-1)
+
+class EventQueue;
+struct Task;
+typedef uint8_t (*TaskFunction)(struct Task *task);
+
+// set up by start_task(), only context is for the task function,
+// tasks must be zeroed, as globals are, before their first use
+typedef struct Task {
+    struct Task *next;
+    EventQueue *queue;
+    TaskFunction run;
+    void *context;
+    uint16_t resume;      // line of the last wait, 0 to start
+    uint8_t state;
+    uint8_t event;        // waited for, EVENT_TYPES if it timed out
+    void *data;           // of the event
+    Timer timer;          // for sleeps and timeouts
+} Task;
+
+#define TASK_BEGIN(task) switch ((task)->resume) { case 0:
+
+#define TASK_END(task) } (task)->resume = 0; return TASK_DONE
+
+// lets other tasks and events run before continuing
+#define TASK_YIELD(task) \
+    do { (task)->resume = __LINE__; return TASK_POLLING; case __LINE__:; } while (0)
+
+// checks the condition on each dispatch() until it is true
+#define TASK_WAIT_UNTIL(task, condition) \
+    do { (task)->resume = __LINE__; case __LINE__: \
+         if (!(condition)) return TASK_POLLING; } while (0)
+
+#define TASK_SLEEP(task, ms) \
+    do { (task)->queue->sleep_task(task, ms); (task)->resume = __LINE__; \
+         return TASK_SLEEPING; case __LINE__:; } while (0)
+
+// waits for the event with the given data, or TASK_ANY_DATA, for up to
+// timeout ms, or forever if timeout is 0, the event's data is then in
+// (task)->data
+#define TASK_WAIT_EVENT(task, event, data, timeout) \
+    do { (task)->queue->wait_event(task, event, data, timeout); \
+         (task)->resume = __LINE__; return TASK_WAITING; case __LINE__:; } while (0)
+
+#define TASK_TIMED_OUT(task) ((task)->event == EVENT_TYPES)
+
 class EventQueue
 {
     private:
-        int begin;
-        int count;
+        EventRing rings[EVENT_PRIORITIES];
+        uint16_t overflows;     // events dropped as a queue was full, up to 65535
         EventQueueEntry queue[EVENT_QUEUE_LENGTH];
-        EventQueueEntry *dequeue();
+        const Event_hander_t *table;  // in flash, indexed by event
+        EventEntry events[EVENT_TYPES];
+        boolean run_event(uint8_t priority);
+
+        // timer wheel, the clock is the last tick processed
+        Timer *wheel[TIMER_LEVELS][TIMER_SLOTS];
+        unsigned long timer_tick;
+        unsigned long timer_ms;   // time of timer_tick
+        uint8_t timers_running;
+
+        // timer statistics
+        unsigned long timers_fired;
+        unsigned long total_jitter;
+        unsigned long max_jitter;
+
+        void insert_timer(Timer *timer);
+        void cascade(uint8_t level, uint8_t slot);
+        void run_timers(unsigned long now);
+
+        Task *tasks;
+        void wake_tasks(uint8_t event, void *data);
+        void run_tasks();
+        boolean tasks_ready();
             
     public:
         EventQueue();
@@ -34,6 +214,29 @@ class EventQueue
         boolean enqueue(Event_t event, void *data);
         void dispatch();
         void set_handler(Event_t event, Event_hander_t handler);
+        void set_table(const Event_hander_t *handlers);
+        void subscribe(Event_t event, EventSubscriber *subscriber,
+                       Event_hander_t handler);
+        void unsubscribe(Event_t event, EventSubscriber *subscriber);
+        uint16_t get_overflows();
+        void print_event_stats();
+
+        void start_timer(Timer *timer, unsigned long delay, unsigned long period,
+                         Event_hander_t handler, void *data);
+        void cancel_timer(Timer *timer);
+        boolean is_running(Timer *timer);
+        unsigned long next_timer();
+        unsigned long idle_time();
+        void print_timer_stats();
+
+        void start_task(Task *task, TaskFunction run, void *context);
+        void stop_task(Task *task);
+        boolean is_running(Task *task);
+        
+        // for the task macros
+        void sleep_task(Task *task, unsigned long ms);
+        void wait_event(Task *task, uint8_t event, void *data,
+                        unsigned long timeout);
 };
 
 #endif
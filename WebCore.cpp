@@ -33,6 +33,19 @@ unsigned int ThingPool::size()
     return things_count;
 }
 
+// recover name for one of the thing's symbols, e.g. for printing
+// note that the name isn't null terminated and may be in flash,
+// on the AVR, this reads the names saved when WebThings::thing()
+// registered the thing, so it is only for things
+const char *CoreThing::get_name(Symbol symbol, unsigned int *length)
+{
+#if defined(WOT_GATEWAY)
+    return Names::dictionary()->name(symbols.shared(symbol), length);
+#else
+    return Names::lookup(names, symbol, length);
+#endif
+}
+
 float ThingPool::used()
 {
     // return percentage of allocated nodes
@@ -31,6 +31,13 @@ class CoreThing
         NPIndex actions; // functions implementing each action
         NPIndex proxies; // set of registered proxies for this thing
         CoreThing *next;  // linked list of registered things/proxies
+#if defined(WOT_GATEWAY)
+        SymbolView symbols;  // maps model symbols to the shared dictionary
+#else
+        unsigned int names;  // EEPROM address of the names, see Names::save()
+#endif
+
+        const char *get_name(Symbol symbol, unsigned int *length);
     
         virtual void register_observer(Symbol event, EventFunc handler) = 0;
         virtual void raise_event(Symbol event, ...) = 0;
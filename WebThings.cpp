@@ -3,6 +3,7 @@
 #include <stdarg.h>
 #include <Arduino.h>
 #include "NodePool.h"
+#include "StringPool.h"
 #include "AvlNode.h"
 #include "Names.h"
 #include "JSON.h"
@@ -28,6 +29,7 @@ WebThings::WebThings()
     Serial.print(F("stale count ")); Serial.println(stale_count);
     AvlNode::initialise_pool(&wot_node_pool);
     JSON::initialise_pool(&wot_node_pool);
+    StringPool::initialise_pool(&wot_node_pool);
     
     Serial.print(F("avl node size: "));
     Serial.print((sizeof(AvlNode)));
@@ -165,21 +167,28 @@ void WebThings::thing(const char *name, const __FlashStringHelper *model, SetupF
 
 void WebThings::thing(const char *name, char *model, SetupFunc setup)
 {
-    Names table;
-    unsigned int id = 0;
-    Thing *t = things, *thing = (Thing *)ThingPool::allocate();
+    static Symbol last_id;
+    Thing *thing = (Thing *)ThingPool::allocate();
     
     if (thing)
     {
-        while (t)
-        {
-            ++id;
-            t = (Thing *)t->next;
-        }
+#if defined(WOT_GATEWAY)
+        // names are interned in the shared dictionary
+        Names table(&thing->symbols);
+#else
+        Names table;
+#endif
+
+        // ids are never reused, and never 0, as that marks a free thing
+        if (!++last_id)
+            last_id = 1;
     
         thing->uri = (char *)name;
-        thing->id = ++id;
+        thing->id = last_id;
         thing->model = get_index(JSON::parse(model, &table));
+#if !defined(WOT_GATEWAY)
+        thing->names = table.save(model);  // see CoreThing::get_name()
+#endif
         thing->events = get_index(JSON::new_object());
         thing->properties = get_index(JSON::new_object());
         thing->actions = get_index(JSON::new_object());
@@ -261,13 +270,13 @@ NPIndex WebThings::get_index(JSON *json)
 void Thing::print()
 {
     Serial.print(F(" model: "));
-    WebThings::get_json(this->model)->print();
+    WebThings::get_json(this->model)->print(this);
     Serial.print(F("\n properties: "));
-    WebThings::get_json(this->properties)->print();
+    WebThings::get_json(this->properties)->print(this);
     Serial.print(F("\n actions: "));
-    WebThings::get_json(this->actions)->print();
+    WebThings::get_json(this->actions)->print(this);
     Serial.print(F("\n events: "));
-    WebThings::get_json(this->events)->print();
+    WebThings::get_json(this->events)->print(this);
     Serial.print(F("\n"));
 }
 
@@ -333,6 +342,9 @@ void Thing::sweep(boolean phase)
 
 void Thing::remove()
 {
+#if defined(WOT_GATEWAY)
+    symbols.clear();
+#endif
     AvlNode::free(properties);
     AvlNode::free(actions);
     AvlNode::free(events);
@@ -406,6 +418,9 @@ void Proxy::sweep(boolean phase)
 
 void Proxy::remove()
 {
+#if defined(WOT_GATEWAY)
+    symbols.clear();
+#endif
     AvlNode::free(properties);
     AvlNode::free(actions);
     AvlNode::free(events);
@@ -1,15 +1,11 @@
 #include <Arduino.h>
 #include "Strings.h"
+#include "WSEvent.h"
+#include "NetDriver.h"
 #include "WiznetTCP.h"
-#include "DHCP.h"
 
-// MULTICAST FOR GATEWAY DISCOVERY
-
-#define DISCOVERY_PORT 54321
-#define DISCOVERY_GROUP "225.0.0.37" 
-
-#define MAX_MDNS_RETRY 10
-#define MDNS_WAIT_TIME 2000
+// the SPI code is for the AVR, other MCUs would use the SPI library
+#if defined(__AVR__)
 
 // COMMON REGISTERS
 
@@ -55,16 +51,12 @@
 
 
 // SOCKET BUFER INFO
-// 2 sockets each with 4KB for TX and RX buffers
-// more generally will need a macro based upon
-// number of sockets that have been initialised
-// for now only concerned with socket zero
+// 8KB each for TX and RX shared between the sockets in order,
+// see set_buffer_sizes(), the default is 2KB for every socket
 
 #define BASE_TX_BUFFER 0x4000
 #define BASE_RX_BUFFER 0x6000
-#define SOCKET_SIZE 0x1000
-#define TX_BUFFER_MASK 0xFFF
-#define RX_BUFFER_MASK 0xFFF
+#define BUFFER_MEMORY 8
 
 // OFFSETS
 
@@ -72,6 +64,7 @@
 #define SOCKET_ONE 0x500
 #define SOCKET_TWO 0x600
 #define SOCKET_THREE 0x700
+#define SOCKET_BASE(s) (SOCKET_ZERO + ((uint16_t)(s) << 8))
 
 // COMMANDs
 
@@ -100,6 +93,8 @@
 // forward reference to SPI data transfer functions
 inline static uint8_t read_byte(uint16_t addr);
 inline static void write_byte(uint16_t addr, uint8_t data);
+static void read_block(uint16_t addr, uint8_t *buffer, uint16_t length);
+static void write_block(uint16_t addr, uint8_t *buffer, uint16_t length);
 static uint16_t read_word(uint16_t addr);
 static void write_word(uint16_t addr, uint16_t word);
 static void write32(uint16_t addr, uint8_t *p);
@@ -108,6 +103,16 @@ static void write32(uint16_t addr, uint8_t n0, uint8_t n1, uint8_t n2, uint8_t n
 static void write48(uint16_t addr, uint8_t n0, uint8_t n1, uint8_t n2,
                                    uint8_t n3, uint8_t n4, uint8_t n5);
 
+// set whilst an SPI frame is in progress, as the ISR can't then use SPI
+static volatile uint8_t spi_busy = 0;
+static WiznetTCP *interrupt_driver;
+
+// the level triggered interrupt is masked whilst it is being deferred,
+// or when the main code needs the socket interrupt flags to itself
+#define INT_MASK_BIT _BV(digitalPinToInterrupt(W5100_INT_PIN))
+#define mask_interrupt() (EIMSK &= ~INT_MASK_BIT)
+#define unmask_interrupt() (EIMSK |= INT_MASK_BIT)
+
 
 WiznetTCP::WiznetTCP()
 {
@@ -117,11 +122,14 @@ WiznetTCP::WiznetTCP()
 
     write_byte(W5100_MODE_REGISTER, 0x80); // reset
     
-    // 2 sockets with 8KB each, i.e. 4KB max packet size
-    // but for 4 sockets with 4KB use value of 0x55
-    // if we only use 1 socket we can use 2 * 4KB for RAM
-    write_byte(W5100_RMSR_REGISTER, 0xAA);
-    write_byte(W5100_TMSR_REGISTER, 0xAA);
+    // 4 sockets each with 2KB for RX and 2KB for TX
+    uint8_t sizes[W5100_SOCKETS] = {2, 2, 2, 2};
+    set_buffer_sizes(sizes, sizes);
+    
+    events = NULL;
+    sending = pending = deferred = waiting = 0;
+    interrupts_enabled = false;
+    local_port = 0;
 }
 
 WiznetTCP::~WiznetTCP()
@@ -129,384 +137,88 @@ WiznetTCP::~WiznetTCP()
     // close W5100 socket
 }
 
-void WiznetTCP::begin(uint16_t port)
+// returns the RMSR/TMSR bits for a buffer of kb KB after used KB
+// have been given to the preceding sockets, or 0xFF if invalid
+static uint8_t size_bits(uint8_t kb, uint8_t used)
 {
-    delay(200); // not needed, here for luck
-    
-    // ask server for IP address, subnet mask and gateway
-    if (!run_DHCP_client()) {
-        // Couldn't get an IP address so use defaults
-        Serial.println(F("Using default network configuration as fall back"));
-        write32(W5100_GATEWAY, 192, 168, 1, 254);
-        write32(W5100_SUBNET_MASK, 255, 255, 255, 0);
-        write32(W5100_LOCAL_IP_ADDRESS, 192, 168, 1, 25);
+    if (used + kb > BUFFER_MEMORY)
+        return 0xFF;
+        
+    switch (kb) {
+        case 1: return 0;
+        case 2: return 1;
+        case 4: return 2;
+        case 8: return 3;
     }
     
-    uint8_t n0, n1, n2, n3;
-    get_local_ip(&n0, &n1, &n2, &n3);
-    Serial.print(F("IP = "));
-    Serial.print(n0);
-    Serial.print(F("."));
-    Serial.print(n1);
-    Serial.print(F("."));
-    Serial.print(n2);
-    Serial.print(F("."));
-    Serial.print(n3);
-    Serial.print(F(", port = "));
-    Serial.println(port);
-    
-    write_word(SOCKET_ZERO + SOCKET_SRC_PORT, port);
-    open();
+    return 0xFF;
 }
 
-void WiznetTCP::begin(uint8_t n0, uint8_t n1, uint8_t n2, uint8_t n3, uint16_t port)
+// sets the RX and TX buffer sizes for each socket in KB, with no more
+// than 8KB in total for each direction. The W5100 can only leave the
+// sockets at the end without memory, and the last is needed for UDP,
+// so every socket needs 1, 2 or 4KB. Call this before opening any
+// sockets, returns false if the sizes are invalid.
+bool WiznetTCP::set_buffer_sizes(const uint8_t *rx_kb, const uint8_t *tx_kb)
 {
-    delay(200); // not needed, here for luck
-    
-    write32(W5100_GATEWAY, n0, n1, n2, 254);
-    write48(W5100_MAC_ADDRESS, 0x61, 0xf8, 0x1d, 0xbc, 0xf4, 0x2f);
-    write32(W5100_SUBNET_MASK, 255, 255, 255, 0);
-    write32(W5100_LOCAL_IP_ADDRESS, n0, n1, n2, n3);
-    write_word(SOCKET_ZERO + SOCKET_SRC_PORT, port);
-    open();
-}
-
-void WiznetTCP::discover_gateway()
-{
-    uint16_t length;
-    uint8_t found = 0;
-    
-    uint8_t query[33] = {
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // header
-        0x04,0x5F,0x77,0x6F,0x74,  // _wot
-        0x04,0x5F,0x74,0x63,0x70,  // _tcp
-        0x05,0x6C,0x6F,0x63,0x61,0x6C,  // local
-        0x00, // end of service type
-        0x00, 0x0C, // QTYPE PTR
-        0x00, 0x01, // QCLASS IN
-    };
-
-    // the gateway is recored as public properties on WiznetTCP class
-    // I need a better way to pass these to the transport layer
-    gateway_ip = 0;
-    gateway_port = 0;
-
-    // save source port to restore it upon return 
-    uint16_t port = read_word(SOCKET_ZERO + SOCKET_SRC_PORT);
-     
-    for (uint8_t i = MAX_MDNS_RETRY; i; --i) {
-        uint8_t status = get_socket_status();
-        
-        if (status == SOCK_INIT || status == SOCK_CLOSED) {
-            Serial.println(F("starting mDNS search"));
-
-            write_word(SOCKET_ZERO + SOCKET_DEST_PORT, 5353);
-            write_word(SOCKET_ZERO + SOCKET_SRC_PORT, 5353);
+    uint8_t rmsr = 0, tmsr = 0, rx_used = 0, tx_used = 0, bits;
+    uint8_t s;
+    
+    for (s = 0; s < W5100_SOCKETS; ++s) {
+        if ((bits = size_bits(rx_kb[s], rx_used)) == 0xFF)
+            return false;
             
-            // mDNS IPv4 dest address 224.0.0.251 port 5353
-            write32(SOCKET_ZERO + SOCKET_IP_ADDRESS, 224, 0, 0, 251);
-
-            // mDNS socket dest mac address 01:00:5E:00:00:FB
-            // this is a simple mapping from the IPv4 address
-            write48(SOCKET_ZERO + SOCKET_MAC_ADDRESS,
-                    0x01, 0x00, 0x5E, 0x00, 0x00, 0xFB);
+        rmsr |= bits << (2 * s);
+        rx_used += rx_kb[s];
+        
+        if ((bits = size_bits(tx_kb[s], tx_used)) == 0xFF)
+            return false;
             
-            // The W5100 automatically sends the IGMP join (report)
-            // when the multicast socket is opened, and likewise, sends
-            // the IGMP leave automatically when the socket is closed
+        tmsr |= bits << (2 * s);
+        tx_used += tx_kb[s];
+    }
     
-            write_byte(SOCKET_ZERO + SOCKET_MODE, SOCKET_UDP|SOCKET_MULTICAST|IGMP_V2);
-            write_byte(SOCKET_ZERO + SOCKET_COMMAND, SOCKET_OPEN);
-        }
+    rx_used = tx_used = 0;
     
-        if (get_socket_status() == SOCK_UDP) {
-            Serial.print(F("querying _wot._tcp.local, "));
-	        send((char *)query, sizeof(query));
-	    } else {
-	        Serial.println(F("socket not open for UDP"));
-	        close();
-	        continue;
-	    }
-	    
-	    if ((length = receive_available(MDNS_WAIT_TIME)) > 0) {
-	        Serial.print(F("got mDNS message wireshark length "));
-            Serial.println(length+34);
-	        
-	        if (!handle_mDNS_response(query))
-	            Serial.println(F("error in DNS message"));
-	            
-	        if (gateway_ip) {
-	            found = 1;
-	            break;
-	        }
-	        
-	        flush_receive();
-	    }
-	}
-
-    close();
-    
-    if (!found)
-        Serial.print(F("couldn't find gateway, "));
+    for (s = 0; s < W5100_SOCKETS; ++s) {
+        rx_base[s] = BASE_RX_BUFFER + 1024 * rx_used;
+        rx_mask[s] = 1024 * rx_kb[s] - 1;
+        rx_used += rx_kb[s];
         
-    write_word(SOCKET_ZERO + SOCKET_SRC_PORT, port);
-    Serial.println(F("ending mDNS search"));
+        tx_base[s] = BASE_TX_BUFFER + 1024 * tx_used;
+        tx_mask[s] = 1024 * tx_kb[s] - 1;
+        tx_used += tx_kb[s];
+    }
+    
+    write_byte(W5100_RMSR_REGISTER, rmsr);
+    write_byte(W5100_TMSR_REGISTER, tmsr);
+    return true;
 }
 
-// query is the mDNS query message that triggered the response
-uint8_t WiznetTCP::handle_mDNS_response(uint8_t *query)
+// queue for Network_Sent_Event_t and Network_Timeout_Event_t
+void WiznetTCP::set_event_queue(EventQueue *queue)
 {
-    uint32_t ip;
-    uint16_t port, offset = 0, name_offset, srv_link = 0;
-    uint8_t buffer[64];
-    uint8_t match;
-    uint16_t length = receive_available();
-    
-    // first 8 bytes are for IPv4 address, port and length
-    // these are followed by the 12 byte DNS message header
-    if (peek(offset, (char *)buffer, 20) != 20)
-        return 0;
-
-    offset += 20;
-    uint16_t id    = buffer[8]; id <<= 8; id |= buffer[9];
-    uint16_t flags = buffer[10]; flags <<= 8; flags |= buffer[11];
-    uint16_t qdcnt = buffer[12]; qdcnt <<= 8; qdcnt |= buffer[13];
-    uint16_t ancnt = buffer[14]; ancnt <<= 8; ancnt |= buffer[15];
-    uint16_t nscnt = buffer[16]; nscnt <<= 8; nscnt |= buffer[17];
-    uint16_t arcnt = buffer[18]; arcnt <<= 8; arcnt |= buffer[19];
-    uint8_t rrcount = ancnt + nscnt + arcnt;
-
-    Serial.print(F(" id = 0x")); Serial.println(id, HEX);
-    Serial.print(F(" flags = 0x")); Serial.println(flags, HEX);
-    Serial.print(F(" Questions: ")); Serial.println(qdcnt);
-    Serial.print(F(" Answer RRs: ")); Serial.println(ancnt);
-    Serial.print(F(" Authority RRs: ")); Serial.println(nscnt);
-    Serial.print(F(" Additional RRs: ")); Serial.println(arcnt);
-
-    // Parse questions which may come from other clients
-        
-    while (qdcnt--) {
-        Serial.print(F("QN: "));
-        
-        if (!(offset = parse_name(offset, buffer, query+12, &match)))
-            return 0;
-        
-        // skip over qtype and qclass
-        if (peek(offset, (char *)buffer, 4) != 4)
-                return 0;
-                
-        offset += 4;
-        uint16_t qtype = buffer[0]; qtype <<= 8; qtype |= buffer[1];
-        uint16_t qclass = buffer[2]; qclass <<= 8; qclass |= buffer[3];
-        Serial.print(F(" type = 0x")); Serial.println(qtype, HEX);
-        Serial.print(F(" class = 0x")); Serial.println(qclass, HEX);
-    }
-
-    // Parse resource records 
-    
-    while (rrcount--) {
-        // read DNS NAME and check it is as expected
-        // NAMES are <= 255 bytes including length fields
-        // LABELS are 63 bytes max
-        // *** please implement the checking algorithm
-                
-        Serial.print(F("RN: "));
-        name_offset = offset; // note for later match
-        
-        if (!(offset = parse_name(offset, buffer, query+12, &match)))
-            return 0;
-        
-        // TYPE 2 bytes with resource record type.
-        // CLASS 2 bytes indicating the class of the data
-        // TTL a 32 bit unsigned integer giving expiry time in seconds
-        // RDLENGTH 16 bits indicating the length of the RDATA field in bytes.
-        // RDATA varies depending on the type and class of the resource record.
-
-        // read the resource record header
-        if (peek(offset, (char *)buffer, 10) != 10)
-            return 0;
-
-        offset += 10;
-        uint16_t rtype = buffer[0]; rtype <<= 8; rtype |= buffer[1];
-        uint16_t rclass = buffer[2]; rclass <<= 8; rclass |= buffer[3];
-        uint32_t time2live = buffer[4];
-        time2live <<= 8; time2live |= buffer[5];
-        time2live <<= 8; time2live |= buffer[6];
-        time2live <<= 8; time2live |= buffer[7];
-        uint16_t rdlength = buffer[8]; rdlength <<= 8; rdlength |= buffer[9];
-        
-        Serial.print(F("Rtype: "));
-        Serial.println(rtype);
-        Serial.print(F("Rclass: 0x"));
-        Serial.println(rclass, HEX);
-        Serial.print(F("Rttl: "));
-        Serial.println(time2live);
-        Serial.print(F("Rlength: "));
-        Serial.println(rdlength);
-        
-        // followed by rdlength bytes of data
-        
-        if (rtype == 33) {
-            // DNS SRV record - server port
-            if (peek(offset, (char *)buffer, 6) != 6)
-                return 0;
-                
-            offset += 6;
-            uint16_t srv_port = buffer[4];
-            srv_port <<= 8;
-            srv_port |= buffer[5];
-            srv_link = offset;
-            rdlength -= 6;
-            
-            Serial.print(F("Got port "));
-            Serial.println(srv_port);    
-                  
-            if (match)
-                gateway_port = srv_port;
-        } else if (rtype == 1) {
-            // DNS A record - IPv4 address
-            if (peek(offset, (char *)buffer, 4) != 4)
-                return 0;
-
-            offset += 4;
-            uint32_t srv_ip = buffer[0];
-            srv_ip <<= 8; srv_ip |= buffer[1];
-            srv_ip <<= 8; srv_ip |= buffer[2];
-            srv_ip <<= 8; srv_ip |= buffer[3];
-            rdlength -= 4;
-            
-            Serial.print(F("Got IP "));
-            Serial.print((srv_ip>>24)&255);
-            Serial.print(F("."));
-            Serial.print((srv_ip>>16)&255);
-            Serial.print(F("."));
-            Serial.print((srv_ip>>8)&255);
-            Serial.print(F("."));
-            Serial.print(srv_ip&255);
-            Serial.println();
-            
-            uint16_t link = get_link(name_offset);
-            
-            if (link < 0xFFFF && link == srv_link) {
-                Serial.println(F("Matching IP record"));
-                gateway_ip = srv_ip;
-            }
-        }
-        
-        offset += rdlength;
-    }
-    
-    // found gateway?
-    
-    if (gateway_ip && gateway_port) {
-        Serial.print(F("Gateway IP = "));
-        Serial.print((gateway_ip>>24)&255);
-        Serial.print(F("."));
-        Serial.print((gateway_ip>>16)&255);
-        Serial.print(F("."));
-        Serial.print((gateway_ip>>8)&255);
-        Serial.print(F("."));
-        Serial.print(gateway_ip&255);
-        Serial.print(F(", port = "));
-        Serial.println(gateway_port);
-    }
-                
-    return 1;
+    events = queue;
 }
 
-// link to first NAME is 12, but need to add
-// 8 for the preceding IPv4, port and length
-uint16_t WiznetTCP::get_link(uint16_t offset)
+// every socket has buffers on the W5100, see set_buffer_sizes()
+bool WiznetTCP::has_buffers(uint8_t)
 {
-    uint8_t buffer[2];
-    uint16_t link;
-    
-    if (peek(offset++, (char *)buffer, 2) != 2)
-            return 0xFFFF;
-            
-    link = buffer[0];
-    
-    if (link < 0xC0)
-        return 0xFFFF;
-        
-    link -= 0xC0;
-    link <<= 8;
-    link |= buffer[1];
-    return link + 8;
+    return true;
 }
 
-// sn is the service name used in the mDNS query
-// buffer is large enough for all valid labels
-// offset is position to read within received message
-uint16_t WiznetTCP::parse_name(uint16_t offset, uint8_t *buffer,
-                                uint8_t *sn, uint8_t *matched)
+uint8_t WiznetTCP::socket_count()
 {
-    uint16_t saved = 0;
-    uint8_t i = 0;
-    uint8_t match = 1;
-    *matched = 0;
-    
-    for (;;) {
-        // get number of characters in label
-        if (peek(offset++, (char *)buffer, 1) != 1)
-            return 0;
+    return W5100_SOCKETS;
+}
 
-        uint8_t label_len = buffer[0];
-            
-        // 0 signals end of NAME
-        if (!label_len) {
-            if (saved)
-                offset = saved;
-            break;
-        }
-        
-        // check for link to NAME earlier in message
-        if (label_len >= 0xC0) {
-            if (peek(offset++, (char *)buffer+1, 1) != 1)
-                return 0;
-                    
-            if (!saved)
-                saved = offset;
-                    
-            offset = buffer[0] - 0xC0;
-            offset <<= 8;
-            offset |= buffer[1];
-            offset += 8;
-            continue;
-        }
-        
-        // RFC 1025: labels should be 63 octets or less
-        if (label_len > 63)
-            return 0;
-            
-        // read name part into buffer
-        if (peek(offset, (char *)buffer, label_len) != label_len)
-            return 0;
-                
-        offset += label_len;
-        buffer[label_len] = '\0';
-        Serial.print((char *)buffer);
-        Serial.print(F("."));
-        
-        // check for incremental match to query service name
-        if (match) {
-            if (*sn == label_len &&
-             !strncmp((const char *)sn+1, (const char *)buffer, (size_t)label_len))
-                sn += 1 + label_len;
-            else if (i > 0)
-                 match = 0;
-        }
-        
-        ++i;
-    }
-        
-    Serial.println();
-    
-    if (match)
-        Serial.println(F("record matches query"));
-        
-    *matched = match;
-    return offset;
+void WiznetTCP::configure(const uint8_t *mac, const uint8_t *ip,
+                          const uint8_t *subnet, const uint8_t *gateway)
+{
+    write48(W5100_MAC_ADDRESS, (uint8_t *)mac);
+    write32(W5100_LOCAL_IP_ADDRESS, (uint8_t *)ip);
+    write32(W5100_SUBNET_MASK, (uint8_t *)subnet);
+    write32(W5100_GATEWAY, (uint8_t *)gateway);
 }
 
 // to be scrapped as will waste flash space after debugging is done
@@ -580,88 +292,124 @@ void WiznetTCP::print_mac_address()
 }
 #endif
 
-void WiznetTCP::open()
+// all TCP sockets share the local port, so several clients
+// can be served at once by listening on more than one socket
+void WiznetTCP::open(uint8_t s)
+{
+    write_word(SOCKET_BASE(s) + SOCKET_SRC_PORT, local_port);
+    write_byte(SOCKET_BASE(s) + SOCKET_MODE, SOCKET_TCP);
+    write_byte(SOCKET_BASE(s) + SOCKET_COMMAND, SOCKET_OPEN);
+    
+    // wait for command to be processed
+    while (read_byte(SOCKET_BASE(s) + SOCKET_COMMAND));
+}
+
+// opens a UDP socket on the given local port, if group isn't zero
+// the socket joins that IPv4 multicast group, which it also sends to
+void WiznetTCP::open_udp(uint8_t s, uint16_t port, uint32_t group)
 {
-    write_byte(SOCKET_ZERO + SOCKET_MODE, SOCKET_TCP);
-    write_byte(SOCKET_ZERO + SOCKET_COMMAND, SOCKET_OPEN);
+    uint8_t mode = SOCKET_UDP;
+    
+    write_word(SOCKET_BASE(s) + SOCKET_SRC_PORT, port);
+    
+    if (group) {
+        write_word(SOCKET_BASE(s) + SOCKET_DEST_PORT, port);
+        set_ip(s, group);
+        
+        // the multicast mac address is a simple mapping
+        // from the IPv4 address, e.g. 01:00:5E:00:00:FB
+        write48(SOCKET_BASE(s) + SOCKET_MAC_ADDRESS, 0x01, 0x00, 0x5E,
+                (group >> 16) & 0x7F, (group >> 8) & 255, group & 255);
+        
+        // The W5100 automatically sends the IGMP join (report)
+        // when the multicast socket is opened, and likewise, sends
+        // the IGMP leave automatically when the socket is closed
+        mode |= SOCKET_MULTICAST|IGMP_V2;
+    }
+    
+    write_byte(SOCKET_BASE(s) + SOCKET_MODE, mode);
+    write_byte(SOCKET_BASE(s) + SOCKET_COMMAND, SOCKET_OPEN);
+    
+    // wait for command to be processed
+    while (read_byte(SOCKET_BASE(s) + SOCKET_COMMAND));
 }
 
-bool WiznetTCP::listen()
+bool WiznetTCP::listen(uint8_t s)
 {
-    if (get_socket_status() == SOCK_INIT)
+    if (get_socket_status(s) == SOCK_INIT)
     {
-        write_byte(SOCKET_ZERO + SOCKET_COMMAND, SOCKET_LISTEN);
+        write_byte(SOCKET_BASE(s) + SOCKET_COMMAND, SOCKET_LISTEN);
     
         // wait for command to be processed
-        while (read_byte(SOCKET_ZERO + SOCKET_COMMAND));
+        while (read_byte(SOCKET_BASE(s) + SOCKET_COMMAND));
         
-        if (get_socket_status() == SOCK_LISTEN)
+        if (get_socket_status(s) == SOCK_LISTEN)
             return true;
             
-        close();
+        close(s);
     }
     
     return false;
 }
 
-bool WiznetTCP::connect(uint8_t n0, uint8_t n1, uint8_t n2, uint8_t n3, uint16_t port)
+bool WiznetTCP::connect(uint8_t s, uint8_t n0, uint8_t n1, uint8_t n2, uint8_t n3, uint16_t port)
 {
-    if (get_socket_status() == SOCK_INIT)
+    if (get_socket_status(s) == SOCK_INIT)
     {
-        set_ip(n0, n1, n2, n3);
-        set_port(port);
+        set_ip(s, n0, n1, n2, n3);
+        set_port(s, port);
         
-        write_byte(SOCKET_ZERO + SOCKET_COMMAND, SOCKET_CONNECT);
+        write_byte(SOCKET_BASE(s) + SOCKET_COMMAND, SOCKET_CONNECT);
     
         // wait for command to be processed
-        while (read_byte(SOCKET_ZERO + SOCKET_COMMAND));
+        while (read_byte(SOCKET_BASE(s) + SOCKET_COMMAND));
         return true;
     }
     
     return false;
 }
 
-void WiznetTCP::close()
+void WiznetTCP::close(uint8_t s)
 {
-    write_byte(SOCKET_ZERO + SOCKET_COMMAND, SOCKET_CLOSE);
+    write_byte(SOCKET_BASE(s) + SOCKET_COMMAND, SOCKET_CLOSE);
     
     // wait for command to be processed
-    while (read_byte(SOCKET_ZERO + SOCKET_COMMAND));
+    while (read_byte(SOCKET_BASE(s) + SOCKET_COMMAND));
 
     // clear interrupts
-    write_byte(SOCKET_ZERO + SOCKET_INTERRUPT, 0xFF);
+    write_byte(SOCKET_BASE(s) + SOCKET_INTERRUPT, 0xFF);
+    sending &= ~(1 << s);
+    pending &= ~(1 << s);
+    waiting &= ~(1 << s);
 }
 
-void WiznetTCP::disconnect()
+void WiznetTCP::disconnect(uint8_t s)
 {
-    write_byte(SOCKET_ZERO + SOCKET_COMMAND, SOCKET_DISCONNECT);
+    write_byte(SOCKET_BASE(s) + SOCKET_COMMAND, SOCKET_DISCONNECT);
     
     // wait for command to be processed
-    while (read_byte(SOCKET_ZERO + SOCKET_COMMAND));
+    while (read_byte(SOCKET_BASE(s) + SOCKET_COMMAND));
 
     // clear interrupts
-    write_byte(SOCKET_ZERO + SOCKET_INTERRUPT, 0xFF);
+    write_byte(SOCKET_BASE(s) + SOCKET_INTERRUPT, 0xFF);
+    sending &= ~(1 << s);
+    pending &= ~(1 << s);
+    waiting &= ~(1 << s);
 }
 
-void WiznetTCP::set_ip(uint32_t ip)
+void WiznetTCP::set_ip(uint8_t s, uint32_t ip)
 {
     // ip is little endian but W5100 expects big endian
-    write32(SOCKET_ZERO + SOCKET_IP_ADDRESS,
+    write32(SOCKET_BASE(s) + SOCKET_IP_ADDRESS,
          (ip>>24) & 255, (ip>>16) & 255, (ip>>8) & 255, ip & 255);
 }
 
-// use ip(192, 43, 244, 18) for "192.43.244.18"
-void WiznetTCP::set_ip(uint8_t n0, uint8_t n1, uint8_t n2, uint8_t n3)
+void WiznetTCP::get_ip(uint8_t s, uint8_t *n0, uint8_t *n1, uint8_t *n2, uint8_t *n3)
 {
-    write32(SOCKET_ZERO + SOCKET_IP_ADDRESS, n0, n1, n2, n3);
-}
-
-void WiznetTCP::get_ip(uint8_t *n0, uint8_t *n1, uint8_t *n2, uint8_t *n3)
-{
-    *n0 = read_byte(SOCKET_ZERO + SOCKET_IP_ADDRESS);
-    *n1 = read_byte(SOCKET_ZERO + SOCKET_IP_ADDRESS + 1);
-    *n2 = read_byte(SOCKET_ZERO + SOCKET_IP_ADDRESS + 2);
-    *n3 = read_byte(SOCKET_ZERO + SOCKET_IP_ADDRESS + 3);
+    *n0 = read_byte(SOCKET_BASE(s) + SOCKET_IP_ADDRESS);
+    *n1 = read_byte(SOCKET_BASE(s) + SOCKET_IP_ADDRESS + 1);
+    *n2 = read_byte(SOCKET_BASE(s) + SOCKET_IP_ADDRESS + 2);
+    *n3 = read_byte(SOCKET_BASE(s) + SOCKET_IP_ADDRESS + 3);
 }
 
 void WiznetTCP::get_local_ip(uint8_t *n0, uint8_t *n1, uint8_t *n2, uint8_t *n3)
@@ -672,100 +420,74 @@ void WiznetTCP::get_local_ip(uint8_t *n0, uint8_t *n1, uint8_t *n2, uint8_t *n3)
     *n3 = read_byte(W5100_LOCAL_IP_ADDRESS + 3);
 }
 
-void WiznetTCP::set_port(uint16_t port)
+void WiznetTCP::set_port(uint8_t s, uint16_t port)
 {
-    write_word(SOCKET_ZERO + SOCKET_DEST_PORT, port);
+    write_word(SOCKET_BASE(s) + SOCKET_DEST_PORT, port);
 }
 
 // does this get the local or remote port?
 // W5100 spec is ambiguous with use of Source and Destination
 // for IP address, socket dest IP is the IP of the remote device
 // but for ports, the question is how this varies from TX to RX
-uint16_t WiznetTCP::get_port()
+uint16_t WiznetTCP::get_port(uint8_t s)
 {
-    return read_word(SOCKET_ZERO + SOCKET_DEST_PORT);
+    return read_word(SOCKET_BASE(s) + SOCKET_DEST_PORT);
 }
 
-uint16_t WiznetTCP::get_local_port()
+uint16_t WiznetTCP::get_local_port(uint8_t s)
 {
-    return read_word(SOCKET_ZERO+SOCKET_SRC_PORT);;
+    return read_word(SOCKET_BASE(s) + SOCKET_SRC_PORT);;
 }
 
-uint8_t WiznetTCP::get_socket_status()
+uint8_t WiznetTCP::get_socket_status(uint8_t s)
 {
-    return read_byte(SOCKET_ZERO + SOCKET_STATUS);
+    return read_byte(SOCKET_BASE(s) + SOCKET_STATUS);
 }
 
-uint16_t WiznetTCP::send_available()
+uint16_t WiznetTCP::send_available(uint8_t s)
 {
-    return read_word(SOCKET_ZERO + SOCKET_TX_FREE_SIZE);
+    return read_word(SOCKET_BASE(s) + SOCKET_TX_FREE_SIZE);
 }
 
-uint16_t WiznetTCP::receive_available()
+uint16_t WiznetTCP::receive_available(uint8_t s)
 {
-    return read_word(SOCKET_ZERO + SOCKET_RX_RECV_SIZE);
+    return read_word(SOCKET_BASE(s) + SOCKET_RX_RECV_SIZE);
 }
 
-// wait for data until ms milliseconds then return 0
-uint16_t WiznetTCP::receive_available(uint16_t ms)
+uint16_t WiznetTCP::skip(uint8_t s, uint16_t length)
 {
-    unsigned long last_time = 0, now = millis();
-    
-    while (ms) {
-        uint16_t size = read_word(SOCKET_ZERO + SOCKET_RX_RECV_SIZE);
-        
-        if (size)
-            return size;
-            
-        now = millis();
-        
-        if (now != last_time)
-            --ms;
-        
-        last_time = now;
-    }
-
-    return 0;
-}
-
-uint16_t WiznetTCP::flush_receive()
-{
-    return skip(read_word(SOCKET_ZERO + SOCKET_RX_RECV_SIZE));
-}
-
-uint16_t WiznetTCP::skip(uint16_t length)
-{
-    uint16_t size = read_word(SOCKET_ZERO + SOCKET_RX_RECV_SIZE);
+    uint16_t size = read_word(SOCKET_BASE(s) + SOCKET_RX_RECV_SIZE);
     
     if (size) {
-        uint16_t ptr = read_word(SOCKET_ZERO + SOCKET_RX_READ_PNTR);
+        uint16_t ptr = read_word(SOCKET_BASE(s) + SOCKET_RX_READ_PNTR);
     
         if (size > length)
             size = length;
         
         // update socket's read pointer
-        write_word(SOCKET_ZERO + SOCKET_RX_READ_PNTR, ptr+size);
+        write_word(SOCKET_BASE(s) + SOCKET_RX_READ_PNTR, ptr+size);
     
         // re-enable receiving on this socket
-        write_byte(SOCKET_ZERO + SOCKET_COMMAND, SOCKET_RECEIVE);
+        write_byte(SOCKET_BASE(s) + SOCKET_COMMAND, SOCKET_RECEIVE);
     
         // wait for command to be processed
-        while (read_byte(SOCKET_ZERO + SOCKET_COMMAND));
+        while (read_byte(SOCKET_BASE(s) + SOCKET_COMMAND));
     }
     return size;
 }
 
-uint16_t WiznetTCP::peek(uint16_t offset, char *buffer, uint16_t length)
+uint16_t WiznetTCP::peek(uint8_t s, uint16_t offset, char *buffer, uint16_t length)
 {
-    uint16_t size = read_word(SOCKET_ZERO + SOCKET_RX_RECV_SIZE);
+    uint16_t size = read_word(SOCKET_BASE(s) + SOCKET_RX_RECV_SIZE);
     
     if (size > offset) {
-        uint16_t ptr = offset + read_word(SOCKET_ZERO + SOCKET_RX_READ_PNTR);
+        uint16_t ptr = offset + read_word(SOCKET_BASE(s) + SOCKET_RX_READ_PNTR);
+        size -= offset;
     
         if (size > length)
             size = length;
         
-        get_data(ptr, (uint8_t *)buffer, size);
+        get_data(s, ptr, (uint8_t *)buffer, size);
     }
     else
         size = 0;
@@ -774,95 +496,88 @@ uint16_t WiznetTCP::peek(uint16_t offset, char *buffer, uint16_t length)
 }
 
 // returns what's currently available
-uint16_t WiznetTCP::receive(char *buffer, uint16_t length)
+uint16_t WiznetTCP::receive(uint8_t s, char *buffer, uint16_t length)
 {
-    uint16_t size = read_word(SOCKET_ZERO + SOCKET_RX_RECV_SIZE);
+    uint16_t size = read_word(SOCKET_BASE(s) + SOCKET_RX_RECV_SIZE);
     
     if (size) {
-        uint16_t ptr = read_word(SOCKET_ZERO + SOCKET_RX_READ_PNTR);
+        uint16_t ptr = read_word(SOCKET_BASE(s) + SOCKET_RX_READ_PNTR);
     
         if (size > length)
             size = length;
         
-        get_data(ptr, (uint8_t *)buffer, size);
+        get_data(s, ptr, (uint8_t *)buffer, size);
     
         // update socket's read pointer
-        write_word(SOCKET_ZERO + SOCKET_RX_READ_PNTR, ptr+size);
+        write_word(SOCKET_BASE(s) + SOCKET_RX_READ_PNTR, ptr+size);
     
         // re-enable receiving on this socket
-        write_byte(SOCKET_ZERO + SOCKET_COMMAND, SOCKET_RECEIVE);
+        write_byte(SOCKET_BASE(s) + SOCKET_COMMAND, SOCKET_RECEIVE);
     
         // wait for command to be processed
-        while (read_byte(SOCKET_ZERO + SOCKET_COMMAND));
+        while (read_byte(SOCKET_BASE(s) + SOCKET_COMMAND));
     }
     return size;
 }
 
-uint16_t WiznetTCP::receive(char *buffer, uint16_t length, uint32_t *ip, uint16_t *port)
+// copies up to length bytes into the socket's TX buffer
+// without sending them, returns the number of bytes copied
+uint16_t WiznetTCP::queue_data(uint8_t s, char *buffer, uint16_t length)
 {
-    uint16_t size = read_word(SOCKET_ZERO + SOCKET_RX_RECV_SIZE);
-    
-    if (size) {
-        uint8_t header[8];
-        uint16_t ptr = read_word(SOCKET_ZERO + SOCKET_RX_READ_PNTR);
-        get_data(ptr, header, 8); // IP4, port, length
-    
-        // ip is little endian but W5100 provides big endian
-        *ip = header[0];
-        *ip <<= 8; *ip |= header[1];
-        *ip <<= 8; *ip |= header[2];
-        *ip <<= 8; *ip |= header[3];
-        *port = 256 * header[4] + header[5];
-        size = 256 * header[6] + header[7];
+    uint16_t size = send_available(s);
     
-        if (size > length)
-            size = length;
-        
-        ptr += 8; // past header
-        get_data(ptr, (uint8_t *)buffer, size);
+    // send up to the available space
+    if (length < size)
+        size = length;
     
-        // update socket's read pointer
-        write_word(SOCKET_ZERO + SOCKET_RX_READ_PNTR, ptr+size);
+    uint16_t ptr = read_word(SOCKET_BASE(s) + SOCKET_TX_WRITE_PNTR);
     
-        // re-enable receiving on this socket
-        write_byte(SOCKET_ZERO + SOCKET_COMMAND, SOCKET_RECEIVE);
+    // buffer is NULL when the data was written by write_reserved()
+    if (buffer)
+        put_data(s, ptr, (uint8_t *)buffer, size);
     
-        // wait for command to be processed
-        while (read_byte(SOCKET_ZERO + SOCKET_COMMAND));
-    }
+    // update socket's send pointer
+    write_word(SOCKET_BASE(s) + SOCKET_TX_WRITE_PNTR, ptr+size);
     return size;
 }
 
-uint16_t WiznetTCP::send(char *buffer, uint16_t length)
+// ask W5100 to send what is in the TX buffer
+void WiznetTCP::start_send(uint8_t s)
 {
-    uint16_t size = send_available();
+    uint8_t mode = read_byte(SOCKET_BASE(s) + SOCKET_MODE);
     
-    // send up to the available space
-    if (length < size)
-        size = length;
-    
-    uint8_t mode = read_byte(SOCKET_ZERO + SOCKET_MODE);
-    uint16_t ptr = read_word(SOCKET_ZERO + SOCKET_TX_WRITE_PNTR);
-    put_data(ptr, (uint8_t *)buffer, size);
-    
-    // update socket's send pointer
-    write_word(SOCKET_ZERO + SOCKET_TX_WRITE_PNTR, ptr+size);
-
-    // ask W5100 to send the packet
-    write_byte(SOCKET_ZERO + SOCKET_COMMAND,
+    write_byte(SOCKET_BASE(s) + SOCKET_COMMAND,
          (mode & SOCKET_MULTICAST ? SOCKET_SEND_MAC : SOCKET_SEND));
     
-    // wait for command to be processed
-    while (read_byte(SOCKET_ZERO + SOCKET_COMMAND));
+    // wait for command to be accepted, which only takes a few
+    // microseconds, unlike waiting for the data to be sent
+    while (read_byte(SOCKET_BASE(s) + SOCKET_COMMAND));
+}
+
+// blocks until the data has been sent or the send times out
+uint16_t WiznetTCP::send(uint8_t s, char *buffer, uint16_t length)
+{
+    // stop the ISR from clearing the flags we are waiting for
+    if (interrupts_enabled)
+        mask_interrupt();
+        
+    uint16_t size = queue_data(s, buffer, length);
+    start_send(s);
     
     // wait for data to be sent or for a timeout
-    while ((read_byte(SOCKET_ZERO + SOCKET_INTERRUPT) & W5100_SEND_OK) != W5100_SEND_OK);
+    uint8_t flags;
     
-    if (read_byte(SOCKET_ZERO + SOCKET_INTERRUPT) & W5100_TIMEOUT)
+    while (!((flags = read_byte(SOCKET_BASE(s) + SOCKET_INTERRUPT)) &
+                                    (W5100_SEND_OK|W5100_TIMEOUT)));
+    
+    if (flags & W5100_TIMEOUT)
         Serial.println(F("send timeout"));
         
     // clear flags by writing high values as per W5100 datasheet
-    write_byte(SOCKET_ZERO + SOCKET_INTERRUPT, (W5100_SEND_OK|W5100_TIMEOUT));
+    write_byte(SOCKET_BASE(s) + SOCKET_INTERRUPT, (W5100_SEND_OK|W5100_TIMEOUT));
+    
+    if (interrupts_enabled && !deferred)
+        unmask_interrupt();
     
     Serial.print(F("sent "));
     Serial.print(size);
@@ -870,35 +585,240 @@ uint16_t WiznetTCP::send(char *buffer, uint16_t length)
     return size;
 }
 
+// Copies the data to the TX buffer and returns without waiting for it
+// to be sent. If a send is already in flight, the data is sent after
+// it completes. service() must be called from loop() and queues a
+// Network_Sent_Event_t when all the data has been sent, or else a
+// Network_Timeout_Event_t. For UDP, each call sends one datagram, so
+// 0 is returned if a send is already in flight. Returns the number
+// of bytes queued, which is less than length if the buffer is full.
+uint16_t WiznetTCP::send_async(uint8_t s, char *buffer, uint16_t length)
+{
+    uint8_t bit = 1 << s;
+    uint16_t size = 0;
+    
+    // the ISR mustn't complete the send whilst we are adding to it
+    if (interrupts_enabled)
+        mask_interrupt();
+    
+    if (!(sending & bit) ||
+        (read_byte(SOCKET_BASE(s) + SOCKET_MODE) & 0x0F) != SOCKET_UDP)
+    {
+        size = queue_data(s, buffer, length);
+        
+        // a waiting send takes all of the data in the buffer
+        if (size && (sending & bit) && !(waiting & bit))
+            pending |= bit;
+        else if (size) {
+            sending |= bit;
+            start_send(s);
+        }
+    }
+    
+    if (interrupts_enabled && !deferred)
+        unmask_interrupt();
+    
+    return size;
+}
+
+bool WiznetTCP::is_sending(uint8_t s)
+{
+    return (sending & (1 << s)) != 0;
+}
+
+// sends a keep alive packet on an idle connection, the connection
+// times out if the peer doesn't respond. The W5100 only sends these
+// once at least one byte of data has been sent on the connection.
+void WiznetTCP::keep_alive(uint8_t s)
+{
+    if (get_socket_status(s) == SOCK_ESTABLISHED) {
+        write_byte(SOCKET_BASE(s) + SOCKET_COMMAND, SOCKET_SEND_KEEP);
+        
+        // wait for command to be processed
+        while (read_byte(SOCKET_BASE(s) + SOCKET_COMMAND));
+    }
+}
+
+// copies data into the TX buffer offset bytes past the write pointer,
+// with put_data() taking care of the wrap at the end of the buffer
+void WiznetTCP::write_reserved(uint8_t s, uint16_t offset, const char *buffer, uint16_t length)
+{
+    uint16_t ptr = read_word(SOCKET_BASE(s) + SOCKET_TX_WRITE_PNTR);
+    put_data(s, ptr + offset, (uint8_t *)buffer, length);
+}
+
+// sends the first length bytes written by write_reserved() as for
+// send_async(), returns 0 if a UDP send is still in flight, in which
+// case the data stays in the buffer and commit() can be called again
+uint16_t WiznetTCP::commit(uint8_t s, uint16_t length)
+{
+    return send_async(s, NULL, length);
+}
+
+// The W5100 INT output stays low whilst any socket interrupt is set
+// and the ISR is level triggered, so it clears them as it goes. The
+// ISR can't use SPI when it interrupts an SPI transfer, in which case
+// it masks the interrupt and leaves it for service() to handle.
+
+void WiznetTCP::enable_interrupts()
+{
+    interrupt_driver = this;
+    deferred = 0;
+    
+    // enable interrupts for the 4 sockets
+    write_byte(W5100_INTR_MASK_REGISTER, 0x0F);
+    
+    pinMode(W5100_INT_PIN, INPUT);
+    attachInterrupt(digitalPinToInterrupt(W5100_INT_PIN), isr, LOW);
+    interrupts_enabled = true;
+}
+
+void WiznetTCP::isr()
+{
+    WiznetTCP *tcp = interrupt_driver;
+    
+    if (spi_busy) {
+        mask_interrupt();
+        tcp->deferred = 1;
+        return;
+    }
+    
+    tcp->handle_interrupts();
+}
+
+void WiznetTCP::handle_interrupts()
+{
+    uint8_t ir;
+    
+    while ((ir = read_byte(W5100_INTR_REGISTER) & 0x0F)) {
+        for (uint8_t s = 0; s < W5100_SOCKETS; ++s) {
+            if (ir & (1 << s))
+                handle_socket(s, 0xFF);
+        }
+    }
+}
+
+// clears the socket's interrupt flags given by mask and queues
+// the corresponding events, starting the next send if needed
+void WiznetTCP::handle_socket(uint8_t s, uint8_t mask)
+{
+    uint8_t bit = 1 << s;
+    uint8_t flags = read_byte(SOCKET_BASE(s) + SOCKET_INTERRUPT) & mask;
+    
+    if (!flags)
+        return;
+        
+    // clear flags by writing high values as per W5100 datasheet
+    write_byte(SOCKET_BASE(s) + SOCKET_INTERRUPT, flags);
+    
+    if (flags & W5100_CON && events)
+        events->enqueue(Network_Connected_Event_t, (void *)(size_t)s);
+        
+    if (flags & W5100_RECV && events)
+        events->enqueue(Network_Readable_Event_t, (void *)(size_t)s);
+        
+    if (flags & W5100_TIMEOUT) {
+        sending &= ~bit;
+        pending &= ~bit;
+        waiting &= ~bit;
+        
+        if (events)
+            events->enqueue(Network_Timeout_Event_t, (void *)(size_t)s);
+    } else if (flags & W5100_SEND_OK && sending & bit) {
+        if (pending & bit) {
+            pending &= ~bit;
+            
+            // the ISR may have interrupted the main code between writing
+            // a command for this socket, e.g. RECV, and the W5100 taking
+            // it, so the send is left for service() rather than overwrite it
+            if (read_byte(SOCKET_BASE(s) + SOCKET_COMMAND))
+                waiting |= bit;
+            else
+                start_send(s);
+        } else {
+            sending &= ~bit;
+            
+            if (events)
+                events->enqueue(Network_Sent_Event_t, (void *)(size_t)s);
+        }
+    }
+    
+    if (flags & W5100_DISCON && events)
+        events->enqueue(Network_Disconnected_Event_t, (void *)(size_t)s);
+}
+
+bool WiznetTCP::has_deferred()
+{
+    return deferred || waiting;
+}
+
+// starts the sends that handle_socket() left as the socket was busy
+void WiznetTCP::start_waiting()
+{
+    if (interrupts_enabled)
+        mask_interrupt();
+        
+    for (uint8_t s = 0; s < W5100_SOCKETS; ++s) {
+        if (waiting & (1 << s)) {
+            waiting &= ~(1 << s);
+            start_send(s);
+        }
+    }
+    
+    if (interrupts_enabled && !deferred)
+        unmask_interrupt();
+}
+
+// called from loop() to handle interrupts that the ISR left, or
+// before interrupts are enabled, to check on sends in flight
+void WiznetTCP::service()
+{
+    if (interrupts_enabled) {
+        if (deferred) {
+            deferred = 0;
+            handle_interrupts();
+            unmask_interrupt();
+        }
+    } else {
+        for (uint8_t s = 0; s < W5100_SOCKETS; ++s) {
+            if (sending & (1 << s))
+                handle_socket(s, W5100_SEND_OK|W5100_TIMEOUT);
+        }
+    }
+    
+    if (waiting)
+        start_waiting();
+}
+
 #if 0
-uint16_t WiznetTCP::send_mac(char *buffer, uint16_t length)
+uint16_t WiznetTCP::send_mac(uint8_t s, char *buffer, uint16_t length)
 {
-    uint16_t size = send_available();
+    uint16_t size = send_available(s);
     
     // send up to the available space
     if (length < size)
         size = length;
         
-    uint16_t ptr = read_word(SOCKET_ZERO + SOCKET_TX_WRITE_PNTR);
-    put_data(ptr, (uint8_t *)buffer, size);
+    uint16_t ptr = read_word(SOCKET_BASE(s) + SOCKET_TX_WRITE_PNTR);
+    put_data(s, ptr, (uint8_t *)buffer, size);
     
     // update socket's send pointer
-    write_word(SOCKET_ZERO + SOCKET_TX_WRITE_PNTR, ptr+size);
+    write_word(SOCKET_BASE(s) + SOCKET_TX_WRITE_PNTR, ptr+size);
 
     // ask W5100 to send the packet
-    write_byte(SOCKET_ZERO + SOCKET_COMMAND, SOCKET_SEND_MAC);
+    write_byte(SOCKET_BASE(s) + SOCKET_COMMAND, SOCKET_SEND_MAC);
     
     // wait for command to be processed
-    while (read_byte(SOCKET_ZERO + SOCKET_COMMAND));
+    while (read_byte(SOCKET_BASE(s) + SOCKET_COMMAND));
     
     // wait for data to be sent or for a timeout
-    while ((read_byte(SOCKET_ZERO + SOCKET_INTERRUPT) & W5100_SEND_OK) != W5100_SEND_OK);
+    while ((read_byte(SOCKET_BASE(s) + SOCKET_INTERRUPT) & W5100_SEND_OK) != W5100_SEND_OK);
     
-    if (read_byte(SOCKET_ZERO + SOCKET_INTERRUPT) & W5100_TIMEOUT)
+    if (read_byte(SOCKET_BASE(s) + SOCKET_INTERRUPT) & W5100_TIMEOUT)
         Serial.println(F("send timeout"));
         
     // clear flags by writing high values as per W5100 datasheet
-    write_byte(SOCKET_ZERO + SOCKET_INTERRUPT, (W5100_SEND_OK|W5100_TIMEOUT));
+    write_byte(SOCKET_BASE(s) + SOCKET_INTERRUPT, (W5100_SEND_OK|W5100_TIMEOUT));
     
     Serial.print(F("sent "));
     Serial.print(size);
@@ -908,56 +828,48 @@ uint16_t WiznetTCP::send_mac(char *buffer, uint16_t length)
 #endif
 
 // assumes buffer is large enough for at least size bytes
-void WiznetTCP::get_data(uint16_t ptr, uint8_t *buffer, uint16_t size)
+void WiznetTCP::get_data(uint8_t s, uint16_t ptr, uint8_t *buffer, uint16_t size)
 {
-    uint16_t mask = ptr & RX_BUFFER_MASK;
-    uint16_t i, src = BASE_RX_BUFFER + mask;
+    uint16_t mask = ptr & rx_mask[s];
+    uint16_t src = rx_base[s] + mask;
     
     // will data extend past top of RX buffer?
     
-    if (mask + size > SOCKET_SIZE) {
+    if (mask + size > rx_mask[s] + 1) {
         // data is not contiguous
         
-        uint16_t len = SOCKET_SIZE - mask;
+        uint16_t len = rx_mask[s] + 1 - mask;
         
-        for (i = 0; i < len; ++i, ++src)
-            buffer[i] = read_byte(src);
-
-        for (src = BASE_RX_BUFFER; i < size; ++i, ++src)
-            buffer[i] = read_byte(src);
+        read_block(src, buffer, len);
+        read_block(rx_base[s], buffer + len, size - len);
         
     } else {
         // data is contiguous
            
-        for (i = 0; i < size; ++i, ++src)
-            buffer[i] = read_byte(src);
+        read_block(src, buffer, size);
     }
 }
 
 // assumes that socket transmit buffer has at least size bytes free
-void WiznetTCP::put_data(uint16_t ptr, uint8_t *buffer, uint16_t size)
+void WiznetTCP::put_data(uint8_t s, uint16_t ptr, uint8_t *buffer, uint16_t size)
 {
-    uint16_t mask = ptr & TX_BUFFER_MASK;
-    uint16_t i, dst = BASE_TX_BUFFER + mask;
+    uint16_t mask = ptr & tx_mask[s];
+    uint16_t dst = tx_base[s] + mask;
     
     // will data extend past top of TX buffer?
     
-    if (size + mask > SOCKET_SIZE) {
+    if (size + mask > tx_mask[s] + 1) {
         // data is not contiguous
         
-        uint16_t len = SOCKET_SIZE - mask;
+        uint16_t len = tx_mask[s] + 1 - mask;
         
-        for (i = 0; i < len; ++i, ++dst)
-            write_byte(dst, buffer[i]);
-
-        for (dst = BASE_TX_BUFFER; i < size; ++i, ++dst)
-            write_byte(dst, buffer[i]);
+        write_block(dst, buffer, len);
+        write_block(tx_base[s], buffer + len, size - len);
         
     } else {
         // data is contiguous
            
-        for (i = 0; i < size; ++i, ++dst)
-            write_byte(dst, buffer[i]);
+        write_block(dst, buffer, size);
     }
 }
 
@@ -978,19 +890,23 @@ void WiznetTCP::spi_init()
     PORTB |= _BV(2); // set W5100 slave select high
     PORTC |= _BV(4); // activate internal pull up to disable SD Card
 
-    // no interrupt, enable SPI, MCU as master, SPI mode 0, 4 Mhz clock
+    // no interrupt, enable SPI, MCU as master, SPI mode 0, and with
+    // SPI2X an 8 Mhz clock, which is well within the W5100's limit
     SPCR = (1<<SPE)|(1<<MSTR);
+    SPSR = (1<<SPI2X);
     Serial.println(F("initialised SPI"));
 }
 
 inline static void setSS()
 {
+    spi_busy = 1;
     PORTB &= ~_BV(2);
 }
 
 inline static void resetSS()
 {
     PORTB |= _BV(2);
+    spi_busy = 0;
 }
 
 // single byte transfer via AVR's SPI hardware
@@ -1058,6 +974,60 @@ inline static void write_byte(uint16_t addr, uint8_t data)
     resetSS();
 }
 
+// The W5100 needs a 4 byte frame for each byte of data, as unlike the
+// W5500, it has no burst mode for SPI. The block transfers keep the
+// cost down to the frame itself, with no calls or nops, by loading the
+// next byte into SPDR as soon as the previous one has gone, and doing
+// the address and buffer arithmetic whilst the bytes are shifted out.
+// SS is still raised after each frame, as the W5100 requires, and the
+// ISR can use SPI between frames.
+
+#define SPI_WAIT() while (!(SPSR & (1<<SPIF)))
+
+static void read_block(uint16_t addr, uint8_t *buffer, uint16_t length)
+{
+    uint8_t hi, lo;
+    
+    while (length--) {
+        setSS();
+        SPDR = 0x0F;
+        hi = addr >> 8;
+        lo = addr & 0xFF;
+        ++addr;
+        SPI_WAIT();
+        SPDR = hi;
+        SPI_WAIT();
+        SPDR = lo;
+        SPI_WAIT();
+        SPDR = 0;
+        SPI_WAIT();
+        *buffer++ = SPDR;
+        resetSS();
+    }
+}
+
+static void write_block(uint16_t addr, uint8_t *buffer, uint16_t length)
+{
+    uint8_t hi, lo, data;
+    
+    while (length--) {
+        setSS();
+        SPDR = 0xF0;
+        hi = addr >> 8;
+        lo = addr & 0xFF;
+        data = *buffer++;
+        ++addr;
+        SPI_WAIT();
+        SPDR = hi;
+        SPI_WAIT();
+        SPDR = lo;
+        SPI_WAIT();
+        SPDR = data;
+        SPI_WAIT();
+        resetSS();
+    }
+}
+
 static uint16_t read_word(uint16_t addr)
 {
     uint16_t word = read_byte(addr) << 8;
@@ -1071,347 +1041,4 @@ static void write_word(uint16_t addr, uint16_t word)
     write_byte(addr+1, word & 255);
 }
 
-// DHCP client - ~3KB code including the debug statements
-// See http://tools.ietf.org/html/rfc2132 for details
-
-uint8_t WiznetTCP::run_DHCP_client(void)
-{
-    #define HOST_NAME	"DAVES-ARDUINO" // host name - should be loaded from EEPROM
-                                        // *** FIX ME with EEPROM config module
-    uint8_t SRC_MAC_ADDR[6];            // local MAC address
-    uint8_t GET_SN_MASK[4];				// subnet mask received from the DHCP server
-    uint8_t GET_GW_IP[4];				// gateway ip address received from the DHCP server
-    uint8_t GET_SIP[4] = {0, 0, 0, 0};	// local ip address received from the DHCP server
-    uint8_t DHCP_SIP[4] = {0, 0, 0, 0}; // DHCP server ip address is discovered
-    
-    uint32_t DHCP_XID = 0x75269875;
-    RIP_MSG* pRIPMSG;				    // pointer for the DHCP message
-    RIP_MSG RIPMSG;                     // structure definition
-    
-    uint16_t recv_msg_size;
-    uint8_t *recv_msg_end;
-    uint8_t *current_option;
-    uint8_t  option_length;
-    uint8_t host_name_length;
-    
-    uint16_t i=0;
-    uint16_t port;
-    uint32_t ip;
-    
-    Serial.println(F("running DHCP client"));
-    
-    // set local IP address to zero
-    write32(W5100_LOCAL_IP_ADDRESS, 0, 0, 0, 0);
-
-    
-    // MAC address - fixed for now but should be loaded from EEPROM
-    SRC_MAC_ADDR[0] = 0x61,
-    SRC_MAC_ADDR[1] = 0xf8,
-    SRC_MAC_ADDR[2] = 0x1d,
-    SRC_MAC_ADDR[3] = 0xbc,
-    SRC_MAC_ADDR[4] = 0xf4,
-    SRC_MAC_ADDR[5] = 0x2f;
-    write48(W5100_MAC_ADDRESS, SRC_MAC_ADDR);
-
-    // set up UDP socket for DHCP client port
-    write_word(SOCKET_ZERO + SOCKET_SRC_PORT, DHCP_CLIENT_PORT);
-    write_byte(SOCKET_ZERO + SOCKET_MODE, SOCKET_UDP);
-    write_byte(SOCKET_ZERO + SOCKET_COMMAND, SOCKET_OPEN);
-
-    // send DHCPDISCOVER
-    
-	pRIPMSG = &RIPMSG;
-	
-	memset((void*)pRIPMSG, 0, sizeof(RIP_MSG)); // zero RIPMSG contents
-
-	pRIPMSG->op = DHCP_BOOTREQUEST;
-	pRIPMSG->htype = DHCP_HTYPE10MB;
-	pRIPMSG->hlen = DHCP_HLENETHERNET;
-	pRIPMSG->hops = DHCP_HOPS;
-	pRIPMSG->xid = DHCP_XID;
-	pRIPMSG->secs = DHCP_SECS;
-	pRIPMSG->flags = DHCP_FLAGSBROADCAST;
-	pRIPMSG->chaddr[0] = SRC_MAC_ADDR[0];
-	pRIPMSG->chaddr[1] = SRC_MAC_ADDR[1];
-	pRIPMSG->chaddr[2] = SRC_MAC_ADDR[2];
-	pRIPMSG->chaddr[3] = SRC_MAC_ADDR[3];
-	pRIPMSG->chaddr[4] = SRC_MAC_ADDR[4];
-	pRIPMSG->chaddr[5] = SRC_MAC_ADDR[5];
-
-	// MAGIC_COOKIE IN NETWORK ORDER
-	pRIPMSG->options[i++] = (char)((MAGIC_COOKIE >> 24)& 0xFF);
-	pRIPMSG->options[i++] = (char)((MAGIC_COOKIE >> 16)& 0xFF);
-	pRIPMSG->options[i++] = (char)((MAGIC_COOKIE >> 8)& 0xFF);
-	pRIPMSG->options[i++] = (char)(MAGIC_COOKIE& 0xFF);
-
-	// Option Request Param.
-	pRIPMSG->options[i++] = dhcpMessageType;
-	pRIPMSG->options[i++] = 0x01;
-	pRIPMSG->options[i++] = DHCP_DISCOVER;
-
-	// Client identifier
-	pRIPMSG->options[i++] = dhcpClientIdentifier;
-	pRIPMSG->options[i++] = 0x07;
-	pRIPMSG->options[i++] = 0x01; // Ethernet (10Mb)
-	pRIPMSG->options[i++] = SRC_MAC_ADDR[0];
-	pRIPMSG->options[i++] = SRC_MAC_ADDR[1];
-	pRIPMSG->options[i++] = SRC_MAC_ADDR[2];
-	pRIPMSG->options[i++] = SRC_MAC_ADDR[3];
-	pRIPMSG->options[i++] = SRC_MAC_ADDR[4];
-	pRIPMSG->options[i++] = SRC_MAC_ADDR[5];
-	
-	// host name
-	pRIPMSG->options[i++] = hostName;
-	pRIPMSG->options[i++] = host_name_length = strlen(HOST_NAME);
-	strcpy((char*)&(pRIPMSG->options[i]),HOST_NAME);
-	i+=host_name_length;
-
-	// IP Address Lease Time request
-    pRIPMSG->options[i++] = dhcpIPaddrLeaseTime;
-    pRIPMSG->options[i++] = 4;
-    pRIPMSG->options[i++] = 0xFF;
-    pRIPMSG->options[i++] = 0xFF;
-    pRIPMSG->options[i++] = 0xFF;
-    pRIPMSG->options[i++] = 0xFF;
-    
-    // Parameter Request List
-	pRIPMSG->options[i++] = dhcpParamRequest;
-	pRIPMSG->options[i++] = 0x02;
-	pRIPMSG->options[i++] = subnetMask;
-	pRIPMSG->options[i++] = routersOnSubnet;
-	pRIPMSG->options[i++] = endOption;
-
-	// send broadcasting packet
-	Serial.println(F("send DHCP DISCOVER"));
-	set_ip(255, 255, 255, 255);
-	set_port(DHCP_SERVER_PORT);
-	
-	for (i = MAX_DHCP_RETRY; i; --i) {
-	    Serial.print(F("socket status: 0x"));
-        Serial.println(get_socket_status(), HEX);
-	    send((char *)pRIPMSG, sizeof(RIP_MSG));
-	    
-	    if (receive_available(DHCP_WAIT_TIME)) {
-	        Serial.println(F("got DHCP OFFER"));
-	        break;
-	    }
-	}
-	
-	if (i == 0) {
-	     Serial.println(F("failed to get DHCP OFFER"));
-	     return 0;
-	}
-    
-    recv_msg_size = receive((char *)pRIPMSG, sizeof(RIPMSG), &ip, &port);
-            
-    if (port==DHCP_SERVER_PORT &&
-        !memcmp(RIPMSG.chaddr, SRC_MAC_ADDR, 6) &&
-        RIPMSG.xid == DHCP_XID)
-    {
-        // Check options
-        recv_msg_end = (uint8_t *)((uint16_t)&(RIPMSG.op) + recv_msg_size);
-        current_option = (uint8_t *)((uint16_t)&(RIPMSG.op) + 240);
-        
-        while(current_option < recv_msg_end)
-        {
-            switch (*(current_option++))
-            {
-                case padOption:
-                    break;
-                        
-                case endOption:
-                    break;
-                        
-                case dhcpMessageType:
-                    current_option++;
-                    
-                    if ((*current_option++) != DHCP_OFFER)
-                        return 0;
-                                
-                    break;
-                            
-                case subnetMask:
-                    option_length = *current_option++;
-                    memcpy(GET_SN_MASK, current_option, 4);
-                    current_option += option_length;
-                    break;
-                            
-                case routersOnSubnet:
-                    option_length = *current_option++;
-                    memcpy(GET_GW_IP, current_option, 4);
-                    current_option += option_length;
-                    break;
-                            
-                case dhcpServerIdentifier:
-                    current_option++;
-                    memcpy(DHCP_SIP, current_option, 4);
-                    current_option += 4;
-                    break;
-                            
-                default:
-                    option_length = *current_option++;
-                    current_option += option_length;
-                    break;
-            }
-        }
-                
-        memcpy(GET_SIP, (RIPMSG.yiaddr), 4);
-
-    }
-    else {
-        close();
-        return 0;
-    }
-    
-    // send DHCPREQUEST
-    
-    memset((void*)pRIPMSG, 0, sizeof(RIP_MSG));
-
-    pRIPMSG->op = DHCP_BOOTREQUEST;
-    pRIPMSG->htype = DHCP_HTYPE10MB;
-    pRIPMSG->hlen = DHCP_HLENETHERNET;
-    pRIPMSG->hops = DHCP_HOPS;
-    pRIPMSG->xid = DHCP_XID;
-    pRIPMSG->secs = DHCP_SECS;
-    pRIPMSG->flags = DHCP_FLAGSBROADCAST;
-    pRIPMSG->chaddr[0] = SRC_MAC_ADDR[0];
-    pRIPMSG->chaddr[1] = SRC_MAC_ADDR[1];
-    pRIPMSG->chaddr[2] = SRC_MAC_ADDR[2];
-    pRIPMSG->chaddr[3] = SRC_MAC_ADDR[3];
-    pRIPMSG->chaddr[4] = SRC_MAC_ADDR[4];
-    pRIPMSG->chaddr[5] = SRC_MAC_ADDR[5];
-
-    i=0;
-        
-    // MAGIC_COOKIE
-    pRIPMSG->options[i++] = (char)((MAGIC_COOKIE >> 24)& 0xFF);
-    pRIPMSG->options[i++] = (char)((MAGIC_COOKIE >> 16)& 0xFF);
-    pRIPMSG->options[i++] = (char)((MAGIC_COOKIE >> 8)& 0xFF);
-    pRIPMSG->options[i++] = (char)(MAGIC_COOKIE& 0xFF);
-
-    // option request param
-    pRIPMSG->options[i++] = dhcpMessageType;
-    pRIPMSG->options[i++] = 0x01;
-    pRIPMSG->options[i++] = DHCP_REQUEST;
-
-    // client identifier
-    pRIPMSG->options[i++] = dhcpClientIdentifier;
-    pRIPMSG->options[i++] = 0x07;
-    pRIPMSG->options[i++] = 0x01;
-    pRIPMSG->options[i++] = SRC_MAC_ADDR[0];
-    pRIPMSG->options[i++] = SRC_MAC_ADDR[1];
-    pRIPMSG->options[i++] = SRC_MAC_ADDR[2];
-    pRIPMSG->options[i++] = SRC_MAC_ADDR[3];
-    pRIPMSG->options[i++] = SRC_MAC_ADDR[4];
-    pRIPMSG->options[i++] = SRC_MAC_ADDR[5];
-    
-    // request IP address
-    pRIPMSG->options[i++] = dhcpRequestedIPaddr;
-    pRIPMSG->options[i++] = 0x04;
-    pRIPMSG->options[i++] = GET_SIP[0];
-    pRIPMSG->options[i++] = GET_SIP[1];
-    pRIPMSG->options[i++] = GET_SIP[2];
-    pRIPMSG->options[i++] = GET_SIP[3];
-    
-    // server identifier
-    pRIPMSG->options[i++] = dhcpServerIdentifier;
-    pRIPMSG->options[i++] = 0x04;
-    pRIPMSG->options[i++] = DHCP_SIP[0];
-    pRIPMSG->options[i++] = DHCP_SIP[1];
-    pRIPMSG->options[i++] = DHCP_SIP[2];
-    pRIPMSG->options[i++] = DHCP_SIP[3];
-    
-    // host name
-	pRIPMSG->options[i++] = hostName;
-	pRIPMSG->options[i++] = host_name_length = strlen(HOST_NAME);
-	strcpy((char*)&(pRIPMSG->options[i]),HOST_NAME);
-	i+=host_name_length;
-    
-    // parameter request list
-    pRIPMSG->options[i++] = dhcpParamRequest;
-    pRIPMSG->options[i++] = 0x02;
-    pRIPMSG->options[i++] = subnetMask;
-    pRIPMSG->options[i++] = routersOnSubnet;
-    pRIPMSG->options[i++] = endOption;
-
-    // send broadcasting packet
-    Serial.println(F("send DHCP REQUEST"));
-	set_ip(255, 255, 255, 255);
-	set_port(DHCP_SERVER_PORT);
-	
-	for (i = MAX_DHCP_RETRY; i; --i) {
-	    send((char *)pRIPMSG, sizeof(RIP_MSG));
-	    
-	    if (receive_available(DHCP_WAIT_TIME)) {
-	        Serial.println(F("got DHCP ACK"));
-	        break;
-	    }
-	}
-	
-	if (i == 0) {
-	     Serial.println(F("failed to get DHCP ACK"));
-	     return 0;
-	}
-    
-    recv_msg_size = receive((char *)pRIPMSG, sizeof(RIPMSG), &ip, &port);
-            
-    if (port==DHCP_SERVER_PORT &&
-        !memcmp(RIPMSG.chaddr, SRC_MAC_ADDR, 6) &&
-        RIPMSG.xid == DHCP_XID) {
-        // Check options
-        recv_msg_end = (uint8_t *)((uint16_t)&(RIPMSG.op) + recv_msg_size);
-        current_option = (uint8_t *)((uint16_t)&(RIPMSG.op) + 240);
-        
-        while(current_option < recv_msg_end) {
-            switch (*(current_option++)) {
-                case padOption:
-                break;
-                        
-                case endOption:
-                    break;
-                        
-                case dhcpMessageType:
-                    current_option++;
-                    if ((*current_option++) != DHCP_ACK)
-                        return 0;
-                        
-                    break;
-                        
-                case subnetMask:
-                    option_length = *current_option++;
-                    memcpy(GET_SN_MASK, current_option, 4);
-                    current_option += option_length;
-                    break;
-                        
-                case routersOnSubnet:
-                    option_length = *current_option++;
-                    memcpy(GET_GW_IP, current_option, 4);
-                    current_option += option_length;
-                    break;
-                        
-                default:
-                    option_length = *current_option++;
-                    current_option += option_length;
-                    break;
-            }
-        }
-                
-        memcpy(GET_SIP, (RIPMSG.yiaddr), 4);
-        memcpy(DHCP_SIP, (RIPMSG.siaddr), 4);
-    }
-    else {
-        close();
-        return 0;
-    }
-    
-    // set network parameters
-    write32(W5100_GATEWAY, GET_GW_IP);        
-    write32(W5100_SUBNET_MASK, GET_SN_MASK);    
-    write32(W5100_LOCAL_IP_ADDRESS, RIPMSG.yiaddr);
-    
-    // close the socket used to talk to DHCP server
-    close();
-    
-    Serial.println(F("Got IP address via DHCP"));
-    return 1;
-}
+#endif
@@ -6,80 +6,87 @@
    
    This supports client and server connections. For server, the
    listen method waits until a client connects to the socket.
-   The server thus can only process one connection at a time.
+   Each method takes the socket number, and the TCP sockets share
+   the local port, so that several connections can be processed at
+   once. The last socket is reserved for UDP, and is kept open for
+   mDNS discovery of the gateway.
+   
+   This is the W5100 implementation of NetDriver.
 */
 
-// W5100 Socket status
-
-#define SOCK_CLOSED 0
-#define SOCK_INIT 19
-#define SOCK_LISTEN 20
-#define SOCK_SYNSENT 21
-#define SOCK_SYNRECV 22
-#define SOCK_ESTABLISHED 23
-#define SOCK_FIN_WAIT 24
-#define SOCK_CLOSING 26
-#define SOCK_TIME_WAIT 27
-#define SOCK_CLOSE_WAIT 28
-#define SOCK_LAST_ACK 29
-#define SOCK_UDP 34
-#define SOCK_IPRAW 50
-#define SOCK_MACRAW 66
-#define SOCK_PPPOE 95
+#define W5100_SOCKETS 4
 
-typedef unsigned char uint8_t;
-typedef unsigned int uint16_t;
-typedef unsigned long uint32_t;
+// the W5100 INT output is wired to this pin, which on the Ethernet
+// shield needs the INT jumper to be fitted, see enable_interrupts()
+#define W5100_INT_PIN 2
 
-class WiznetTCP
+class WiznetTCP : public NetDriver
 {
     private:
-        uint32_t gateway_ip;
-        uint16_t gateway_port;
+        uint16_t rx_base[W5100_SOCKETS];
+        uint16_t rx_mask[W5100_SOCKETS];
+        uint16_t tx_base[W5100_SOCKETS];
+        uint16_t tx_mask[W5100_SOCKETS];
+        EventQueue *events;
+        volatile uint8_t sending;  // bit per socket with a send in flight
+        volatile uint8_t pending;  // bit per socket with more data to send
+        volatile uint8_t deferred; // interrupt left for service()
+        volatile uint8_t waiting;  // bit per socket with a send left for service()
+        bool interrupts_enabled;
         
         void spi_init();
-        void get_data(uint16_t ptr, uint8_t *buffer, uint16_t length);
-        void put_data(uint16_t ptr, uint8_t *buffer, uint16_t length);
-        uint8_t run_DHCP_client(void);
-        uint8_t handle_mDNS_response(uint8_t *query);
-        uint16_t get_link(uint16_t offset);
-        uint16_t parse_name(uint16_t offset, uint8_t *buffer,
-                             uint8_t *sn, uint8_t *matched);
+        uint16_t queue_data(uint8_t s, char *buffer, uint16_t length);
+        void start_send(uint8_t s);
+        void start_waiting();
+        void handle_interrupts();
+        void handle_socket(uint8_t s, uint8_t mask);
+        static void isr();
+        void get_data(uint8_t s, uint16_t ptr, uint8_t *buffer, uint16_t length);
+        void put_data(uint8_t s, uint16_t ptr, uint8_t *buffer, uint16_t length);
         void dump_buffer(uint8_t *buffer, uint16_t length);
         
     public:
         WiznetTCP();
         ~WiznetTCP();
-        void begin(uint16_t port);
-        void begin(uint8_t n0, uint8_t n1, uint8_t n2, uint8_t n3, uint16_t port);
-        bool listen();
-        void disconnect();
-        bool connect(uint8_t n0, uint8_t n1, uint8_t n2, uint8_t n3, uint16_t port);
-        void open();
-        void close();
-        void discover_gateway();
+        uint8_t socket_count();
+        bool set_buffer_sizes(const uint8_t *rx_kb, const uint8_t *tx_kb);
+        bool has_buffers(uint8_t s);
+        void set_event_queue(EventQueue *queue);
+        void enable_interrupts();
+        void configure(const uint8_t *mac, const uint8_t *ip,
+                       const uint8_t *subnet, const uint8_t *gateway);
+        bool listen(uint8_t s);
+        void disconnect(uint8_t s);
+        bool connect(uint8_t s, uint8_t n0, uint8_t n1, uint8_t n2, uint8_t n3, uint16_t port);
+        void open(uint8_t s);
+        void open_udp(uint8_t s, uint16_t port, uint32_t group);
+        void close(uint8_t s);
         
         void print_mac_address();
         
-        uint8_t get_socket_status();
-        uint16_t send_available();
-        uint16_t send(char *buffer, uint16_t length);
-        uint16_t send_mac(char *buffer, uint16_t length);
-        uint16_t receive_available();
-        uint16_t receive_available(uint16_t ms);
-        uint16_t flush_receive();
-        uint16_t skip(uint16_t length);
-        uint16_t peek(uint16_t offset, char *buffer, uint16_t length);
-        uint16_t receive(char *buffer, uint16_t length);
-        uint16_t receive(char *buffer, uint16_t length, uint32_t *ip, uint16_t *port);
+        uint8_t get_socket_status(uint8_t s);
+        uint16_t send_available(uint8_t s);
+        uint16_t send(uint8_t s, char *buffer, uint16_t length);
+        uint16_t send_mac(uint8_t s, char *buffer, uint16_t length);
+        uint16_t send_async(uint8_t s, char *buffer, uint16_t length);
+        bool is_sending(uint8_t s);
+        void keep_alive(uint8_t s);
+        void write_reserved(uint8_t s, uint16_t offset, const char *buffer, uint16_t length);
+        uint16_t commit(uint8_t s, uint16_t length);
+        void service();
+        bool has_deferred();
+        uint16_t receive_available(uint8_t s);
+        uint16_t skip(uint8_t s, uint16_t length);
+        uint16_t peek(uint8_t s, uint16_t offset, char *buffer, uint16_t length);
+        uint16_t receive(uint8_t s, char *buffer, uint16_t length);
         
-        void set_ip(uint32_t ip);
-        void set_ip(uint8_t n0, uint8_t n1, uint8_t n2, uint8_t n3);
-        void get_ip(uint8_t *n0, uint8_t *n1, uint8_t *n2, uint8_t *n3);
+        using NetDriver::set_ip;
+        void set_ip(uint8_t s, uint32_t ip);
+        void get_ip(uint8_t s, uint8_t *n0, uint8_t *n1, uint8_t *n2, uint8_t *n3);
         void get_local_ip(uint8_t *n0, uint8_t *n1, uint8_t *n2, uint8_t *n3);
-        void set_port(uint16_t port);
-        uint16_t get_port();
-        uint16_t get_local_port();
+        void set_port(uint8_t s, uint16_t port);
+        uint16_t get_port(uint8_t s);
+        uint16_t get_local_port(uint8_t s);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,87 @@
+// Arduino compatibility header for building parts of the library
+// on a Linux or Mac host, e.g. PosixTCP and the programs in host/
+
+#ifndef _WOTF_HOST_ARDUINO
+#define _WOTF_HOST_ARDUINO
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HEX 16
+#define DEC 10
+
+// strings are in RAM on hosts, so pgm_read_byte() isn't defined
+class __FlashStringHelper;
+#define F(s) ((const __FlashStringHelper *)(s))
+
+static inline unsigned long micros()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (unsigned long)t.tv_sec * 1000000UL + t.tv_nsec / 1000;
+}
+
+static inline unsigned long millis()
+{
+    return micros() / 1000;
+}
+
+static inline void delay(unsigned long ms)
+{
+    usleep(ms * 1000);
+}
+
+static inline void delayMicroseconds(unsigned int us)
+{
+    usleep(us);
+}
+
+static inline void noInterrupts() {}
+static inline void interrupts() {}
+
+static inline long random(long n)
+{
+    return rand() % n;
+}
+
+static inline long random(long low, long high)
+{
+    return low + rand() % (high - low);
+}
+
+class HostSerial
+{
+    public:
+        void begin(long) {}
+        void flush() { fflush(stdout); }
+        size_t write(uint8_t c) { return fwrite(&c, 1, 1, stdout); }
+        size_t write(const uint8_t *p, size_t n) { return fwrite(p, 1, n, stdout); }
+
+        void print(const char *s) { fputs(s, stdout); }
+        void print(const __FlashStringHelper *s) { fputs((const char *)s, stdout); }
+        void print(char c) { putchar(c); }
+        void print(unsigned long n, int base = DEC) { printf(base == HEX ? "%lx" : "%lu", n); }
+        void print(long n, int base = DEC) { printf(base == HEX ? "%lx" : "%ld", n); }
+        void print(unsigned int n, int base = DEC) { print((unsigned long)n, base); }
+        void print(int n, int base = DEC) { print((long)n, base); }
+        void print(unsigned char n, int base = DEC) { print((unsigned long)n, base); }
+        void print(double d) { printf("%.2f", d); }
+
+        void println() { putchar('\n'); }
+        template<class T> void println(T x) { print(x); println(); }
+        template<class T> void println(T x, int base) { print(x, base); println(); }
+};
+
+// each file gets its own, which is harmless as they all write to stdout
+static HostSerial Serial __attribute__((unused));
+
+#endif
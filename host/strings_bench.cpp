@@ -0,0 +1,133 @@
+// times the bulk string operations in Strings against the byte at a
+// time loops over Strings::get_char() that they replaced
+//
+// Build and run from the top directory with:
+//
+//     g++ -O2 -Ihost -I. host/strings_bench.cpp Strings.cpp -o strings_bench
+//     ./strings_bench
+//
+// Strings are only in RAM on hosts, so this times the RAM paths, where
+// the old loops paid for a call to get_char() per byte. On the AVR,
+// the flash paths save that call too, and use the avr-libc _P routines.
+
+#include <Arduino.h>
+#include "Strings.h"
+
+#define ROUNDS 200000
+
+static volatile unsigned int sink;  // keeps the results live
+
+// the loops from before Strings had bulk operations
+
+static void old_memcpy(char *dst, const char *src, unsigned int len)
+{
+    for (unsigned int i = 0; i < len; ++i)
+        dst[i] = Strings::get_char(src + i);
+}
+
+static const char *old_find(const char *s, unsigned int len, char c)
+{
+    while (len--) {
+        if (Strings::get_char(s) == c)
+            return s;
+
+        ++s;
+    }
+
+    return 0;
+}
+
+static unsigned int old_hash(const char *s, unsigned int len)
+{
+    unsigned h = 0;
+
+    while (len--) {
+        h += (unsigned char)Strings::get_char(s++);
+        h += (h << 10);
+        h ^= (h >> 6);
+    }
+
+    h += (h << 3);
+    h ^= (h >> 11);
+    h += (h << 15);
+    return h;
+}
+
+static int old_strcmp(const char *s1, unsigned int len1,
+                      const char *s2, unsigned int len2)
+{
+    while (len1 && len2) {
+        int diff = Strings::get_char(s1++) - Strings::get_char(s2++);
+
+        if (diff)
+            return diff;
+
+        --len1;
+        --len2;
+    }
+
+    return len1 - len2;
+}
+
+static void report(const char *name, unsigned int len,
+                   unsigned long old_us, unsigned long new_us)
+{
+    double bytes = (double)ROUNDS * len;
+
+    printf("%-8s %4u bytes: old %6.2f ns/byte, new %6.2f ns/byte, %5.1fx\n",
+           name, len, old_us * 1000.0 / bytes, new_us * 1000.0 / bytes,
+           new_us ? (double)old_us / new_us : 0.0);
+}
+
+static void run(unsigned int len)
+{
+    char *a = (char *)malloc(len + 1), *b = (char *)malloc(len + 1);
+    char dst[256];
+    unsigned long start, old_us;
+
+    // a name or JSON text with the quote at the end
+    for (unsigned int i = 0; i < len; ++i)
+        a[i] = b[i] = 'a' + i % 26;
+
+    a[len - 1] = b[len - 1] = '"';
+    a[len] = b[len] = 0;
+
+    start = micros();
+    for (int r = 0; r < ROUNDS; ++r) { old_memcpy(dst, a, len); sink += dst[r % len]; }
+    old_us = micros() - start;
+    start = micros();
+    for (int r = 0; r < ROUNDS; ++r) { Strings::memcpy(dst, a, len); sink += dst[r % len]; }
+    report("memcpy", len, old_us, micros() - start);
+
+    start = micros();
+    for (int r = 0; r < ROUNDS; ++r) sink += old_find(a, len, '"') - a;
+    old_us = micros() - start;
+    start = micros();
+    for (int r = 0; r < ROUNDS; ++r) sink += Strings::find(a, len, '"') - a;
+    report("find", len, old_us, micros() - start);
+
+    start = micros();
+    for (int r = 0; r < ROUNDS; ++r) sink += old_hash(a, len);
+    old_us = micros() - start;
+    start = micros();
+    for (int r = 0; r < ROUNDS; ++r) sink += Strings::hash(a, len);
+    report("hash", len, old_us, micros() - start);
+
+    start = micros();
+    for (int r = 0; r < ROUNDS; ++r) sink += old_strcmp(a, len, b, len);
+    old_us = micros() - start;
+    start = micros();
+    for (int r = 0; r < ROUNDS; ++r) sink += Strings::strcmp(a, len, b, len);
+    report("strcmp", len, old_us, micros() - start);
+
+    free(a);
+    free(b);
+}
+
+int main()
+{
+    run(8);     // a property name
+    run(32);
+    run(256);   // a model
+    return 0;
+}
@@ -0,0 +1,311 @@
+// runs the W5100 block transfers from WiznetTCP.cpp against a simulated
+// W5100, and counts what goes over the SPI bus for each byte of data
+//
+// Build and run from the top directory with:
+//
+//     g++ -O2 -Ihost -I. host/w5100_bench.cpp -o w5100_bench
+//     ./w5100_bench
+//
+// The AVR's SPDR, SPSR and PORTB are replaced by objects that drive the
+// simulated W5100, which follows the datasheet: each byte of data needs
+// its own 4 byte frame of opcode, address and data, framed by SS, and
+// a frame of any other length is ignored. read_block() and write_block()
+// are copied from WiznetTCP.cpp, as the driver only builds for the AVR,
+// along with the byte at a time loop that they replaced. A burst, with
+// SS held low for a whole block as on the W5500, shows why every frame
+// raises SS. The counts are exact. The host can't give the AVR's cycles,
+// so the times are the SPI bus time at the 8 MHz clock set by SPI2X,
+// which is the limit for any loop, see the readme for the cycle counts.
+// The reads of SPDR show where the old loop spent its extra cycles.
+
+#include <Arduino.h>
+
+#define ROUNDS 200
+#define BLOCK 512               // bytes, e.g. a model
+#define SPI_CLOCK 8000000UL     // Hz, with SPI2X at 16 MHz
+
+#define SPIF 7
+#define _BV(b) (1 << (b))
+
+class W5100Sim
+{
+    public:
+        uint8_t memory[0x8000];
+        unsigned long spi_bytes, frames, errors, selects;
+        unsigned long reads;    // of SPDR by the loop
+
+        void select()
+        {
+            ++selects;
+            position = 0;
+        }
+
+        void deselect()
+        {
+            if (position == 4)
+                ++frames;
+            else
+                ++errors;
+        }
+
+        // the byte shifted out by the W5100 whilst c is shifted in
+        uint8_t shift(uint8_t c)
+        {
+            uint8_t out = position < 3 ? position : 0;
+
+            ++spi_bytes;
+
+            switch (position++) {
+                case 0: opcode = c; break;
+                case 1: address = c << 8; break;
+                case 2: address |= c; break;
+                case 3:
+                    if (opcode == 0xF0)
+                        memory[address & 0x7FFF] = c;
+                    else if (opcode == 0x0F)
+                        out = memory[address & 0x7FFF];
+                    break;
+                default:
+                    // not a valid frame, so the W5100 ignores it
+                    break;
+            }
+
+            return out;
+        }
+
+    private:
+        uint8_t position, opcode;
+        uint16_t address;
+};
+
+static W5100Sim w5100;
+
+// stand ins for the AVR's SPI and port registers
+
+class SpiData
+{
+    public:
+        void operator=(uint8_t c) { received = w5100.shift(c); }
+        operator uint8_t() { ++w5100.reads; return received; }
+
+    private:
+        uint8_t received;
+};
+
+class SpiStatus
+{
+    public:
+        // each transfer completes at once
+        operator uint8_t() { return _BV(SPIF); }
+};
+
+class Port
+{
+    public:
+        void operator&=(uint8_t mask)
+        {
+            if ((bits & _BV(2)) && !(mask & _BV(2)))
+                w5100.select();
+
+            bits &= mask;
+        }
+
+        void operator|=(uint8_t mask)
+        {
+            if (!(bits & _BV(2)) && (mask & _BV(2)))
+                w5100.deselect();
+
+            bits |= mask;
+        }
+
+    private:
+        uint8_t bits = _BV(2);
+};
+
+static SpiData SPDR;
+static SpiStatus SPSR;
+static Port PORTB;
+static volatile uint8_t spi_busy;
+
+// from WiznetTCP.cpp
+
+inline static void setSS()
+{
+    spi_busy = 1;
+    PORTB &= ~_BV(2);
+}
+
+inline static void resetSS()
+{
+    PORTB |= _BV(2);
+    spi_busy = 0;
+}
+
+// without the nop, which only matters for the AVR's timing
+inline static uint8_t transfer(uint8_t data)
+{
+    SPDR = data;
+    while (!(SPSR & (1<<SPIF)));
+    return SPDR;
+}
+
+inline static uint8_t read_byte(uint16_t addr)
+{
+    uint8_t data;
+
+    setSS();
+    transfer(0x0F);
+    transfer(addr >> 8);
+    transfer(addr & 0xFF);
+    data = transfer(0);
+    resetSS();
+    return data;
+}
+
+inline static void write_byte(uint16_t addr, uint8_t data)
+{
+    setSS();
+    transfer(0xF0);
+    transfer((addr >> 8) & 255);
+    transfer(addr & 255);
+    transfer(data);
+    resetSS();
+}
+
+#define SPI_WAIT() while (!(SPSR & (1<<SPIF)))
+
+static void read_block(uint16_t addr, uint8_t *buffer, uint16_t length)
+{
+    uint8_t hi, lo;
+
+    while (length--) {
+        setSS();
+        SPDR = 0x0F;
+        hi = addr >> 8;
+        lo = addr & 0xFF;
+        ++addr;
+        SPI_WAIT();
+        SPDR = hi;
+        SPI_WAIT();
+        SPDR = lo;
+        SPI_WAIT();
+        SPDR = 0;
+        SPI_WAIT();
+        *buffer++ = SPDR;
+        resetSS();
+    }
+}
+
+static void write_block(uint16_t addr, uint8_t *buffer, uint16_t length)
+{
+    uint8_t hi, lo, data;
+
+    while (length--) {
+        setSS();
+        SPDR = 0xF0;
+        hi = addr >> 8;
+        lo = addr & 0xFF;
+        data = *buffer++;
+        ++addr;
+        SPI_WAIT();
+        SPDR = hi;
+        SPI_WAIT();
+        SPDR = lo;
+        SPI_WAIT();
+        SPDR = data;
+        SPI_WAIT();
+        resetSS();
+    }
+}
+
+// the loops from before the block transfers
+
+static void old_read(uint16_t addr, uint8_t *buffer, uint16_t length)
+{
+    for (uint16_t i = 0; i < length; ++i)
+        buffer[i] = read_byte(addr + i);
+}
+
+static void old_write(uint16_t addr, uint8_t *buffer, uint16_t length)
+{
+    for (uint16_t i = 0; i < length; ++i)
+        write_byte(addr + i, buffer[i]);
+}
+
+// a W5500 style burst, which the W5100 doesn't support
+
+static void burst_read(uint16_t addr, uint8_t *buffer, uint16_t length)
+{
+    setSS();
+    transfer(0x0F);
+    transfer(addr >> 8);
+    transfer(addr & 0xFF);
+
+    while (length--)
+        *buffer++ = transfer(0);
+
+    resetSS();
+}
+
+static void burst_write(uint16_t addr, uint8_t *buffer, uint16_t length)
+{
+    setSS();
+    transfer(0xF0);
+    transfer(addr >> 8);
+    transfer(addr & 0xFF);
+
+    while (length--)
+        transfer(*buffer++);
+
+    resetSS();
+}
+
+typedef void (*Transfer)(uint16_t addr, uint8_t *buffer, uint16_t length);
+
+// an RX buffer, as get_data() reads it
+#define RX_ADDRESS 0x6000
+
+static void run(const char *name, Transfer transfer, bool writes)
+{
+    uint8_t data[BLOCK], check[BLOCK];
+    unsigned long bytes = (unsigned long)ROUNDS * BLOCK;
+    bool ok = true;
+
+    memset(&w5100, 0, sizeof(w5100));
+
+    for (int r = 0; r < ROUNDS; ++r) {
+        for (int i = 0; i < BLOCK; ++i)
+            data[i] = (uint8_t)(r * 7 + i);
+
+        if (writes) {
+            transfer(RX_ADDRESS, data, BLOCK);
+            ok = ok && !memcmp(w5100.memory + RX_ADDRESS, data, BLOCK);
+        } else {
+            memcpy(w5100.memory + RX_ADDRESS, data, BLOCK);
+            transfer(RX_ADDRESS, check, BLOCK);
+            ok = ok && !memcmp(check, data, BLOCK);
+        }
+    }
+
+    // 8 clocks for each byte on the bus
+    double us = w5100.spi_bytes * 8.0 * 1000000.0 / SPI_CLOCK / bytes;
+
+    printf("%-12s %4.2f SPI bytes, %4.2f SS cycles, %4.2f SPDR reads, "
+           "%4.2f us, %4.0f KB/s, %3lu bad frames, data %s\n",
+           name, (double)w5100.spi_bytes / bytes, (double)w5100.selects / bytes,
+           (double)w5100.reads / bytes, us, 1000.0 / us, w5100.errors,
+           ok ? "ok" : "WRONG");
+}
+
+int main()
+{
+    printf("%d blocks of %d bytes, SPI at %lu MHz, per byte of data:\n",
+           ROUNDS, BLOCK, SPI_CLOCK / 1000000);
+    run("old read", old_read, false);
+    run("read_block", read_block, false);
+    run("burst read", burst_read, false);
+    run("old write", old_write, true);
+    run("write_block", write_block, true);
+    run("burst write", burst_write, true);
+    return 0;
+}
@@ -2,14 +2,23 @@
 #include <avr/pgmspace.h>
 #include <Arduino.h>
 #include <NodePool.h>
+#include <StringPool.h>
 #include <AvlNode.h>
 #include <Names.h>
 #include <JSON.h>
 #include <MessageCoder.h>
-#include <WiznetTCP.h>
 #include <WSEvent.h>
+#include <NetDriver.h>
+#include <DHCP.h>
+#include <DnsReader.h>
+#include <Discovery.h>
+#include <Framing.h>
+#include <TxSink.h>
+#include <GatewayLink.h>
+#include <WiznetTCP.h>
 #include <WebThings.h>
 #include <Transport.h>
+#include <Idle.h>
 
 #define null 0
 
@@ -35,8 +44,18 @@ void setup_light(Thing *thing, Names *names)
 
 //Names names; // to pull in hash table
 WebThings wot; // sets up node pool
+WiznetTCP ethernet; // W5100 driver, or W5500TCP for the W5500
 Transport transport; // TCP client/server
 EventQueue event_queue; // sets up event queue
+Task monitor_task; // prints statistics
+IdleManager idle; // sleeps when there is nothing to do
+
+// W5100 buffer sizes in KB, socket 0 is the gateway link and gets
+// larger buffers for bulk transfers such as models, socket 1 serves
+// clients, as does socket 2 unless USE_DHCP is set in Transport.h, in
+// which case it is for DHCP, and socket 3 is for mDNS
+const uint8_t rx_buffer_sizes[W5100_SOCKETS] = {4, 1, 1, 2};
+const uint8_t tx_buffer_sizes[W5100_SOCKETS] = {4, 2, 1, 1};
 
 Thing *test1;
 
@@ -98,9 +117,32 @@ void setup_test(Thing *thing, Names *names)
     thing->print();
 }
 
+// prints statistics every minute, and whenever the gateways change
+uint8_t monitor(Task *task)
+{
+    TASK_BEGIN(task);
+    
+    for (;;) {
+        TASK_WAIT_EVENT(task, Gateway_Changed_Event_t, TASK_ANY_DATA, 60000);
+        
+        if (!TASK_TIMED_OUT(task))
+            Serial.println(F("gateways changed"));
+            
+        transport.print_stats();
+        event_queue.print_timer_stats();
+        event_queue.print_event_stats();
+        idle.print_stats();
+    }
+    
+    TASK_END(task);
+}
+
 void setup() {
     Serial.begin(19200);
-    transport.start();
+    ethernet.set_buffer_sizes(rx_buffer_sizes, tx_buffer_sizes);
+    transport.start(&ethernet, &event_queue);
+    idle.begin(&event_queue, &ethernet);
+    event_queue.start_task(&monitor_task, monitor, NULL);
         
  #define TEST_MODEL \
       "{\"properties\": {\"pressure\": \"bar\"}}"
@@ -113,5 +155,6 @@ void loop() {
   
     event_queue.dispatch(); // queued by interrupt services routines
     transport.serve();
+    idle.sleep(!transport.is_idle()); // until there is something to do
 }
 